@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "l4bulk.h"
+#include "prof.h"
+
+/* Sends messages of the given size with L4Bulk and reports the rate, or
+ * receives and checks them with -s.
+ */
+
+void usage( const char* name )
+{
+    fprintf( stderr, "Usage: %s <serverip> <port> <stripes> <kbytes> [<count> [<window>]]\n"
+                     "       %s -s <port> <stripes> [<count> [<busy_ms>]]\n"
+                     "       serverip - IPv4 address of the receiver in dotted decimal notation\n"
+                     "       port     - First of the receiver's ports, one per stripe\n"
+                     "       stripes  - Number of sockets and threads (1 to %d)\n"
+                     "       kbytes   - Size of each message in KB\n"
+                     "       count    - Number of messages (default 1; the receiver runs forever)\n"
+                     "       window   - Frames in flight (default %d, up to %d with 32-bit frame numbers)\n"
+                     "       busy_ms  - Time the receiver works before it takes each message\n",
+                     name, name, L4_BULK_MAX_STRIPES, L4_BULK_WINDOW, L4_BULK_WINDOW_SEQ32 );
+    exit( -1 );
+}
+
+static uint8_t pattern( uint32_t i )
+{
+    return (uint8_t)(i % 251);
+}
+
+static double now_sec( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_server( int port, int stripes, int count, int busy_ms )
+{
+    L4Bulk* bulk = l4bulk_server_create( port, stripes );
+    if( !bulk ) return -1;
+
+    for( int n=0; count == 0 || n < count; n++ )
+    {
+        // Busy elsewhere while the next message arrives; its sender must
+        // wait for the window to open
+        if( busy_ms > 0 ) usleep( busy_ms * 1000 );
+
+        uint8_t* data;
+        int len = l4bulk_recv( bulk, &data, NULL );
+        if( len <= 0 ) continue;
+
+        uint32_t bad = 0;
+        for( uint32_t i=0; i<(uint32_t)len; i++ )
+        {
+            if( data[i] != pattern( i ) ) bad++;
+        }
+        printf( "message %d: %d bytes, %u wrong\n", n, len, bad );
+        fflush( stdout );
+        free( data );
+    }
+
+    l4bulk_destroy( bulk );
+    return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+    if( argc >= 4 && strcmp( argv[1], "-s" ) == 0 )
+    {
+        if( argc > 6 ) usage( argv[0] );
+        return run_server( atoi( argv[2] ), atoi( argv[3] ), argc >= 5 ? atoi( argv[4] ) : 0,
+                           argc == 6 ? atoi( argv[5] ) : 0 );
+    }
+    if( argc < 5 || argc > 7 ) usage( argv[0] );
+
+    uint32_t len    = (uint32_t)atoi( argv[4] ) * 1024;
+    int      count  = argc >= 6 ? atoi( argv[5] ) : 1;
+    int      window = argc == 7 ? atoi( argv[6] ) : 0;
+    if( len == 0 || len > L4_BULK_MAX_MSG || count < 1 || window < 0 ) usage( argv[0] );
+
+    uint8_t* data = malloc( len );
+    if( !data ) {
+        fprintf( stderr, "Failed to allocate %u bytes\n", len );
+        return -1;
+    }
+    for( uint32_t i=0; i<len; i++ ) data[i] = pattern( i );
+
+    L4Bulk* bulk = l4bulk_create( argv[1], atoi( argv[2] ), atoi( argv[3] ) );
+    if( !bulk ) {
+        fprintf( stderr, "Failed to create client\n" );
+        return -1;
+    }
+    if( window > 0 )
+    {
+        printf( "window of %d frames\n", l4bulk_set_window( bulk, window ) );
+    }
+
+    int failed = 0;
+    for( int n=0; n<count; n++ )
+    {
+        prof_request_begin( );
+        double start = now_sec( );
+        int sent = l4bulk_send( bulk, data, len );
+        double seconds = now_sec( ) - start;
+        prof_request_end( );
+        if( sent < 0 )
+        {
+            printf( "message %d: failed\n", n );
+            failed++;
+            continue;
+        }
+        printf( "message %d: %u bytes in %.3f s, %.1f MB/s\n", n, len, seconds, len / seconds / 1e6 );
+    }
+
+    l4bulk_destroy( bulk );
+    free( data );
+    return failed ? -1 : 0;
+}
@@ -4,6 +4,7 @@
 #include <sys/select.h>
 
 #include "l2sap.h"
+#include "prof.h"
 
 static int maxi( int a, int b )
 {
@@ -33,6 +34,8 @@ int main( int argc, char *argv[] )
     {
         fprintf( stderr, "\n%s: Round %d\n\n", __FUNCTION__, i );
 
+        prof_request_begin( );
+
         char buffer[4096];
         snprintf( buffer, 1024, "message %d from client to server.", i );
 
@@ -66,6 +69,8 @@ int main( int argc, char *argv[] )
         }
     }
 
+    prof_request_end( );
+
     l2sap_destroy( l2 );
 }
 
@@ -0,0 +1,348 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#include "l2sap.h"
+
+/* Measures the cost per frame of l2sap_sendto for several payload
+ * sizes. Then it sends datagrams of 4 to 64 KB from a plain UDP socket,
+ * once copied and once with MSG_ZEROCOPY, to find the size from which
+ * pinning the pages pays off. L2 frames are far below that size, which
+ * is why L2SAP has no zero-copy path.
+ * Without a server address, everything is sent to a socket on the
+ * loopback interface that nobody reads. The kernel copies zero-copy
+ * sends on loopback ("zc copied"), so only a remote address shows the
+ * crossover.
+ *
+ * With -i, it measures the rate at which one L2SAP can send frames to
+ * another, first over UDP on loopback and then with the AF_PACKET
+ * backend on the given interface.
+ */
+
+static const int sizes[] = { 64, 256, 512, L2Payloadsize };
+
+static const int raw_sizes[] = { 4096, 8192, 16384, 32768, 65000 };
+
+/* Bytes per size of the raw sweep, at most ZC_INFLIGHT zero-copy sends
+ * not yet completed, and waits of one second without a completion
+ * before giving up.
+ */
+#define RAW_BYTES     (256L << 20)
+#define ZC_INFLIGHT   64
+#define ZC_REAP_TRIES 10
+
+static uint64_t now_ns( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void usage( const char* name )
+{
+    fprintf( stderr, "Usage: %s [<count> [<serverip> <port>]]\n"
+                     "       %s -i <interface> [<count>]\n"
+                     "       count    - Number of frames per measurement (default 100000)\n"
+                     "       serverip - IPv4 address of the receiver in dotted decimal notation\n"
+                     "       port     - The receiver's port\n"
+                     "       interface- Interface for the AF_PACKET backend, e.g. lo\n" , name, name );
+    exit( -1 );
+}
+
+static double bench_copy( L2SAP* l2, const uint8_t* payload, int len, int count )
+{
+    uint64_t start = now_ns( );
+    for( int i=0; i<count; i++ )
+    {
+        if( l2sap_sendto( l2, payload, len ) < 0 ) return -1;
+    }
+    return (double)(now_ns( ) - start) / count;
+}
+
+/* Reads the zero-copy completions from the error queue of sock,
+ * waiting up to wait_ms for the first, and adds them to *completed and
+ * the ones that the kernel copied anyway to *copied. Returns the
+ * number of completed sends.
+ */
+static int reap( int sock, int wait_ms, uint64_t* completed, uint64_t* copied )
+{
+    int count = 0;
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    // POLLERR is reported when the error queue is not empty
+    struct pollfd pfd = { sock, 0, 0 };
+    if( wait_ms > 0 && poll( &pfd, 1, wait_ms ) <= 0 ) return 0;
+
+    while( 1 )
+    {
+        uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+        struct msghdr msg;
+        memset( &msg, 0, sizeof(msg) );
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if( recvmsg( sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 ) break;
+
+        for( struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+        {
+            if( cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR ) continue;
+            struct sock_extended_err serr;
+            memcpy( &serr, CMSG_DATA(cmsg), sizeof(serr) );
+            if( serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY ) continue;
+
+            // One notification covers the sends ee_info to ee_data
+            uint32_t n = serr.ee_data - serr.ee_info + 1;
+            if( serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) *copied += n;
+            *completed += n;
+            count += n;
+        }
+    }
+#else
+    (void)sock; (void)wait_ms; (void)completed; (void)copied;
+#endif
+    return count;
+}
+
+/* Sends count datagrams of len bytes from buf with the given flags and
+ * returns the time per send in ns, or -1 on error. With MSG_ZEROCOPY it
+ * also waits until the kernel has released every send. All sends share
+ * one buffer that never changes, so there is no need to know which of
+ * them completed, only how many.
+ */
+static double bench_raw( int sock, const struct sockaddr_in* to, const uint8_t* buf, int len,
+                         int count, int flags, uint64_t* copied )
+{
+    uint64_t completed = 0;
+    int waits = 0;
+    uint64_t start = now_ns( );
+    for( int i=0; i<=count; i++ )
+    {
+        while( flags && (i == count ? completed < (uint64_t)count : i - completed >= ZC_INFLIGHT) )
+        {
+            if( reap( sock, 1000, &completed, copied ) > 0 ) continue;
+            if( ++waits < ZC_REAP_TRIES ) continue;
+            fprintf( stderr, "%s: ERROR: no zero-copy completions for %d s\n", __FUNCTION__, waits );
+            return -1;
+        }
+        if( i == count ) break;
+
+        ssize_t sent = sendto( sock, buf, len, flags, (const struct sockaddr*)to, sizeof(*to) );
+        // ENOBUFS: the socket's optmem for notifications is used up
+        if( sent < 0 && flags && errno == ENOBUFS )
+        {
+            reap( sock, 1000, &completed, copied );
+            sent = sendto( sock, buf, len, flags, (const struct sockaddr*)to, sizeof(*to) );
+        }
+        if( sent < 0 )
+        {
+            perror( "sendto" );
+            return -1;
+        }
+    }
+    return (double)(now_ns( ) - start) / count;
+}
+
+/* Sweeps raw_sizes with copied and zero-copy sends from a UDP socket. */
+static int bench_zerocopy( const struct sockaddr_in* to )
+{
+    int sock = socket( AF_INET, SOCK_DGRAM, 0 );
+    uint8_t* buf = malloc( 65536 );
+    if( sock < 0 || buf == NULL )
+    {
+        fprintf( stderr, "Failed to create the raw socket\n" );
+        free( buf );
+        if( sock >= 0 ) close( sock );
+        return -1;
+    }
+    for( int i=0; i<65536; i++ ) buf[i] = (uint8_t)i;
+
+    int zc = 0;
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    int on = 1;
+    zc = setsockopt( sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on) ) == 0;
+#endif
+    if( !zc ) printf( "MSG_ZEROCOPY is not supported here\n" );
+
+    printf( "%ld MB per size from a UDP socket\n", RAW_BYTES >> 20 );
+    printf( "%8s %14s %14s %10s\n", "bytes", "copy ns/send", "zc ns/send", "zc copied" );
+    int rc = 0;
+    for( unsigned s=0; s<sizeof(raw_sizes)/sizeof(raw_sizes[0]) && rc == 0; s++ )
+    {
+        int len = raw_sizes[s];
+        int count = (int)(RAW_BYTES / len);
+        uint64_t copied = 0;
+        double copy_ns = bench_raw( sock, to, buf, len, count, 0, &copied );
+        if( copy_ns < 0 )
+        {
+            rc = -1;
+            break;
+        }
+        if( !zc )
+        {
+            printf( "%8d %14.1f %14s %10s\n", len, copy_ns, "-", "-" );
+            continue;
+        }
+#ifdef MSG_ZEROCOPY
+        double zc_ns = bench_raw( sock, to, buf, len, count, MSG_ZEROCOPY, &copied );
+        if( zc_ns < 0 )
+        {
+            fprintf( stderr, "Zero-copy send failed\n" );
+            rc = -1;
+            break;
+        }
+        printf( "%8d %14.1f %14.1f %9.0f%%\n", len, copy_ns, zc_ns, 100.0 * copied / count );
+#endif
+    }
+    close( sock );
+    free( buf );
+    return rc;
+}
+
+/* Sends count frames from tx to rx in bursts and returns the number of
+ * frames per second that arrived. Frames that are lost are not resent.
+ * The receiver does not wait between bursts, so this measures the rate
+ * and not the latency of the backend.
+ */
+static double bench_rate( L2SAP* tx, L2SAP* rx, int count )
+{
+    const int burst = 32;
+    uint8_t payload[L2Payloadsize];
+    uint8_t buffer[L2Payloadsize];
+    memset( payload, 0x5a, sizeof(payload) );
+
+    int received = 0;
+    uint64_t start = now_ns( );
+    for( int sent=0; sent<count; )
+    {
+        int n = count - sent < burst ? count - sent : burst;
+        for( int i=0; i<n; i++ )
+        {
+            if( l2sap_sendto( tx, payload, L2Payloadsize ) < 0 ) return -1;
+        }
+        l2sap_flush( tx );
+        sent += n;
+
+        // Take what has arrived so far, and wait at the end
+        while( received < count )
+        {
+            struct timeval timeout = { 0, sent < count ? 0 : 100000 };
+            if( l2sap_recvfrom_timeout( rx, buffer, sizeof(buffer), &timeout ) <= 0 ) break;
+            received++;
+        }
+    }
+    double seconds = (now_ns( ) - start) / 1e9;
+    if( received < count )
+    {
+        printf( "  %d of %d frames lost\n", count - received, count );
+    }
+    return received / seconds;
+}
+
+static int bench_backends( const char* ifname, int count )
+{
+    // UDP between two sockets on loopback
+    L2SAP* rx = l2sap_create( "127.0.0.1", 1 );
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if( !rx || bind( rx->socket, (struct sockaddr*)&addr, sizeof(addr) ) < 0
+            || getsockname( rx->socket, (struct sockaddr*)&addr, &addrlen ) < 0 )
+    {
+        fprintf( stderr, "Failed to create the UDP receiver\n" );
+        return -1;
+    }
+    L2SAP* tx = l2sap_create( "127.0.0.1", ntohs( addr.sin_port ) );
+    if( !tx ) return -1;
+    l2sap_tune_buffers( rx, 1024, L2_DEFAULT_RTT_US, L2_DEFAULT_BANDWIDTH );
+    double udp = bench_rate( tx, rx, count );
+    l2sap_destroy( tx );
+    l2sap_destroy( rx );
+
+    // AF_PACKET rings; the addresses only tell the two L2SAPs apart
+    rx = l2sap_packet_create( ifname, "10.0.0.2", "10.0.0.1", NULL );
+    tx = l2sap_packet_create( ifname, "10.0.0.1", "10.0.0.2", NULL );
+    if( !rx || !tx )
+    {
+        fprintf( stderr, "Failed to create the AF_PACKET L2SAPs (needs CAP_NET_RAW)\n" );
+        return -1;
+    }
+    double ring = bench_rate( tx, rx, count );
+    l2sap_destroy( tx );
+    l2sap_destroy( rx );
+
+    printf( "%d frames of %d bytes\n", count, L2Framesize );
+    printf( "%-22s %12.0f frames/s\n", "UDP loopback", udp );
+    printf( "%-22s %12.0f frames/s\n", "AF_PACKET TPACKET_V3", ring );
+    return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+    if( argc >= 3 && strcmp( argv[1], "-i" ) == 0 )
+    {
+        if( argc > 4 ) usage( argv[0] );
+        int count = argc == 4 ? atoi( argv[3] ) : 100000;
+        if( count <= 0 ) usage( argv[0] );
+        return bench_backends( argv[2], count );
+    }
+
+    if( argc != 1 && argc != 2 && argc != 4 ) usage( argv[0] );
+
+    int count = argc > 1 ? atoi( argv[1] ) : 100000;
+    if( count <= 0 ) usage( argv[0] );
+
+    // Local sink that is never read
+    int sink = -1;
+    const char* ip = "127.0.0.1";
+    int port;
+    if( argc == 4 )
+    {
+        ip   = argv[2];
+        port = atoi( argv[3] );
+    }
+    else
+    {
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        memset( &addr, 0, sizeof(addr) );
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        sink = socket( AF_INET, SOCK_DGRAM, 0 );
+        if( sink < 0 || bind( sink, (struct sockaddr*)&addr, sizeof(addr) ) < 0
+                     || getsockname( sink, (struct sockaddr*)&addr, &addrlen ) < 0 )
+        {
+            perror( "Failed to create the sink socket" );
+            return -1;
+        }
+        port = ntohs( addr.sin_port );
+    }
+
+    L2SAP* l2 = l2sap_create( ip, port );
+    if( !l2 ) {
+        fprintf( stderr, "Failed to create client\n" );
+        return -1;
+    }
+
+    uint8_t payload[L2Payloadsize];
+    for( int i=0; i<L2Payloadsize; i++ ) payload[i] = (uint8_t)i;
+
+    printf( "%d frames to %s:%d\n", count, ip, port );
+    printf( "%8s %14s\n", "payload", "copy ns/frame" );
+    for( unsigned s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++ )
+    {
+        int len = sizes[s];
+        printf( "%8d %14.1f\n", len, bench_copy( l2, payload, len, count ) );
+    }
+    int rc = bench_zerocopy( &l2->peer_addr );
+
+    l2sap_destroy( l2 );
+    if( sink >= 0 ) close( sink );
+    return rc;
+}
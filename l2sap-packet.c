@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#endif
+
+#include "l2sap.h"
+#include "prof.h"
+#include "probes.h"
+
+/* AF_PACKET backend for L2SAP.
+ *
+ * Both rings are mapped into one area, the receive ring first. The
+ * receive ring is made of blocks that the kernel fills with several
+ * frames and hands over as a whole (TPACKET_V3); we give a block back
+ * when all its frames are read. The transmit ring is made of fixed-size
+ * frame slots that we fill and mark for sending; one sendto() then
+ * sends all marked slots.
+ */
+
+#ifdef __linux__
+
+/* A receive block is handed to us when it is full, or when it has been
+ * partly filled for RING_RETIRE_MS. Small blocks of about a dozen frames
+ * fill up quickly under load; the timeout is low because L4 waits for
+ * single ACKs.
+ */
+#define RING_RX_BLOCK_SIZE (1 << 14)
+#define RING_RX_BLOCKS     64
+#define RING_TX_BLOCK_SIZE (1 << 16)
+#define RING_TX_BLOCKS     8
+#define RING_FRAME_SIZE    2048
+#define RING_TX_FRAMES     (RING_TX_BLOCKS * (RING_TX_BLOCK_SIZE / RING_FRAME_SIZE))
+
+#define RING_RETIRE_MS     1
+
+/* Number of queued frames after which l2ring_sendto sends the batch
+ * without waiting for l2sap_flush or a receive.
+ */
+#define RING_TX_BATCH      64
+
+// Where the frame data starts in a transmit slot
+#define RING_TX_DATA       TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct L2Ring
+{
+    uint8_t*            map;
+    size_t              map_len;
+    uint8_t*            rx;
+    uint8_t*            tx;
+
+    uint8_t             local_mac[ETH_ALEN];
+    uint8_t             peer_mac[ETH_ALEN];
+    uint32_t            local_addr;
+
+    // Receive position: current block and next frame in it
+    unsigned            rx_block;
+    struct tpacket3_hdr* rx_pkt;
+    uint32_t            rx_left;
+
+    // Next transmit slot and the number of slots marked for sending
+    unsigned            tx_frame;
+    unsigned            tx_pending;
+};
+
+static struct tpacket_block_desc* rx_block_desc( struct L2Ring* ring, unsigned i ) {
+    return (struct tpacket_block_desc*)(ring->rx + (size_t)i * RING_RX_BLOCK_SIZE);
+}
+
+static struct tpacket3_hdr* tx_slot( struct L2Ring* ring, unsigned i ) {
+    return (struct tpacket3_hdr*)(ring->tx + (size_t)i * RING_FRAME_SIZE);
+}
+
+static int setup_ring( int fd, int opt, unsigned block_size, unsigned blocks, unsigned retire_ms ) {
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = blocks;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = blocks * (block_size / RING_FRAME_SIZE);
+    req.tp_retire_blk_tov = retire_ms;
+    return setsockopt(fd, SOL_PACKET, opt, &req, sizeof(req));
+}
+
+L2SAP* l2sap_packet_create( const char* ifname, const char* local_ip,
+                            const char* peer_ip, const uint8_t* peer_mac ) {
+    if (ifname == NULL || local_ip == NULL || peer_ip == NULL) {
+        fprintf(stderr, "%s ERROR: invalid parameters\n", __FUNCTION__);
+        return NULL;
+    }
+
+    L2SAP* client = calloc(1, sizeof(L2SAP));
+    struct L2Ring* ring = calloc(1, sizeof(struct L2Ring));
+    if (!client || !ring) {
+        fprintf(stderr, "%s ERROR: malloc failed\n", __FUNCTION__);
+        free(client);
+        free(ring);
+        return NULL;
+    }
+    client->ring = ring;
+    client->peer_addr.sin_family = AF_INET;
+    struct in_addr local;
+    if (inet_pton(AF_INET, peer_ip, &client->peer_addr.sin_addr) <= 0 ||
+        inet_pton(AF_INET, local_ip, &local) <= 0) {
+        fprintf(stderr, "%s ERROR: inet_pton failed\n", __FUNCTION__);
+        goto fail_alloc;
+    }
+    ring->local_addr = local.s_addr;
+    if (peer_mac) {
+        memcpy(ring->peer_mac, peer_mac, ETH_ALEN);
+    } else {
+        memset(ring->peer_mac, 0xff, ETH_ALEN);
+    }
+
+    client->socket = socket(AF_PACKET, SOCK_RAW, htons(L2_ETHERTYPE));
+    if (client->socket < 0) {
+        fprintf(stderr, "%s ERROR: socket failed: %s\n", __FUNCTION__, strerror(errno));
+        goto fail_alloc;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (ioctl(client->socket, SIOCGIFHWADDR, &ifr) < 0) {
+        fprintf(stderr, "%s ERROR: no interface %s\n", __FUNCTION__, ifname);
+        goto fail_socket;
+    }
+    memcpy(ring->local_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    // Our own frames are of no interest. Ignored by kernels before 4.20.
+    int on = 1;
+    setsockopt(client->socket, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+
+    int version = TPACKET_V3;
+    if (setsockopt(client->socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+        setup_ring(client->socket, PACKET_RX_RING, RING_RX_BLOCK_SIZE, RING_RX_BLOCKS, RING_RETIRE_MS) < 0 ||
+        setup_ring(client->socket, PACKET_TX_RING, RING_TX_BLOCK_SIZE, RING_TX_BLOCKS, 0) < 0) {
+        fprintf(stderr, "%s ERROR: TPACKET_V3 rings not supported: %s\n", __FUNCTION__, strerror(errno));
+        goto fail_socket;
+    }
+
+    size_t rx_len = (size_t)RING_RX_BLOCKS * RING_RX_BLOCK_SIZE;
+    ring->map_len = rx_len + (size_t)RING_TX_BLOCKS * RING_TX_BLOCK_SIZE;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED,
+                     client->socket, 0);
+    if (ring->map == MAP_FAILED) {
+        // MAP_LOCKED fails beyond RLIMIT_MEMLOCK, try again without it
+        ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, client->socket, 0);
+    }
+    if (ring->map == MAP_FAILED) {
+        fprintf(stderr, "%s ERROR: mmap failed: %s\n", __FUNCTION__, strerror(errno));
+        goto fail_socket;
+    }
+    ring->rx = ring->map;
+    ring->tx = ring->map + rx_len;
+
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(L2_ETHERTYPE);
+    sll.sll_ifindex = if_nametoindex(ifname);
+    if (bind(client->socket, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
+        fprintf(stderr, "%s ERROR: bind to %s failed\n", __FUNCTION__, ifname);
+        munmap(ring->map, ring->map_len);
+        goto fail_socket;
+    }
+
+    pthread_mutex_init(&client->peer_lock, NULL);
+    fprintf(stderr, "%s: Created L2SAP with packet socket %d on %s\n", __FUNCTION__, client->socket, ifname);
+    return client;
+
+fail_socket:
+    close(client->socket);
+fail_alloc:
+    free(ring);
+    free(client);
+    return NULL;
+}
+
+void l2ring_destroy( L2SAP* client ) {
+    struct L2Ring* ring = client->ring;
+    l2sap_flush(client);
+    munmap(ring->map, ring->map_len);
+    free(ring);
+    client->ring = NULL;
+}
+
+int l2sap_flush( L2SAP* client ) {
+    if (client == NULL || client->ring == NULL || client->ring->tx_pending == 0) return 0;
+
+    client->ring->tx_pending = 0;
+    uint64_t t0 = prof_now();
+    int rc = sendto(client->socket, NULL, 0, 0, NULL, 0);
+    prof_add(PROF_SYSCALL, t0);
+    if (rc < 0) {
+        fprintf(stderr, "%s ERROR: sendto failed: %s\n", __FUNCTION__, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int l2ring_sendto( L2SAP* client, const uint8_t* data, int len ) {
+    struct L2Ring* ring = client->ring;
+    struct tpacket3_hdr* slot = tx_slot(ring, ring->tx_frame);
+
+    // Wait until the kernel has sent what was in the slot before
+    while (slot->tp_status != TP_STATUS_AVAILABLE) {
+        if (slot->tp_status == TP_STATUS_WRONG_FORMAT) {
+            fprintf(stderr, "%s ERROR: kernel rejected a frame\n", __FUNCTION__);
+            slot->tp_status = TP_STATUS_AVAILABLE;
+            break;
+        }
+        l2sap_flush(client);
+        struct pollfd pfd = { client->socket, POLLOUT, 0 };
+        poll(&pfd, 1, 10);
+    }
+
+    uint64_t t0 = prof_now();
+    uint8_t* eth = (uint8_t*)slot + RING_TX_DATA;
+    struct ethhdr* ethhdr = (struct ethhdr*)eth;
+    memcpy(ethhdr->h_dest, ring->peer_mac, ETH_ALEN);
+    memcpy(ethhdr->h_source, ring->local_mac, ETH_ALEN);
+    ethhdr->h_proto = htons(L2_ETHERTYPE);
+
+    // dst_addr holds the whole address, see l2sap.h
+    uint8_t* frame = eth + ETH_HLEN;
+    struct L2Header* header = (struct L2Header*)frame;
+    header->dst_addr = client->peer_addr.sin_addr.s_addr;
+    header->len = htons(len + L2Headersize);
+    header->checksum = 0;
+    header->mbz = 0;
+    memcpy(frame + L2Headersize, data, len);
+    prof_add(PROF_COPY, t0);
+
+    t0 = prof_now();
+    header->checksum = l2sap_checksum(frame, len + L2Headersize);
+    prof_add(PROF_CHECKSUM, t0);
+
+    slot->tp_len = ETH_HLEN + L2Headersize + len;
+    slot->tp_next_offset = 0;
+    __sync_synchronize();
+    slot->tp_status = TP_STATUS_SEND_REQUEST;
+
+    ring->tx_frame = (ring->tx_frame + 1) % RING_TX_FRAMES;
+    __atomic_fetch_add(&client->stats.frames_sent, 1, __ATOMIC_RELAXED);
+    PROBE1(l2_frame_send, len);
+    if (++ring->tx_pending >= RING_TX_BATCH && l2sap_flush(client) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+// Gives a completely read block back to the kernel
+static void release_block( struct L2Ring* ring ) {
+    struct tpacket_block_desc* block = rx_block_desc(ring, ring->rx_block);
+    __sync_synchronize();
+    block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    ring->rx_block = (ring->rx_block + 1) % RING_RX_BLOCKS;
+    ring->rx_pkt = NULL;
+}
+
+static int64_t now_us( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Waits for the next frame until deadline_us on the CLOCK_MONOTONIC
+ * clock, or forever if it is negative. Returns NULL with errno 0 on
+ * timeout.
+ */
+static struct tpacket3_hdr* next_frame( L2SAP* client, int64_t deadline_us ) {
+    struct L2Ring* ring = client->ring;
+    while (1) {
+        if (ring->rx_pkt != NULL && ring->rx_left == 0) {
+            release_block(ring);
+        }
+        if (ring->rx_pkt == NULL) {
+            struct tpacket_block_desc* block = rx_block_desc(ring, ring->rx_block);
+            if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+                struct pollfd pfd = { client->socket, POLLIN, 0 };
+                int wait_ms = -1;
+                if (deadline_us >= 0) {
+                    int64_t left_us = deadline_us - now_us();
+                    wait_ms = left_us > 0 ? (int)((left_us + 999) / 1000) : 0;
+                }
+                uint64_t t0 = prof_now();
+                int rc = poll(&pfd, 1, wait_ms);
+                prof_add(PROF_WAIT, t0);
+                if (rc < 0 && errno != EINTR) {
+                    perror("Poll failed");
+                    return NULL;
+                }
+                if (rc == 0) {
+                    errno = 0;
+                    return NULL;
+                }
+                continue;
+            }
+            ring->rx_pkt = (struct tpacket3_hdr*)((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+            ring->rx_left = block->hdr.bh1.num_pkts;
+            if (ring->rx_left == 0) continue;
+        }
+
+        struct tpacket3_hdr* pkt = ring->rx_pkt;
+        ring->rx_left--;
+        if (ring->rx_left > 0) {
+            ring->rx_pkt = (struct tpacket3_hdr*)((uint8_t*)pkt + pkt->tp_next_offset);
+        }
+        return pkt;
+    }
+}
+
+int l2ring_recvfrom( L2SAP* client, uint8_t* data, int len,
+                     struct timeval* timeout, struct timespec* rx_time ) {
+    struct L2Ring* ring = client->ring;
+
+    // Whatever we wait for may be an answer to frames still in the ring
+    l2sap_flush(client);
+
+    // Frames for others and EINTR must not restart the timeout
+    int64_t deadline_us = -1;
+    if (timeout) {
+        deadline_us = now_us() + (int64_t)timeout->tv_sec * 1000000 + timeout->tv_usec;
+    }
+
+    while (1) {
+        struct tpacket3_hdr* pkt = next_frame(client, deadline_us);
+        if (pkt == NULL) {
+            return errno ? -1 : L2_TIMEOUT;
+        }
+
+        uint8_t* eth = (uint8_t*)pkt + pkt->tp_mac;
+        int received = (int)pkt->tp_snaplen - ETH_HLEN;
+        if (received < L2Headersize || received > L2Framesize) {
+            fprintf(stderr, "%s: ERROR: bad frame size %d\n", __FUNCTION__, received);
+            continue;
+        }
+
+        // Frames for other L2SAPs on the same interface
+        uint8_t* frame = eth + ETH_HLEN;
+        struct L2Header* header = (struct L2Header*)frame;
+        if (header->dst_addr != ring->local_addr) {
+            continue;
+        }
+
+        // Check the checksum without writing to the ring
+        uint64_t t0 = prof_now();
+        uint8_t calculated_checksum = l2sap_checksum(frame, received) ^ header->checksum;
+        prof_add(PROF_CHECKSUM, t0);
+        if (header->checksum != calculated_checksum) {
+            client->stats.checksum_errors++;
+            PROBE2(l2_checksum_fail, header->checksum, calculated_checksum);
+            fprintf(stderr, "%s: ERROR: L2 Frame received with incorrect checksum %d, expecting %d. Discarding frame.\n", __FUNCTION__, header->checksum, calculated_checksum);
+            return -1;
+        }
+
+        uint16_t payload_len = ntohs(header->len) - L2Headersize;
+        if (payload_len > len || payload_len > received - L2Headersize) {
+            fprintf(stderr, "%s: ERROR: payload too large\n", __FUNCTION__);
+            return -1;
+        }
+        t0 = prof_now();
+        memcpy(data, frame + L2Headersize, payload_len);
+        prof_add(PROF_COPY, t0);
+        if (rx_time != NULL) {
+            rx_time->tv_sec = pkt->tp_sec;
+            rx_time->tv_nsec = pkt->tp_nsec;
+        }
+        client->stats.frames_received++;
+        PROBE1(l2_frame_recv, payload_len);
+        return payload_len;
+    }
+}
+
+#else
+
+L2SAP* l2sap_packet_create( const char* ifname, const char* local_ip,
+                            const char* peer_ip, const uint8_t* peer_mac ) {
+    (void)ifname; (void)local_ip; (void)peer_ip; (void)peer_mac;
+    fprintf(stderr, "%s: ERROR: AF_PACKET is not supported on this system\n", __FUNCTION__);
+    return NULL;
+}
+
+int l2sap_flush( L2SAP* client ) {
+    (void)client;
+    return 0;
+}
+
+int l2ring_sendto( L2SAP* client, const uint8_t* data, int len ) {
+    (void)client; (void)data; (void)len;
+    return -1;
+}
+
+int l2ring_recvfrom( L2SAP* client, uint8_t* data, int len,
+                     struct timeval* timeout, struct timespec* rx_time ) {
+    (void)client; (void)data; (void)len; (void)timeout; (void)rx_time;
+    return -1;
+}
+
+void l2ring_destroy( L2SAP* client ) {
+    (void)client;
+}
+
+#endif
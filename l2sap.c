@@ -5,13 +5,31 @@
 #include <arpa/inet.h>
 
 #include "l2sap.h"
+#include "prof.h"
+#include "probes.h"
+
+/* The drop counter, kernel timestamps and forced buffer sizes are Linux
+ * socket options. Elsewhere setsockopt fails for them and the features
+ * are off.
+ */
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL     -1
+#endif
+#ifndef SO_TIMESTAMPNS
+#define SO_TIMESTAMPNS  -1
+#define SCM_TIMESTAMPNS -1
+#endif
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE  SO_RCVBUF
+#define SO_SNDBUFFORCE  SO_SNDBUF
+#endif
 
 
-/* compute_checksum is a helper function for l2_sendto and
+/* l2sap_checksum is a helper function for l2_sendto and
  * l2_recvfrom_timeout to compute the 1-byte checksum both
  * on sending and receiving and L2 frame.
  */
-static uint8_t compute_checksum( const uint8_t* frame, int len ) {
+uint8_t l2sap_checksum( const uint8_t* frame, int len ) {
     uint8_t checksum = 0;
     for (int i = 0; i < len; i++) {
         checksum ^= frame[i]; // XOR all bytes except the checksum field
@@ -19,6 +37,94 @@ static uint8_t compute_checksum( const uint8_t* frame, int len ) {
     return checksum;
 }
 
+// Reads the effective socket buffer sizes into the statistics
+static void read_buffer_sizes( L2SAP* client ) {
+    socklen_t optlen = sizeof(int);
+    getsockopt(client->socket, SOL_SOCKET, SO_RCVBUF, &client->stats.rcvbuf, &optlen);
+    optlen = sizeof(int);
+    getsockopt(client->socket, SOL_SOCKET, SO_SNDBUF, &client->stats.sndbuf, &optlen);
+}
+
+/* Sets one socket buffer to at least wanted bytes. The kernel doubles
+ * the value that is set to account for its own overhead and reports the
+ * doubled value, so half is requested. If net.core.rmem_max/wmem_max is
+ * too small, the FORCE variant is tried, which only works with
+ * CAP_NET_ADMIN.
+ */
+static int grow_buffer( L2SAP* client, int opt, int force_opt, int current, int wanted ) {
+    if (current >= wanted) return 0;
+    int half = wanted / 2;
+    setsockopt(client->socket, SOL_SOCKET, opt, &half, sizeof(half));
+
+    int effective = 0;
+    socklen_t optlen = sizeof(effective);
+    getsockopt(client->socket, SOL_SOCKET, opt, &effective, &optlen);
+    if (effective >= wanted) return 0;
+
+    setsockopt(client->socket, SOL_SOCKET, force_opt, &half, sizeof(half));
+    optlen = sizeof(effective);
+    getsockopt(client->socket, SOL_SOCKET, opt, &effective, &optlen);
+    return effective >= wanted ? 0 : -1;
+}
+
+int l2sap_tune_buffers( L2SAP* client, int window_frames, int rtt_us, long bandwidth_bps ) {
+    if (client == NULL || client->socket < 0 || window_frames < 1 || rtt_us < 0 || bandwidth_bps < 0) {
+        fprintf(stderr, "%s ERROR: invalid parameters\n", __FUNCTION__);
+        return -1;
+    }
+
+    // Frames in flight: the larger of the window and the bandwidth-delay product
+    long long bdp_bytes = (long long)bandwidth_bps / 8 * rtt_us / 1000000;
+    long long frames = (bdp_bytes + L2Framesize - 1) / L2Framesize;
+    if (frames < window_frames) frames = window_frames;
+    long long wanted = frames * L2_FRAME_TRUESIZE;
+    if (wanted > INT32_MAX) wanted = INT32_MAX;
+
+    read_buffer_sizes(client);
+    int rc = grow_buffer(client, SO_RCVBUF, SO_RCVBUFFORCE, client->stats.rcvbuf, (int)wanted);
+    rc |= grow_buffer(client, SO_SNDBUF, SO_SNDBUFFORCE, client->stats.sndbuf, (int)wanted);
+    read_buffer_sizes(client);
+
+    fprintf(stderr, "%s: %lld frames in flight need %lld bytes, rcvbuf %d, sndbuf %d\n",
+            __FUNCTION__, frames, wanted, client->stats.rcvbuf, client->stats.sndbuf);
+    if (rc) {
+        fprintf(stderr, "%s: WARNING: buffers limited by net.core.rmem_max/wmem_max\n", __FUNCTION__);
+    }
+    return rc ? -1 : 0;
+}
+
+void l2sap_print_stats( const L2SAP* client, FILE* out ) {
+    if (client == NULL) return;
+    fprintf(out, "L2SAP socket %d: %" PRIu64 " frames sent, %" PRIu64 " received, "
+                 "%" PRIu64 " checksum errors, %u kernel drops, rcvbuf %d, sndbuf %d\n",
+            client->socket, client->stats.frames_sent, client->stats.frames_received,
+            client->stats.checksum_errors, client->stats.kernel_drops,
+            client->stats.rcvbuf, client->stats.sndbuf);
+}
+
+// Sets the socket options that every UDP L2SAP uses
+static void setup_socket( L2SAP* client ) {
+    // Ask the kernel to report how many frames it dropped on this socket
+    int on = 1;
+    if (setsockopt(client->socket, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+        fprintf(stderr, "%s: WARNING: SO_RXQ_OVFL not supported, no drop counts\n", __FUNCTION__);
+    }
+    // Ask for the arrival time of every frame, for RTT measurements
+    if (setsockopt(client->socket, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        fprintf(stderr, "%s: WARNING: SO_TIMESTAMPNS not supported, using user-space time\n", __FUNCTION__);
+    }
+    l2sap_tune_buffers(client, 1, L2_DEFAULT_RTT_US, L2_DEFAULT_BANDWIDTH);
+    pthread_mutex_init(&client->peer_lock, NULL);
+}
+
+// The receiving thread of a server L2SAP may change peer_addr meanwhile
+static struct sockaddr_in get_peer( L2SAP* client ) {
+    pthread_mutex_lock(&client->peer_lock);
+    struct sockaddr_in peer = client->peer_addr;
+    pthread_mutex_unlock(&client->peer_lock);
+    return peer;
+}
+
 // Initializes and configures a UDP socket and stores it in a L2SAP structure
 L2SAP* l2sap_create( const char* server_ip, int server_port ) {
     // Allocate memory for the L2SAP structure
@@ -50,13 +156,110 @@ L2SAP* l2sap_create( const char* server_ip, int server_port ) {
         free(client);
         return NULL;
     }
+    setup_socket(client);
+
     fprintf(stderr, "%s: Created L2SAP with socket %d\n", __FUNCTION__, client->socket);
     return client;
 }
 
+// Binds a UDP socket to the given port on all interfaces
+L2SAP* l2sap_server_create( int port ) {
+    L2SAP* server = (L2SAP*)malloc(sizeof(L2SAP));
+    if (!server) {
+        fprintf(stderr, "%s ERROR: malloc failed\n", __FUNCTION__);
+        return NULL;
+    }
+    memset(server, 0, sizeof(L2SAP));
+    server->server = 1;
+
+    server->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server->socket < 0) {
+        fprintf(stderr, "%s ERROR: socket failed\n", __FUNCTION__);
+        free(server);
+        return NULL;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(server->socket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "%s ERROR: bind to port %d failed\n", __FUNCTION__, port);
+        close(server->socket);
+        free(server);
+        return NULL;
+    }
+    setup_socket(server);
+
+    fprintf(stderr, "%s: Created L2SAP with socket %d on port %d\n", __FUNCTION__, server->socket, port);
+    return server;
+}
+
+// Sends to the group over the interface with address if_ip, and joins it
+L2SAP* l2sap_mcast_create( const char* group_ip, int port, const char* if_ip, int join ) {
+    L2SAP* client = (L2SAP*)malloc(sizeof(L2SAP));
+    if (!client) {
+        fprintf(stderr, "%s ERROR: malloc failed\n", __FUNCTION__);
+        return NULL;
+    }
+    memset(client, 0, sizeof(L2SAP));
+
+    struct ip_mreq mreq;
+    client->peer_addr.sin_family = AF_INET;
+    client->peer_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, group_ip, &client->peer_addr.sin_addr) <= 0 ||
+        !IN_MULTICAST(ntohl(client->peer_addr.sin_addr.s_addr)) ||
+        inet_pton(AF_INET, if_ip, &mreq.imr_interface) <= 0) {
+        fprintf(stderr, "%s ERROR: invalid group or interface address\n", __FUNCTION__);
+        free(client);
+        return NULL;
+    }
+    mreq.imr_multiaddr = client->peer_addr.sin_addr;
+
+    client->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (client->socket < 0) {
+        fprintf(stderr, "%s ERROR: socket failed\n", __FUNCTION__);
+        free(client);
+        return NULL;
+    }
+
+    // All members on this host bind the same port
+    int on = 1;
+    unsigned char loop = 1;
+    unsigned char ttl = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if ((join && (setsockopt(client->socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+                  bind(client->socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+                  setsockopt(client->socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)) ||
+        setsockopt(client->socket, IPPROTO_IP, IP_MULTICAST_IF, &mreq.imr_interface, sizeof(mreq.imr_interface)) < 0 ||
+        setsockopt(client->socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+        setsockopt(client->socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+        fprintf(stderr, "%s ERROR: joining %s:%d on %s failed\n", __FUNCTION__, group_ip, port, if_ip);
+        close(client->socket);
+        free(client);
+        return NULL;
+    }
+    // Members answer the sender of the group's frames
+    client->server = join;
+    setup_socket(client);
+
+    fprintf(stderr, "%s: Created L2SAP with socket %d in group %s:%d\n", __FUNCTION__, client->socket, group_ip, port);
+    return client;
+}
+
 // Closes socket and frees memory associated with L2SAP
 void l2sap_destroy(L2SAP* client) {
     if (client != NULL){
+        l2sap_print_stats(client, stderr);
+        if (client->ring) {
+            l2ring_destroy(client);
+        }
+        pthread_mutex_destroy(&client->peer_lock);
         if (client-> socket >= 0){
             close(client->socket); // Properly close the socket
         }
@@ -95,33 +298,43 @@ int l2sap_sendto( L2SAP* client, const uint8_t* data, int len ) {
         fprintf(stderr, "%s ERROR: frame too large\n", __FUNCTION__);
         return -1;
     }
+    if (client->ring) {
+        return l2ring_sendto(client, data, len);
+    }
 
     // Allocate and zero the buffer that will hold the full frame
     uint8_t frame[L2Framesize];
+    struct sockaddr_in peer = get_peer(client);
+    uint64_t t0 = prof_now();
     memset(frame, 0, L2Framesize);
    
     // Fill in the L2 header
     struct L2Header* header= (struct L2Header*)frame;
-    header->dst_addr = htons(client->peer_addr.sin_addr.s_addr);
+    header->dst_addr = htons(peer.sin_addr.s_addr);
     header->len = htons(len + L2Headersize);  // Set total length in host byte order
     header->checksum = 0; 
     header->mbz = 0;  
     
     // Copy the payload data into the frame after the header
     memcpy(frame + L2Headersize, data, len);
+    prof_add(PROF_COPY, t0);
 
     // Compute the checksum
-    header->checksum = compute_checksum(frame, len + L2Headersize);
+    t0 = prof_now();
+    header->checksum = l2sap_checksum(frame, len + L2Headersize);
+    prof_add(PROF_CHECKSUM, t0);
     
     // Send the frame to the remote peer
+    t0 = prof_now();
     int sent_udpbytes = sendto(client->socket, frame, len + L2Headersize, 0,
-                    (struct sockaddr*)&client->peer_addr, sizeof(client->peer_addr));
+                    (struct sockaddr*)&peer, sizeof(peer));
+    prof_add(PROF_SYSCALL, t0);
     if (sent_udpbytes < 0){
         fprintf(stderr, "%s ERROR: sendto failed\n", __FUNCTION__);
         return -1;
     }
-
-    fprintf(stderr, "%s successful sendto\n", __FUNCTION__);
+    __atomic_fetch_add(&client->stats.frames_sent, 1, __ATOMIC_RELAXED);
+    PROBE1(l2_frame_send, len);
     return len;
 }
 
@@ -150,12 +363,42 @@ int l2sap_recvfrom( L2SAP* client, uint8_t* data, int len ) {
  */
 // Recieves an L2 frame and extracts the payload from it
 int l2sap_recvfrom_timeout( L2SAP* client, uint8_t* data, int len, struct timeval* timeout ) {
-    // Parameter validation
-    if (!client || !data || len <= 0) {
-        fprintf(stderr, "%s ERROR: invalid parameters\n", __FUNCTION__);
-        return -1;
+    return l2sap_recvfrom_timeout_ts( client, data, len, timeout, NULL );
+}
+
+// Copies a payload of payload_len bytes, the first head_len to head
+static void copy_split( const uint8_t* payload, int payload_len, uint8_t* head, int head_len, uint8_t* data ) {
+    uint64_t t0 = prof_now();
+    int n = payload_len < head_len ? payload_len : head_len;
+    if (n > 0) memcpy(head, payload, n);
+    if (payload_len > n) memcpy(data, payload + n, payload_len - n);
+    prof_add(PROF_COPY, t0);
+}
+
+/* Receives a frame and copies the first head_len bytes of its payload
+ * to head and the rest, up to len bytes, to data.
+ */
+static int recv_split( L2SAP* client, uint8_t* head, int head_len, uint8_t* data, int len,
+                       struct timeval* timeout, struct timespec* rx_time ) {
+    if (client->ring) {
+        if (head_len == 0) {
+            return l2ring_recvfrom(client, data, len, timeout, rx_time);
+        }
+        uint8_t payload[L2Payloadsize];
+        int payload_len = l2ring_recvfrom(client, payload, sizeof(payload), timeout, rx_time);
+        if (payload_len <= 0) return payload_len;
+        if (payload_len > head_len + len) {
+            fprintf(stderr, "%s: ERROR: payload too large\n", __FUNCTION__);
+            return -1;
+        }
+        copy_split(payload, payload_len, head, head_len, data);
+        return payload_len;
     }
 
+    struct sockaddr_in sender_addr;
+    uint8_t frame[L2Framesize];
+    uint8_t control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct timespec))];
+
     // Set up a file descriptor set for select()
     fd_set readfds;
     FD_ZERO(&readfds);                  // Zero out the set
@@ -163,7 +406,10 @@ int l2sap_recvfrom_timeout( L2SAP* client, uint8_t* data, int len, struct timeva
 
     // Wait for data to be available (blocking or with timeout)
     int select_result;
-    if ((select_result = select(client->socket + 1, &readfds, NULL, NULL, timeout)) < 0) {
+    uint64_t t0 = prof_now();
+    select_result = select(client->socket + 1, &readfds, NULL, NULL, timeout);
+    prof_add(PROF_WAIT, t0);
+    if (select_result < 0) {
         perror("Select failed");
         return -1;
     }
@@ -172,18 +418,49 @@ int l2sap_recvfrom_timeout( L2SAP* client, uint8_t* data, int len, struct timeva
     }
 
     // Allocate a buffer to recieve the full frame
-    struct sockaddr_in sender_addr;
-    socklen_t addr_len = sizeof(sender_addr);
-    uint8_t frame[L2Framesize];
+    t0 = prof_now();
     memset(frame, 0, L2Framesize);
+    prof_add(PROF_COPY, t0);
+
+    // recvmsg instead of recvfrom to get the drop counter and the
+    // arrival time as ancillary data
+    struct iovec iov = { frame, L2Framesize };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sender_addr;
+    msg.msg_namelen = sizeof(sender_addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    t0 = prof_now();
+    int received = recvmsg(client->socket, &msg, 0);
+    prof_add(PROF_SYSCALL, t0);
 
-    int received = recvfrom(client->socket, frame, L2Framesize, 0,
-                              (struct sockaddr*)&sender_addr, &addr_len);
-    
     if (received < 0) {
-        fprintf( stderr, "%s: ERROR: recvfrom failed\n", __FUNCTION__ );
+        fprintf( stderr, "%s: ERROR: recvmsg failed\n", __FUNCTION__ );
         return -1;
     }
+
+    // A truncated control buffer may end in half a message, so then
+    // neither the drop counter nor the arrival time is used
+    int have_timestamp = 0;
+    if (!(msg.msg_flags & MSG_CTRUNC)) {
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET) continue;
+            if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+                memcpy(&client->stats.kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+            } else if (cmsg->cmsg_type == SCM_TIMESTAMPNS && rx_time != NULL) {
+                memcpy(rx_time, CMSG_DATA(cmsg), sizeof(struct timespec));
+                have_timestamp = 1;
+            }
+        }
+    }
+    if (rx_time != NULL && !have_timestamp) {
+        clock_gettime(CLOCK_REALTIME, rx_time);
+    }
+
     if(received < L2Headersize){
         fprintf( stderr, "%s: ERROR: frame too small\n", __FUNCTION__ );
         return -1;
@@ -193,20 +470,53 @@ int l2sap_recvfrom_timeout( L2SAP* client, uint8_t* data, int len, struct timeva
     struct L2Header* header = (struct L2Header*)frame;
     uint8_t received_checksum = header->checksum;
     header->checksum = 0;
-    uint8_t calculated_checksum = compute_checksum(frame, received);
+    t0 = prof_now();
+    uint8_t calculated_checksum = l2sap_checksum(frame, received);
+    prof_add(PROF_CHECKSUM, t0);
     
     // Check if the checksum is correct
     if (received_checksum != calculated_checksum) {
+        client->stats.checksum_errors++;
+        PROBE2(l2_checksum_fail, received_checksum, calculated_checksum);
         fprintf(stderr, "%s: ERROR: L2 Frame received with incorrect checksum %d, expecting %d. Discarding frame.\n", __FUNCTION__, received_checksum, calculated_checksum);
         return -1;
     }
 
-    // Copy the payload to the provided buffer
+    // Copy the payload to the provided buffers
     uint16_t payload_len = ntohs(header->len) - L2Headersize;
-    if (payload_len > len) {
+    if (payload_len > head_len + len) {
         fprintf(stderr, "%s: ERROR: payload too large\n", __FUNCTION__);
         return -1;
     }
-    memcpy(data, frame + L2Headersize, payload_len);
+
+    // A server answers whoever sent the last valid frame. Only this
+    // thread writes peer_addr, so it can compare without the lock.
+    if (client->server && memcmp(&client->peer_addr, &sender_addr, sizeof(sender_addr)) != 0) {
+        pthread_mutex_lock(&client->peer_lock);
+        client->peer_addr = sender_addr;
+        pthread_mutex_unlock(&client->peer_lock);
+    }
+    copy_split(frame + L2Headersize, payload_len, head, head_len, data);
+    client->stats.frames_received++;
+    PROBE1(l2_frame_recv, payload_len);
     return payload_len;
+}
+
+int l2sap_recvfrom_timeout_ts( L2SAP* client, uint8_t* data, int len,
+                               struct timeval* timeout, struct timespec* rx_time ) {
+    // Parameter validation
+    if (!client || !data || len <= 0) {
+        fprintf(stderr, "%s ERROR: invalid parameters\n", __FUNCTION__);
+        return -1;
+    }
+    return recv_split(client, NULL, 0, data, len, timeout, rx_time);
+}
+
+int l2sap_recvfrom_split( L2SAP* client, uint8_t* head, int head_len, uint8_t* data, int len,
+                          struct timeval* timeout, struct timespec* rx_time ) {
+    if (!client || !head || head_len <= 0 || !data || len <= 0) {
+        fprintf(stderr, "%s ERROR: invalid parameters\n", __FUNCTION__);
+        return -1;
+    }
+    return recv_split(client, head, head_len, data, len, timeout, rx_time);
 }
\ No newline at end of file
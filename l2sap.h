@@ -2,10 +2,13 @@
 #define L2SAP_H
 
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <time.h>
 
 /* This is the maximum size of a frame in bytes.
  * Frames that are sent over our emulated network can never
@@ -18,6 +21,24 @@
 
 #define L2_TIMEOUT    0
 
+/* Assumptions for sizing the socket buffers when the caller does not
+ * know better: 100 Mbit/s and 10 ms RTT.
+ */
+#define L2_DEFAULT_BANDWIDTH  100000000L
+#define L2_DEFAULT_RTT_US     10000
+
+/* Memory that the kernel charges against the socket buffer for one
+ * queued frame of L2Framesize bytes, including the sk_buff and its
+ * allocation overhead (truesize). Small datagrams cost a lot more
+ * than their length.
+ */
+#define L2_FRAME_TRUESIZE     2304
+
+/* EtherType of L2 frames that are sent over a raw link with the
+ * AF_PACKET backend. 0x88B5 is reserved for local experiments.
+ */
+#define L2_ETHERTYPE          0x88B5
+
 typedef struct L2Header L2Header;
 
 struct L2Header
@@ -58,15 +79,70 @@ struct L2Header
     uint8_t  mbz;
 };
 
+typedef struct L2Stats L2Stats;
+
+/* frames_sent is counted atomically, because several threads may send
+ * over one L2SAP; the other counters belong to the receiving thread.
+ */
+struct L2Stats
+{
+    uint64_t frames_sent;
+    uint64_t frames_received;
+    uint64_t checksum_errors;
+
+    /* Frames that the kernel dropped because the receive buffer of
+     * this socket was full (SO_RXQ_OVFL). The kernel attaches the
+     * count to every frame it queues, so drops become visible with
+     * the first frame that arrives after them.
+     */
+    uint32_t kernel_drops;
+
+    /* Socket buffer sizes in bytes, as reported by the kernel. */
+    int      rcvbuf;
+    int      sndbuf;
+};
+
 typedef struct L2SAP L2SAP;
 
 struct L2SAP
 {
     int                socket;
     struct sockaddr_in peer_addr;
+    L2Stats            stats;
+
+    /* Set for l2sap_server_create: peer_addr is then the sender of the
+     * last frame that was received with a valid length and checksum.
+     */
+    int                server;
+
+    /* Taken by senders to copy peer_addr and by the receiver to change
+     * it, so that a server L2SAP can receive in one thread and send in
+     * others.
+     */
+    pthread_mutex_t    peer_lock;
+
+    /* Memory-mapped AF_PACKET rings (l2sap-packet.c), or NULL when
+     * frames are sent over UDP.
+     */
+    struct L2Ring*     ring;
 };
 
-struct L2SAP* l2sap_server_create( int port );
+/* Create an L2SAP that is bound to the given UDP port on all interfaces.
+ * It sends to the peer from which it received the last frame, so it
+ * cannot send before it has received.
+ */
+L2SAP* l2sap_server_create( int port );
+
+/* Create an L2SAP that sends to the IPv4 multicast group group_ip and
+ * port over the interface with the address if_ip, e.g. 127.0.0.1 for
+ * loopback. Members on this host receive the frames as well, and they
+ * stay on the local network (TTL 1).
+ * With join set, the L2SAP is a member of the group, receives on the
+ * port, and, like a server L2SAP, sends to the sender of the last
+ * frame that it received. Without it, it receives what is sent to its
+ * own port, e.g. replies from the members.
+ */
+L2SAP* l2sap_mcast_create( const char* group_ip, int port, const char* if_ip, int join );
 
 L2SAP* l2sap_create( const char* server_ip, int server_port );
 void l2sap_destroy( L2SAP* client );
@@ -74,5 +150,64 @@ int  l2sap_sendto( L2SAP* client, const uint8_t* data, int len );
 int  l2sap_recvfrom_timeout( L2SAP* client, uint8_t* data, int len, struct timeval* timeout );
 int  l2sap_recvfrom( L2SAP* client, uint8_t* data, int len );
 
+/* Like l2sap_recvfrom_timeout, and stores the time at which the frame
+ * arrived in the kernel (SO_TIMESTAMPNS, CLOCK_REALTIME) in rx_time.
+ * That time does not include the delay until select wakes up and the
+ * process is scheduled. If the kernel did not provide a timestamp, the
+ * time after recvmsg is used. rx_time may be NULL.
+ */
+int  l2sap_recvfrom_timeout_ts( L2SAP* client, uint8_t* data, int len,
+                                struct timeval* timeout, struct timespec* rx_time );
+
+/* Like l2sap_recvfrom_timeout_ts, but the first head_len bytes of the
+ * payload go to head and the rest to data, so that an upper layer can
+ * keep its header and hand the rest to its caller without another copy.
+ * It returns the payload length, which may be below head_len, and -1 if
+ * the rest is longer than len.
+ */
+int  l2sap_recvfrom_split( L2SAP* client, uint8_t* head, int head_len, uint8_t* data, int len,
+                           struct timeval* timeout, struct timespec* rx_time );
+
+/* Grow SO_RCVBUF and SO_SNDBUF so that they can hold a whole window of
+ * window_frames frames and the bandwidth-delay product of a path with
+ * the given RTT and bandwidth. Buffers are never shrunk below the
+ * system default. Returns 0, or -1 if the kernel limit (net.core.rmem_max
+ * or wmem_max) kept a buffer below the wanted size.
+ */
+int  l2sap_tune_buffers( L2SAP* client, int window_frames, int rtt_us, long bandwidth_bps );
+
+/* Raw link-layer backend (Linux only). Frames are carried in Ethernet
+ * frames with EtherType L2_ETHERTYPE over the interface ifname, e.g.
+ * "lo" or one end of a veth pair, and sent and received through
+ * TPACKET_V3 rings that are shared with the kernel. Receiving needs no
+ * system call while the ring holds frames, and sent frames are queued
+ * in the ring and handed to the kernel in batches.
+ *
+ * local_ip and peer_ip are only used as addresses in dst_addr of the
+ * L2Header, which holds all four bytes here; frames for other addresses
+ * are ignored, which lets several L2SAPs share one interface. peer_mac
+ * may be NULL to broadcast.
+ *
+ * Needs CAP_NET_RAW. All other l2sap functions work on the result,
+ * except l2sap_tune_buffers (the ring size is fixed).
+ */
+L2SAP* l2sap_packet_create( const char* ifname, const char* local_ip,
+                            const char* peer_ip, const uint8_t* peer_mac );
+
+/* Hand the frames that are queued in the transmit ring to the kernel.
+ * Receiving does this implicitly. Does nothing for UDP.
+ */
+int  l2sap_flush( L2SAP* client );
+
+/* Used by l2sap.c to call into the AF_PACKET backend. */
+int  l2ring_sendto( L2SAP* client, const uint8_t* data, int len );
+int  l2ring_recvfrom( L2SAP* client, uint8_t* data, int len,
+                      struct timeval* timeout, struct timespec* rx_time );
+void l2ring_destroy( L2SAP* client );
+uint8_t l2sap_checksum( const uint8_t* frame, int len );
+
+/* Print the counters of client->stats. */
+void l2sap_print_stats( const L2SAP* client, FILE* out );
+
 #endif
 
@@ -0,0 +1,913 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "l4bulk.h"
+#include "prof.h"
+#include "probes.h"
+
+/* How long an idle stripe thread waits for frames before it checks
+ * whether the L4Bulk is destroyed.
+ */
+#define L4_BULK_IDLE_US   50000
+
+// States of a frame in rx_state
+#define RX_EMPTY    0
+#define RX_COPYING  1
+#define RX_DONE     2
+
+static uint64_t now_us( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The kernel stamps arrivals with CLOCK_REALTIME. Only the age of the
+ * frame is read on that clock, and taken off now_us.
+ */
+static uint64_t arrival_us( const struct timespec* rx_time ) {
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    uint64_t now = now_us();
+    int64_t age = (int64_t)(real.tv_sec - rx_time->tv_sec) * 1000000 + (real.tv_nsec - rx_time->tv_nsec) / 1000;
+    if (age < 0) age = 0;
+    return (uint64_t)age < now ? now - (uint64_t)age : 0;
+}
+
+static uint32_t frame_count( uint32_t len, uint32_t payload ) {
+    return len == 0 ? 1 : (len + payload - 1) / payload;
+}
+
+// The largest payload per frame of the frame type
+static uint32_t full_payload( int seq32 ) {
+    return seq32 ? L4BulkSeq32Payloadsize : L4BulkPayloadsize;
+}
+
+// The largest window that the frame numbers of a message allow
+static uint16_t max_window( int seq32 ) {
+    return seq32 ? L4_BULK_WINDOW_SEQ32 : L4_BULK_WINDOW;
+}
+
+/* Duplicate ACKs that trigger a fast retransmission of tx_base. Stripes
+ * are served by different threads and reorder frames, so one duplicate
+ * ACK per stripe is no sign of loss.
+ */
+static uint32_t dupack_threshold( const L4Bulk* bulk ) {
+    return 3 * bulk->nstripes;
+}
+
+/* With reordering, a hole in the ACKs is only a loss if the frame has
+ * been on its way for clearly longer than a round trip (as in RACK).
+ */
+static int probably_lost( const L4Bulk* bulk, uint32_t seq ) {
+    uint32_t srtt = bulk->stats.srtt_us;
+    return bulk->stats.rtt_samples == 0 || now_us() - bulk->tx_sent_us[seq] > srtt + srtt / 4;
+}
+
+/* Frames beyond rx_next that the receiver can take. A complete message
+ * that l4bulk_recv has not taken blocks the next one. Called with the
+ * lock held.
+ */
+static uint16_t rx_window( const L4Bulk* bulk ) {
+    return bulk->rx_ready ? 0 : max_window(bulk->rx_seq32);
+}
+
+// ACKs an L4_SEQ32 message with an L4_SEQ32 frame
+static void send_ack( L4Bulk* bulk, int stripe, uint16_t msgid, uint32_t ackno, uint16_t window, int seq32 ) {
+    uint8_t frame[L4BulkSeq32Headersize];
+    L4Header* header = (L4Header*)frame;
+    header->type = L4_BULK_ACK;
+    header->seqno = 0;
+    header->ackno = (uint8_t)ackno;
+    header->mbz = 0;
+    L4BulkHeader* bulk_header = (L4BulkHeader*)(frame + L4Headersize);
+    bulk_header->msgid = htons(msgid);
+    bulk_header->window = htons(window);
+    bulk_header->msg_len = 0;
+    if (!seq32) {
+        l2sap_sendto(bulk->l2[stripe], frame, L4BulkHeadersize);
+        return;
+    }
+    header->type |= L4_SEQ32;
+    header->ackno = 0;
+    L4Seq32* ext = (L4Seq32*)(frame + L4BulkHeadersize);
+    ext->seqno = 0;
+    ext->ackno = htonl(ackno);
+    l2sap_sendto(bulk->l2[stripe], frame, L4BulkSeq32Headersize);
+}
+
+/* Sends frame seq of the current message. Called without the lock;
+ * the caller has raised tx_busy so that tx_data stays valid.
+ */
+static void send_frame( L4Bulk* bulk, uint32_t seq, uint16_t msgid ) {
+    uint8_t frame[L4Framesize];
+    L4Header* header = (L4Header*)frame;
+    header->type = L4_BULK;
+    header->seqno = (uint8_t)seq;
+    header->ackno = 0;
+    header->mbz = 0;
+    L4BulkHeader* bulk_header = (L4BulkHeader*)(frame + L4Headersize);
+    bulk_header->msgid = htons(msgid);
+    bulk_header->window = bulk->tx_payload < full_payload(bulk->tx_seq32) ? htons(bulk->tx_payload) : 0;
+    bulk_header->msg_len = htonl(bulk->tx_len);
+
+    int headersize = L4BulkHeadersize;
+    if (bulk->tx_seq32) {
+        header->type |= L4_SEQ32;
+        header->seqno = 0;
+        L4Seq32* ext = (L4Seq32*)(frame + L4BulkHeadersize);
+        ext->seqno = htonl(seq);
+        ext->ackno = 0;
+        headersize = L4BulkSeq32Headersize;
+    }
+
+    uint32_t payload = bulk->tx_payload;
+    uint32_t offset = seq * payload;
+    uint32_t len = bulk->tx_len - offset < payload ? bulk->tx_len - offset : payload;
+    uint64_t t0 = prof_now();
+    memcpy(frame + headersize, bulk->tx_data + offset, len);
+    prof_add(PROF_COPY, t0);
+    l2sap_sendto(bulk->l2[seq % bulk->nstripes], frame, headersize + len);
+}
+
+// Drops the lock for the send, and returns with the lock held
+static void send_frame_unlocked( L4Bulk* bulk, uint32_t seq ) {
+    uint16_t msgid = bulk->tx_msgid;
+    bulk->tx_busy++;
+    pthread_mutex_unlock(&bulk->lock);
+    send_frame(bulk, seq, msgid);
+    pthread_mutex_lock(&bulk->lock);
+    if (--bulk->tx_busy == 0 && !bulk->tx_active) {
+        pthread_cond_broadcast(&bulk->cond);
+    }
+}
+
+/* Sends all frames of all stripes that the window allows. Frames that
+ * were sent before count as retransmissions. Called and returns with
+ * the lock held.
+ */
+static void send_new_frames( L4Bulk* bulk ) {
+    int more = 1;
+    while (more && bulk->tx_active) {
+        more = 0;
+        for (int k = 0; k < bulk->nstripes && bulk->tx_active; k++) {
+            uint32_t seq = bulk->tx_next[k];
+            if (seq >= bulk->tx_frames || seq >= bulk->tx_base + bulk->tx_window || seq >= bulk->tx_limit) {
+                continue;
+            }
+            bulk->tx_next[k] += bulk->nstripes;
+            if (seq >= bulk->tx_high) bulk->tx_high = seq + 1;
+            bulk->tx_sent_us[seq] = now_us();
+            if (bulk->tx_tries[seq]++ > 0) {
+                bulk->stats.retransmits++;
+                PROBE2(l4_retransmit, seq, bulk->tx_tries[seq] - 1);
+            }
+            bulk->stats.data_sent++;
+            send_frame_unlocked(bulk, seq);
+            more = 1;
+        }
+    }
+}
+
+// Called with the lock held
+static void finish_send( L4Bulk* bulk, int result ) {
+    bulk->tx_active = 0;
+    bulk->tx_result = result;
+    pthread_cond_broadcast(&bulk->cond);
+}
+
+// Sends tx_base once more. Called with the lock held.
+static void resend_base( L4Bulk* bulk ) {
+    uint32_t seq = bulk->tx_base;
+    bulk->tx_tries[seq]++;
+    bulk->tx_sent_us[seq] = now_us();
+    bulk->tx_deadline_us = bulk->tx_sent_us[seq] + bulk->stats.rto_us;
+    bulk->stats.data_sent++;
+    bulk->stats.retransmits++;
+    PROBE2(l4_retransmit, seq, bulk->tx_tries[seq] - 1);
+    send_frame_unlocked(bulk, seq);
+}
+
+// Sends everything from tx_base again (go-back-N)
+static void rewind_stripes( L4Bulk* bulk ) {
+    uint32_t base = bulk->tx_base;
+    for (int k = 0; k < bulk->nstripes; k++) {
+        bulk->tx_next[k] = base + (k + bulk->nstripes - base % bulk->nstripes) % bulk->nstripes;
+    }
+}
+
+static void backoff( L4Bulk* bulk ) {
+    bulk->stats.rto_us = bulk->stats.rto_us * 2 > L4_MAX_RTO_US ? L4_MAX_RTO_US : bulk->stats.rto_us * 2;
+    bulk->tx_deadline_us = now_us() + bulk->stats.rto_us;
+}
+
+/* Arms the tail-loss probe when every frame of the message has been
+ * sent and some are not acknowledged: no later frames will produce
+ * duplicate ACKs if they are lost. Called with the lock held.
+ */
+static void arm_probe( L4Bulk* bulk ) {
+    bulk->tx_probe_us = 0;
+    if (bulk->tx_high < bulk->tx_frames || bulk->tx_base >= bulk->tx_frames || bulk->tx_limit <= bulk->tx_base) {
+        return;
+    }
+    bulk->tx_probe_us = l4_probe_time(&bulk->stats, now_us(), bulk->tx_deadline_us);
+}
+
+/* The probe timer expired: send tx_base once more. With cumulative ACKs,
+ * its ACK shows the next hole, which the partial ACK then repairs, or
+ * acknowledges the whole tail if only ACKs were lost. Called with the
+ * lock held.
+ */
+static void handle_probe( L4Bulk* bulk ) {
+    bulk->tx_probe_us = 0;
+    bulk->stats.tail_probes++;
+    bulk->tx_recover = bulk->tx_high;
+    resend_base(bulk);
+}
+
+/* The retransmission timer expired: back off and send everything from
+ * tx_base again, since a burst of frames was probably lost, or give up.
+ * With a closed window, the timer probes whether the window update was
+ * lost; the receiver is alive, so probes do not count as tries.
+ * Called with the lock held.
+ */
+static void handle_timeout( L4Bulk* bulk ) {
+    uint32_t base = bulk->tx_base;
+    bulk->tx_probe_us = 0;
+    if (bulk->tx_limit <= base) {
+        backoff(bulk);
+        if (base >= bulk->tx_high) bulk->tx_high = base + 1;
+        bulk->tx_probes++;
+        bulk->stats.data_sent++;
+        send_frame_unlocked(bulk, base);
+        return;
+    }
+    if (bulk->tx_tries[base] >= L4_BULK_MAX_TRIES) {
+        fprintf(stderr, "%s: ERROR: frame %u of message %u not acknowledged after %d tries\n",
+                __FUNCTION__, base, bulk->tx_msgid, L4_BULK_MAX_TRIES);
+        finish_send(bulk, L4_SEND_FAILED);
+        return;
+    }
+    backoff(bulk);
+    bulk->tx_dupacks = 0;
+    bulk->tx_recover = bulk->tx_high;
+    rewind_stripes(bulk);
+    send_new_frames(bulk);
+}
+
+/* Takes the window advertised with ack. Frames that were sent while the
+ * window was closed were dropped, so they go out again when it opens.
+ * Returns 1 if the window opened. Called with the lock held.
+ */
+static int update_window( L4Bulk* bulk, uint32_t ack, uint16_t window ) {
+    int was_closed = bulk->tx_limit <= bulk->tx_base;
+    bulk->tx_limit = ack + window;
+    bulk->tx_peer_window = window;
+    if (was_closed && bulk->tx_limit > bulk->tx_base) {
+        bulk->tx_deadline_us = now_us() + bulk->stats.rto_us;
+        rewind_stripes(bulk);
+        send_new_frames(bulk);
+        return 1;
+    }
+    if (!was_closed && bulk->tx_limit <= bulk->tx_base) {
+        // Start probing
+        bulk->tx_deadline_us = now_us() + bulk->stats.rto_us;
+    }
+    return 0;
+}
+
+static void handle_ack( L4Bulk* bulk, int stripe, const uint8_t* frame, uint64_t rx_us ) {
+    const L4Header* header = (const L4Header*)frame;
+    const L4BulkHeader* bulk_header = (const L4BulkHeader*)(frame + L4Headersize);
+
+    uint16_t msgid = ntohs(bulk_header->msgid);
+    uint16_t window = ntohs(bulk_header->window);
+
+    pthread_mutex_lock(&bulk->lock);
+    if (!bulk->tx_active) {
+        // The receiver took our last message. Its update can overtake the
+        // final ACK, which closed the window, so this only opens it.
+        if (msgid == bulk->tx_msgid && window > bulk->tx_peer_window) {
+            bulk->tx_peer_window = window;
+        }
+        pthread_mutex_unlock(&bulk->lock);
+        return;
+    }
+    if (msgid != bulk->tx_msgid) {
+        // The update for the previous message may open the window of
+        // this one; older ACKs of it must not close it again
+        if (msgid == (uint16_t)(bulk->tx_msgid - 1) && bulk->tx_base == 0 && window > 0) {
+            update_window(bulk, 0, window);
+        }
+        pthread_mutex_unlock(&bulk->lock);
+        return;
+    }
+
+    // ACKs that were queued behind others on this stripe are older than
+    // tx_base
+    uint32_t last = bulk->tx_acked[stripe];
+    uint32_t ack = last + (uint8_t)(header->ackno - (uint8_t)last);
+    if (header->type & L4_SEQ32) {
+        ack = ntohl(((const L4Seq32*)(frame + L4BulkHeadersize))->ackno);
+    }
+    if (ack > bulk->tx_high) {
+        pthread_mutex_unlock(&bulk->lock);
+        return;
+    }
+    bulk->tx_acked[stripe] = ack;
+    if (ack < bulk->tx_base) {
+        pthread_mutex_unlock(&bulk->lock);
+        return;
+    }
+    PROBE2(l4_ack, ack, ack - bulk->tx_base);
+
+    if (update_window(bulk, ack, window)) {
+        pthread_mutex_unlock(&bulk->lock);
+        return;
+    }
+    if (ack == bulk->tx_base && bulk->tx_limit <= ack) {
+        // Closed window, not a loss
+        pthread_mutex_unlock(&bulk->lock);
+        return;
+    }
+    if (ack == bulk->tx_base) {
+        // Fast retransmission, once per frame. Until the frames that are
+        // in flight now are ACKed, partial ACKs show further losses.
+        if (++bulk->tx_dupacks >= dupack_threshold(bulk) && bulk->tx_tries[ack] == 1 &&
+            probably_lost(bulk, ack)) {
+            bulk->tx_recover = bulk->tx_high;
+            resend_base(bulk);
+        }
+        pthread_mutex_unlock(&bulk->lock);
+        return;
+    }
+
+    // Karn: no samples from frames that were sent more than once
+    if (bulk->tx_tries[ack - 1] == 1) {
+        uint64_t tx_us = bulk->tx_sent_us[ack - 1];
+        l4_rtt_sample(&bulk->stats, rx_us > tx_us ? rx_us - tx_us : 0);
+    }
+    bulk->tx_base = ack;
+    bulk->tx_dupacks = 0;
+    if (ack == bulk->tx_frames) {
+        finish_send(bulk, bulk->tx_len);
+    } else {
+        bulk->tx_deadline_us = now_us() + bulk->stats.rto_us;
+        // A partial ACK during recovery: the next hole was lost as well
+        if (ack < bulk->tx_recover && bulk->tx_tries[ack] == 1 && probably_lost(bulk, ack)) {
+            resend_base(bulk);
+        }
+        send_new_frames(bulk);
+        arm_probe(bulk);
+    }
+    pthread_mutex_unlock(&bulk->lock);
+}
+
+// Starts reassembly of a new message. Called with the lock held.
+static int start_message( L4Bulk* bulk, uint16_t msgid, uint32_t msg_len, int seq32, uint32_t payload ) {
+    if (msg_len > L4_BULK_MAX_MSG) {
+        fprintf(stderr, "%s: ERROR: message of %u bytes is too large\n", __FUNCTION__, msg_len);
+        return -1;
+    }
+    if (bulk->rx_active) {
+        // The sender gave up on the previous message
+        free(bulk->rx_data);
+        free(bulk->rx_state);
+        bulk->rx_active = 0;
+    }
+    bulk->rx_seq32 = seq32;
+    bulk->rx_payload = payload;
+    bulk->rx_frames = frame_count(msg_len, bulk->rx_payload);
+    bulk->rx_data = malloc(msg_len ? msg_len : 1);
+    bulk->rx_state = calloc(bulk->rx_frames, 1);
+    if (!bulk->rx_data || !bulk->rx_state) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        free(bulk->rx_data);
+        free(bulk->rx_state);
+        bulk->rx_data = NULL;
+        bulk->rx_state = NULL;
+        return -1;
+    }
+    bulk->rx_len = msg_len;
+    bulk->rx_next = 0;
+    memset(bulk->rx_last, 0, sizeof(bulk->rx_last));
+    bulk->rx_msgid = msgid;
+    bulk->rx_active = 1;
+    return 0;
+}
+
+static void handle_data( L4Bulk* bulk, int stripe, const uint8_t* frame, int len ) {
+    const L4Header* header = (const L4Header*)frame;
+    const L4BulkHeader* bulk_header = (const L4BulkHeader*)(frame + L4Headersize);
+    uint16_t msgid = ntohs(bulk_header->msgid);
+    uint32_t msg_len = ntohl(bulk_header->msg_len);
+    int seq32 = (header->type & L4_SEQ32) != 0;
+    int headersize = seq32 ? L4BulkSeq32Headersize : L4BulkHeadersize;
+    uint32_t payload = ntohs(bulk_header->window);
+    if (payload == 0 || payload > full_payload(seq32)) {
+        payload = full_payload(seq32);
+    }
+
+    pthread_mutex_lock(&bulk->lock);
+    if (bulk->rx_done_valid && msgid == bulk->rx_done_msgid) {
+        // Our last ACK for this message was lost
+        uint32_t ack = bulk->rx_done_frames;
+        uint16_t window = rx_window(bulk);
+        pthread_mutex_unlock(&bulk->lock);
+        send_ack(bulk, stripe, msgid, ack, window, seq32);
+        return;
+    }
+    if (!bulk->rx_active || msgid != bulk->rx_msgid) {
+        // A complete message must be taken by l4bulk_recv before the next
+        // one starts: tell the sender to wait
+        if (bulk->rx_ready) {
+            bulk->rx_blocked_valid = 1;
+            bulk->rx_blocked_msgid = msgid;
+            bulk->rx_blocked_stripe = stripe;
+            pthread_mutex_unlock(&bulk->lock);
+            send_ack(bulk, stripe, msgid, 0, 0, seq32);
+            return;
+        }
+        // A message cannot be dropped while it is copied
+        if (bulk->rx_copying > 0 || start_message(bulk, msgid, msg_len, seq32, payload) < 0) {
+            pthread_mutex_unlock(&bulk->lock);
+            return;
+        }
+    }
+    if (seq32 != bulk->rx_seq32 || payload != bulk->rx_payload) {
+        pthread_mutex_unlock(&bulk->lock);
+        return;
+    }
+
+    // The seqno is the frame number modulo 256, close to the last one
+    // that arrived over this stripe
+    uint32_t last = bulk->rx_last[stripe];
+    int64_t seq = (int64_t)last + (int8_t)(header->seqno - (uint8_t)last);
+    if (seq32) {
+        seq = ntohl(((const L4Seq32*)(frame + L4BulkHeadersize))->seqno);
+    }
+    if (seq > last) {
+        bulk->rx_last[stripe] = seq;
+    }
+    if (seq < bulk->rx_next || (seq < bulk->rx_frames && bulk->rx_state[seq] != RX_EMPTY)) {
+        uint32_t ack = bulk->rx_next;
+        pthread_mutex_unlock(&bulk->lock);
+        send_ack(bulk, stripe, msgid, ack, max_window(seq32), seq32);
+        return;
+    }
+    uint32_t offset = (uint32_t)seq * payload;
+    uint32_t expected = bulk->rx_len - offset < payload ? bulk->rx_len - offset : payload;
+    if (seq >= bulk->rx_frames || seq >= bulk->rx_next + max_window(seq32) ||
+        msg_len != bulk->rx_len || (uint32_t)(len - headersize) != expected) {
+        pthread_mutex_unlock(&bulk->lock);
+        return;
+    }
+
+    // Copy without the lock, so that the stripes copy in parallel
+    bulk->rx_state[seq] = RX_COPYING;
+    bulk->rx_copying++;
+    uint8_t* dest = bulk->rx_data + offset;
+    pthread_mutex_unlock(&bulk->lock);
+
+    uint64_t t0 = prof_now();
+    memcpy(dest, frame + headersize, expected);
+    prof_add(PROF_COPY, t0);
+
+    pthread_mutex_lock(&bulk->lock);
+    bulk->rx_copying--;
+    bulk->rx_state[seq] = RX_DONE;
+    while (bulk->rx_next < bulk->rx_frames && bulk->rx_state[bulk->rx_next] == RX_DONE) {
+        bulk->rx_next++;
+    }
+    uint32_t ack = bulk->rx_next;
+    if (bulk->rx_next == bulk->rx_frames) {
+        free(bulk->rx_state);
+        bulk->rx_state = NULL;
+        bulk->rx_active = 0;
+        bulk->rx_ready = 1;
+        bulk->rx_done_valid = 1;
+        bulk->rx_done_msgid = msgid;
+        bulk->rx_done_frames = bulk->rx_frames;
+        pthread_cond_broadcast(&bulk->cond);
+    }
+    uint16_t window = rx_window(bulk);
+    pthread_mutex_unlock(&bulk->lock);
+    send_ack(bulk, stripe, msgid, ack, window, seq32);
+}
+
+/* Payload of candidate size k: the largest that the agreed max_frame
+ * allows, halved k times.
+ */
+static uint32_t segment_size( const L4Bulk* bulk, int k ) {
+    uint32_t largest = full_payload(bulk->tx_seq32);
+    uint32_t headersize = bulk->tx_seq32 ? L4BulkSeq32Headersize : L4BulkHeadersize;
+    if (bulk->caps.max_frame > headersize && bulk->caps.max_frame - headersize < largest) {
+        largest = bulk->caps.max_frame - headersize;
+    }
+    return largest >> k;
+}
+
+// Retransmissions per transmission of candidate k, 0 without samples
+static double loss_rate( const L4Bulk* bulk, int k ) {
+    return bulk->tx_seg_sent[k] ? (double)bulk->tx_seg_lost[k] / bulk->tx_seg_sent[k] : 0;
+}
+
+/* Picks the payload size of the next message, see l4bulk_send. A size
+ * without enough recent samples gets the loss rate of the size in use,
+ * scaled by the frame length: that tries smaller frames when losses
+ * mount, and larger ones when they fade. If the loss rate does not
+ * depend on the length, the smaller frames measure the same one and
+ * lose to the larger ones on header bytes. Called with the lock held.
+ */
+static int choose_segment( L4Bulk* bulk ) {
+    if (!(bulk->caps.flags & L4_CAP_SEGMENT)) {
+        return 0;
+    }
+    double overhead = L4_BULK_FRAME_OVERHEAD + (bulk->tx_seq32 ? L4BulkSeq32Headersize : L4BulkHeadersize);
+    double current = segment_size(bulk, bulk->tx_segment) + overhead;
+    double current_loss = loss_rate(bulk, bulk->tx_segment);
+    double bdp = (double)bulk->tx_rate * bulk->stats.srtt_us / 1000000;
+
+    int best = 0;
+    double best_efficiency = -1;
+    for (int k = 0; k < L4_BULK_SEGMENTS; k++) {
+        double size = segment_size(bulk, k);
+        if (size < 1 || (k > 0 && size * bulk->tx_window < bdp)) {
+            continue; // the window would no longer fill the path
+        }
+        double loss = bulk->tx_seg_sent[k] >= L4_BULK_SEGMENT_SAMPLES * 256 ?
+            loss_rate(bulk, k) : current_loss * (size + overhead) / current;
+        if (loss > 1) loss = 1;
+        double efficiency = size / (size + overhead) * (1 - loss);
+        if (efficiency > best_efficiency) {
+            best = k;
+            best_efficiency = efficiency;
+        }
+    }
+    return best;
+}
+
+/* Adds the transmissions of the message that was just sent to the loss
+ * rate of its size, after the weights of all sizes have decayed, and
+ * measures the delivery rate. Called with the lock held.
+ */
+static void measure_segment( L4Bulk* bulk, uint64_t start_us ) {
+    uint64_t sent = 0;
+    uint64_t lost = 0;
+    for (uint32_t seq = 0; seq < bulk->tx_frames; seq++) {
+        sent += bulk->tx_tries[seq];
+        if (bulk->tx_tries[seq] > 1) lost += bulk->tx_tries[seq] - 1;
+    }
+    for (int k = 0; k < L4_BULK_SEGMENTS; k++) {
+        bulk->tx_seg_sent[k] -= bulk->tx_seg_sent[k] / 8;
+        bulk->tx_seg_lost[k] -= bulk->tx_seg_lost[k] / 8;
+    }
+    int k = bulk->tx_segment;
+    bulk->tx_seg_sent[k] += sent * 256;
+    bulk->tx_seg_lost[k] += lost * 256;
+    bulk->tx_seg_messages[k]++;
+
+    uint64_t elapsed = now_us() - start_us;
+    if (elapsed > 0) {
+        bulk->tx_rate = (uint64_t)bulk->tx_len * 1000000 / elapsed;
+    }
+}
+
+// The capabilities of L4Bulk
+static void local_caps( L4Caps* caps ) {
+    l4_legacy_caps(caps);
+    caps->version = L4_VERSION;
+    caps->flags = L4_CAP_BULK | L4_CAP_SEQ32 | L4_CAP_SEGMENT;
+    caps->window = L4_BULK_WINDOW_SEQ32;
+}
+
+// Without 32-bit frame numbers, the window must stay below 128 frames
+static void limit_window( L4Caps* caps ) {
+    if (caps->window > max_window(caps->flags & L4_CAP_SEQ32)) {
+        caps->window = max_window(caps->flags & L4_CAP_SEQ32);
+    }
+}
+
+static void handle_hello( L4Bulk* bulk, int stripe, const uint8_t* frame, int len ) {
+    L4Caps ours, agreed;
+    local_caps(&ours);
+    if (l4_hello_reply(bulk->l2[stripe], frame, len, &ours, &agreed)) {
+        limit_window(&agreed);
+        pthread_mutex_lock(&bulk->lock);
+        bulk->caps = agreed;
+        pthread_mutex_unlock(&bulk->lock);
+    }
+}
+
+static void* stripe_main( void* arg ) {
+    L4BulkStripe* stripe = (L4BulkStripe*)arg;
+    L4Bulk* bulk = stripe->bulk;
+    uint8_t frame[L4Framesize];
+
+    while (1) {
+        pthread_mutex_lock(&bulk->lock);
+        if (bulk->quit) {
+            pthread_mutex_unlock(&bulk->lock);
+            break;
+        }
+        uint64_t wait_us = L4_BULK_IDLE_US;
+        if (bulk->tx_active) {
+            uint64_t now = now_us();
+            if (now >= bulk->tx_deadline_us) {
+                handle_timeout(bulk);
+            } else if (bulk->tx_probe_us && now >= bulk->tx_probe_us) {
+                handle_probe(bulk);
+            }
+            if (bulk->tx_active && bulk->tx_deadline_us > now && bulk->tx_deadline_us - now < wait_us) {
+                wait_us = bulk->tx_deadline_us - now;
+            }
+            if (bulk->tx_active && bulk->tx_probe_us > now && bulk->tx_probe_us - now < wait_us) {
+                wait_us = bulk->tx_probe_us - now;
+            }
+        }
+        pthread_mutex_unlock(&bulk->lock);
+
+        struct timeval timeout = { wait_us / 1000000, wait_us % 1000000 };
+        struct timespec rx_time;
+        int len = l2sap_recvfrom_timeout_ts(bulk->l2[stripe->index], frame, L4Framesize, &timeout, &rx_time);
+        if (len < L4Headersize) {
+            continue; // timeout or error
+        }
+        const L4Header* header = (const L4Header*)frame;
+        if (header->type == L4_HELLO) {
+            handle_hello(bulk, stripe->index, frame, len);
+            continue;
+        }
+        if (len < ((header->type & L4_SEQ32) ? L4BulkSeq32Headersize : L4BulkHeadersize)) {
+            continue; // not a bulk frame
+        }
+
+        uint8_t type = header->type & ~L4_SEQ32;
+        if (type == L4_BULK) {
+            handle_data(bulk, stripe->index, frame, len);
+        } else if (type == L4_BULK_ACK) {
+            handle_ack(bulk, stripe->index, frame, arrival_us(&rx_time));
+        }
+    }
+    return NULL;
+}
+
+static void free_l2( L4Bulk* bulk, int n ) {
+    for (int k = 0; k < n; k++) {
+        l2sap_destroy(bulk->l2[k]);
+    }
+    free(bulk);
+}
+
+// Initializes locks and starts the stripe threads of a bulk whose l2 are set
+static L4Bulk* start_bulk( L4Bulk* bulk ) {
+    pthread_mutex_init(&bulk->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&bulk->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    bulk->stats.rto_us = L4_MAX_RTO_US;
+    if (bulk->caps.version == 0) {
+        local_caps(&bulk->caps);
+    }
+    bulk->tx_window = bulk->caps.window < L4_BULK_WINDOW ? bulk->caps.window : L4_BULK_WINDOW;
+    bulk->tx_peer_window = bulk->caps.window;
+    bulk->tx_msgid = (uint16_t)(getpid() ^ time(NULL));
+
+    for (int k = 0; k < bulk->nstripes; k++) {
+        bulk->stripes[k].bulk = bulk;
+        bulk->stripes[k].index = k;
+        if (pthread_create(&bulk->stripes[k].thread, NULL, stripe_main, &bulk->stripes[k]) != 0) {
+            fprintf(stderr, "%s: ERROR: pthread_create failed\n", __FUNCTION__);
+            pthread_mutex_lock(&bulk->lock);
+            bulk->quit = 1;
+            pthread_mutex_unlock(&bulk->lock);
+            while (k-- > 0) {
+                pthread_join(bulk->stripes[k].thread, NULL);
+            }
+            free_l2(bulk, bulk->nstripes);
+            return NULL;
+        }
+    }
+    fprintf(stderr, "%s: L4Bulk with %d stripes created\n", __FUNCTION__, bulk->nstripes);
+    return bulk;
+}
+
+static L4Bulk* alloc_bulk( int nstripes ) {
+    if (nstripes < 1 || nstripes > L4_BULK_MAX_STRIPES) {
+        fprintf(stderr, "%s: ERROR: between 1 and %d stripes are supported\n", __FUNCTION__, L4_BULK_MAX_STRIPES);
+        return NULL;
+    }
+    L4Bulk* bulk = calloc(1, sizeof(L4Bulk));
+    if (bulk == NULL) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+    }
+    return bulk;
+}
+
+L4Bulk* l4bulk_create( const char* server_ip, int server_port, int nstripes ) {
+    if (!server_ip || server_port < 1024 || server_port + nstripes > 65536) {
+        fprintf(stderr, "%s: ERROR: invalid server_ip or port\n", __FUNCTION__);
+        return NULL;
+    }
+    L4Bulk* bulk = alloc_bulk(nstripes);
+    if (bulk == NULL) return NULL;
+
+    for (int k = 0; k < nstripes; k++) {
+        bulk->l2[k] = l2sap_create(server_ip, server_port + k);
+        if (bulk->l2[k] == NULL) {
+            free_l2(bulk, k);
+            return NULL;
+        }
+        l2sap_tune_buffers(bulk->l2[k], L4_BULK_WINDOW_SEQ32, L2_DEFAULT_RTT_US, L2_DEFAULT_BANDWIDTH);
+    }
+    bulk->nstripes = nstripes;
+
+    // Do not flood a peer that cannot take bulk frames
+    L4Caps ours;
+    local_caps(&ours);
+    if (!l4_hello(bulk->l2[0], &ours, &bulk->caps) || !(bulk->caps.flags & L4_CAP_BULK)) {
+        fprintf(stderr, "%s: ERROR: %s:%d does not support L4Bulk\n", __FUNCTION__, server_ip, server_port);
+        free_l2(bulk, nstripes);
+        return NULL;
+    }
+    limit_window(&bulk->caps);
+    return start_bulk(bulk);
+}
+
+L4Bulk* l4bulk_server_create( int port, int nstripes ) {
+    if (port < 1024 || port + nstripes > 65536) {
+        fprintf(stderr, "%s: ERROR: invalid port\n", __FUNCTION__);
+        return NULL;
+    }
+    L4Bulk* bulk = alloc_bulk(nstripes);
+    if (bulk == NULL) return NULL;
+
+    for (int k = 0; k < nstripes; k++) {
+        bulk->l2[k] = l2sap_server_create(port + k);
+        if (bulk->l2[k] == NULL) {
+            free_l2(bulk, k);
+            return NULL;
+        }
+        l2sap_tune_buffers(bulk->l2[k], L4_BULK_WINDOW_SEQ32, L2_DEFAULT_RTT_US, L2_DEFAULT_BANDWIDTH);
+    }
+    bulk->nstripes = nstripes;
+    return start_bulk(bulk);
+}
+
+int l4bulk_set_window( L4Bulk* bulk, int frames ) {
+    if (!bulk || frames < 1) {
+        fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
+        return -1;
+    }
+    pthread_mutex_lock(&bulk->lock);
+    if (bulk->tx_active || bulk->tx_busy) {
+        pthread_mutex_unlock(&bulk->lock);
+        fprintf(stderr, "%s: ERROR: a send is in progress\n", __FUNCTION__);
+        return -1;
+    }
+    bulk->tx_window = frames < bulk->caps.window ? frames : bulk->caps.window;
+    int window = bulk->tx_window;
+    pthread_mutex_unlock(&bulk->lock);
+    return window;
+}
+
+int l4bulk_send( L4Bulk* bulk, const uint8_t* data, uint32_t len ) {
+    if (!bulk || !data || len == 0 || len > L4_BULK_MAX_MSG) {
+        fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&bulk->lock);
+    if (bulk->tx_active || bulk->tx_busy) {
+        pthread_mutex_unlock(&bulk->lock);
+        fprintf(stderr, "%s: ERROR: another send is in progress\n", __FUNCTION__);
+        return -1;
+    }
+    bulk->tx_seq32 = bulk->tx_window > L4_BULK_WINDOW;
+    bulk->tx_segment = choose_segment(bulk);
+    bulk->tx_payload = segment_size(bulk, bulk->tx_segment);
+    bulk->tx_frames = frame_count(len, bulk->tx_payload);
+    bulk->tx_sent_us = malloc(bulk->tx_frames * sizeof(uint64_t));
+    bulk->tx_tries = calloc(bulk->tx_frames, 1);
+    if (!bulk->tx_sent_us || !bulk->tx_tries) {
+        free(bulk->tx_sent_us);
+        free(bulk->tx_tries);
+        pthread_mutex_unlock(&bulk->lock);
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        return -1;
+    }
+    bulk->tx_data = data;
+    bulk->tx_len = len;
+    bulk->tx_base = 0;
+    bulk->tx_high = 0;
+    bulk->tx_recover = 0;
+    memset(bulk->tx_acked, 0, sizeof(bulk->tx_acked));
+    for (int k = 0; k < bulk->nstripes; k++) {
+        bulk->tx_next[k] = k;
+    }
+    bulk->tx_dupacks = 0;
+    bulk->tx_msgid++;
+    bulk->tx_active = 1;
+    uint64_t start_us = now_us();
+    bulk->tx_deadline_us = start_us + bulk->stats.rto_us;
+    // A receiver that has not taken the last message yet gets a probe
+    // when the timer expires, unless its window update comes first
+    bulk->tx_limit = bulk->tx_peer_window;
+
+    // The first window goes out from here, the rest from the stripe
+    // threads when ACKs arrive
+    send_new_frames(bulk);
+    arm_probe(bulk);
+    while (bulk->tx_active || bulk->tx_busy) {
+        pthread_cond_wait(&bulk->cond, &bulk->lock);
+    }
+    int result = bulk->tx_result;
+    measure_segment(bulk, start_us);
+    free(bulk->tx_sent_us);
+    free(bulk->tx_tries);
+    bulk->tx_sent_us = NULL;
+    bulk->tx_tries = NULL;
+    bulk->tx_data = NULL;
+    pthread_mutex_unlock(&bulk->lock);
+    return result;
+}
+
+int l4bulk_recv( L4Bulk* bulk, uint8_t** data, struct timeval* timeout ) {
+    if (!bulk || !data) {
+        fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
+        return -1;
+    }
+
+    struct timespec until;
+    if (timeout) {
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += timeout->tv_sec;
+        until.tv_nsec += timeout->tv_usec * 1000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&bulk->lock);
+    while (!bulk->rx_ready) {
+        if (timeout == NULL) {
+            pthread_cond_wait(&bulk->cond, &bulk->lock);
+        } else if (pthread_cond_timedwait(&bulk->cond, &bulk->lock, &until) == ETIMEDOUT) {
+            pthread_mutex_unlock(&bulk->lock);
+            return L4_TIMEOUT;
+        }
+    }
+    *data = bulk->rx_data;
+    int len = bulk->rx_len;
+    bulk->rx_data = NULL;
+    bulk->rx_ready = 0;
+
+    // Window update. A lost one is covered by the sender's probes.
+    int blocked = bulk->rx_blocked_valid;
+    int stripe = blocked ? bulk->rx_blocked_stripe : 0;
+    uint16_t done_msgid = bulk->rx_done_msgid;
+    uint32_t done_frames = bulk->rx_done_frames;
+    int seq32 = bulk->rx_seq32;
+    bulk->rx_blocked_valid = 0;
+    pthread_mutex_unlock(&bulk->lock);
+
+    send_ack(bulk, stripe, done_msgid, done_frames, max_window(seq32), seq32);
+    return len;
+}
+
+void l4bulk_destroy( L4Bulk* bulk ) {
+    if (bulk == NULL) return;
+
+    pthread_mutex_lock(&bulk->lock);
+    bulk->quit = 1;
+    pthread_mutex_unlock(&bulk->lock);
+    for (int k = 0; k < bulk->nstripes; k++) {
+        pthread_join(bulk->stripes[k].thread, NULL);
+    }
+
+    l4_print_stats(&bulk->stats, "L4Bulk", stderr);
+    fprintf(stderr, "L4Bulk: %" PRIu64 " zero-window probes\n", bulk->tx_probes);
+    uint64_t messages = 0;
+    for (int k = 0; k < L4_BULK_SEGMENTS; k++) {
+        messages += bulk->tx_seg_messages[k];
+    }
+    if (messages > 0) {
+        fprintf(stderr, "L4Bulk: messages per payload size:");
+        for (int k = 0; k < L4_BULK_SEGMENTS; k++) {
+            fprintf(stderr, " %u: %" PRIu64, segment_size(bulk, k), bulk->tx_seg_messages[k]);
+        }
+        fprintf(stderr, "\n");
+    }
+    pthread_mutex_destroy(&bulk->lock);
+    pthread_cond_destroy(&bulk->cond);
+    free(bulk->rx_data);
+    free(bulk->rx_state);
+    free_l2(bulk, bulk->nstripes);
+}
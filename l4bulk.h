@@ -0,0 +1,221 @@
+#ifndef L4BULK_H
+#define L4BULK_H
+
+#include <pthread.h>
+
+#include "l4sap.h"
+
+/* Bulk transfers for messages that do not fit into one L4 frame.
+ *
+ * A message of up to L4_BULK_MAX_MSG bytes is cut into frames that are
+ * sent with a sliding window of L4_BULK_WINDOW frames and cumulative
+ * ACKs. The frames are striped over several L2SAPs on consecutive UDP
+ * ports: frame seq goes over stripe seq % nstripes. Every stripe has its
+ * own thread that receives on its socket, copies the payload of DATA
+ * frames into the message and answers with an ACK on the same socket,
+ * so that the receive work of one large message is spread over several
+ * cores. The receiver reassembles the frames in order.
+ *
+ * The 8-bit seqno and ackno of the L4Header carry frame numbers modulo
+ * 256. A stripe can queue many frames while the others make progress,
+ * so each stripe decodes them relative to the last number that it saw
+ * itself; one socket does not reorder frames. That limits the window to
+ * L4_BULK_WINDOW. With peers that agree on L4_CAP_SEQ32,
+ * l4bulk_set_window allows windows of up to L4_BULK_WINDOW_SEQ32 frames
+ * to fill paths with a large bandwidth-delay product. Messages are then
+ * sent in L4_SEQ32 frames with 32-bit frame numbers in an L4Seq32
+ * extension, which costs 8 bytes of payload per frame.
+ *
+ * Every ACK advertises how many frames beyond its ackno the receiver can
+ * take. A receiver that holds a complete message which l4bulk_recv has
+ * not taken yet advertises 0, and the sender waits instead of sending
+ * frames that would be dropped. The receiver announces the open window
+ * when the message is taken; if that update is lost, the sender probes
+ * the closed window with its first frame.
+ *
+ * Frames carry as many bytes of the message as the agreed max_frame
+ * allows, at most L4BulkPayloadsize, and a smaller payload size in the
+ * window field of DATA frames. With peers that agree on L4_CAP_SEGMENT,
+ * the sender picks the payload size for each message among that
+ * largest one and its halves, down to 1/2^(L4_BULK_SEGMENTS-1) of it, from
+ * the retransmissions that each size needed recently and the round-trip
+ * time: when losses grow with the frame length, a lost small frame costs
+ * less to resend, and when they do not, full frames spend the least on
+ * headers.
+ *
+ * Like L4SAP, an L4Bulk talks to exactly one peer, and it is full-duplex.
+ * Both ends must use L4Bulk; the stop-and-wait L4SAP does not know the
+ * L4_BULK frame types. l4bulk_create exchanges L4Caps with the receiver
+ * over the first stripe and fails unless the receiver has L4_CAP_BULK,
+ * and the sender keeps at most the agreed window in flight.
+ */
+
+#define L4_BULK             (0x1 << 3)
+#define L4_BULK_ACK         (L4_BULK | L4_ACK)
+
+#define L4_BULK_MAX_STRIPES 8
+
+/* Frames in flight. Frame numbers within the window must be told apart
+ * by their 8-bit seqno, so the window must stay below 128, unless both
+ * sides use L4_SEQ32 frames.
+ */
+#define L4_BULK_WINDOW       64
+#define L4_BULK_WINDOW_SEQ32 1024
+
+#define L4_BULK_MAX_MSG     (64 * 1024 * 1024)
+
+/* Transmissions of the oldest unacknowledged frame before the transfer
+ * fails.
+ */
+#define L4_BULK_MAX_TRIES   8
+
+/* Candidate payload sizes, see l4bulk_send. A size's loss rate is
+ * measured over its last transmissions, weighted down by 1/8 per
+ * message; with fewer than L4_BULK_SEGMENT_SAMPLES it is estimated from
+ * the size in use.
+ */
+#define L4_BULK_SEGMENTS        4
+#define L4_BULK_SEGMENT_SAMPLES 32
+
+/* Bytes that every frame costs beyond the L4 frame: the L2 header and
+ * the IPv4 and UDP headers.
+ */
+#define L4_BULK_FRAME_OVERHEAD  (L2Headersize + 28)
+
+/* Follows the L4Header in every bulk frame. */
+typedef struct L4BulkHeader L4BulkHeader;
+struct L4BulkHeader
+{
+    uint16_t msgid;     /* message number, network byte order */
+    uint16_t window;    /* ACKs: frames the receiver accepts from ackno on; DATA: payload per frame,
+                           0 for the largest; network byte order */
+    uint32_t msg_len;   /* length of the whole message, network byte order; 0 in ACKs */
+};
+
+#define L4BulkHeadersize  (int)(L4Headersize + sizeof(L4BulkHeader))
+#define L4BulkPayloadsize (int)(L4Framesize - L4BulkHeadersize)
+
+#define L4BulkSeq32Headersize  (int)(L4BulkHeadersize + sizeof(L4Seq32))
+#define L4BulkSeq32Payloadsize (int)(L4Framesize - L4BulkSeq32Headersize)
+
+typedef struct L4Bulk L4Bulk;
+
+typedef struct L4BulkStripe L4BulkStripe;
+struct L4BulkStripe
+{
+    L4Bulk*   bulk;
+    int       index;
+    pthread_t thread;
+};
+
+struct L4Bulk
+{
+    int             nstripes;
+    L2SAP*          l2[L4_BULK_MAX_STRIPES];
+    L4BulkStripe    stripes[L4_BULK_MAX_STRIPES];
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             quit;
+    L4Caps          caps;           /* agreed with the peer */
+
+    /* Sending. Frames below tx_base are acknowledged; tx_next[k] is the
+     * next frame of stripe k that has not been sent yet. tx_busy counts
+     * threads that read tx_data without holding the lock.
+     */
+    const uint8_t*  tx_data;
+    uint32_t        tx_len;
+    uint32_t        tx_frames;
+    uint32_t        tx_base;
+    uint32_t        tx_next[L4_BULK_MAX_STRIPES];
+    uint64_t*       tx_sent_us;     /* per frame: time of the last transmission */
+    uint8_t*        tx_tries;       /* per frame: number of transmissions */
+    uint64_t        tx_deadline_us; /* retransmission timer of tx_base */
+    uint64_t        tx_probe_us;    /* tail-loss probe timer, 0 if not armed */
+    uint32_t        tx_high;        /* one past the highest frame sent */
+    uint32_t        tx_limit;       /* one past the last frame the receiver accepts */
+    uint16_t        tx_peer_window; /* the last window advertised by the peer */
+    uint64_t        tx_probes;      /* probes of a closed window */
+    uint32_t        tx_recover;     /* tx_high when the last loss was detected */
+    uint32_t        tx_dupacks;
+    uint32_t        tx_acked[L4_BULK_MAX_STRIPES]; /* last ACK per stripe */
+    uint16_t        tx_msgid;
+    uint16_t        tx_window;      /* frames in flight, see l4bulk_set_window */
+    int             tx_seq32;       /* the message goes out in L4_SEQ32 frames */
+    uint32_t        tx_payload;     /* payload bytes per frame */
+    int             tx_segment;     /* tx_payload is candidate size tx_segment */
+    uint64_t        tx_seg_sent[L4_BULK_SEGMENTS];  /* per size: weighted transmissions, 1/256ths */
+    uint64_t        tx_seg_lost[L4_BULK_SEGMENTS];  /* and retransmissions */
+    uint64_t        tx_seg_messages[L4_BULK_SEGMENTS];
+    uint64_t        tx_rate;        /* bytes per second of the last message */
+    int             tx_active;
+    int             tx_busy;
+    int             tx_result;
+
+    /* Receiving. Frames below rx_next are complete; rx_state has one
+     * entry per frame. A complete message waits in rx_data with rx_ready
+     * set until l4bulk_recv takes it.
+     */
+    uint8_t*        rx_data;
+    uint32_t        rx_len;
+    uint32_t        rx_frames;
+    uint32_t        rx_next;
+    uint8_t*        rx_state;
+    uint32_t        rx_last[L4_BULK_MAX_STRIPES];  /* last frame per stripe */
+    int             rx_copying;
+    uint16_t        rx_msgid;
+    int             rx_seq32;       /* the message arrives in L4_SEQ32 frames */
+    uint32_t        rx_payload;
+    int             rx_active;
+    int             rx_ready;
+
+    /* The last complete message; retransmitted frames of it are ACKed. */
+    int             rx_done_valid;
+    uint16_t        rx_done_msgid;
+    uint32_t        rx_done_frames;
+
+    /* A message that was refused with a closed window. Its sender gets a
+     * window update when l4bulk_recv takes the complete message.
+     */
+    int             rx_blocked_valid;
+    uint16_t        rx_blocked_msgid;
+    int             rx_blocked_stripe;
+
+    L4Stats         stats;
+};
+
+/* Create the sending end of a bulk transfer. Stripe k sends to
+ * server_port + k.
+ */
+L4Bulk* l4bulk_create( const char* server_ip, int server_port, int nstripes );
+
+/* Create the receiving end, bound to the ports port to port + nstripes - 1.
+ * It answers to the sockets from which it receives.
+ */
+L4Bulk* l4bulk_server_create( int port, int nstripes );
+
+/* Sets the number of frames that the sender keeps in flight, at most
+ * the window agreed with the peer. Above L4_BULK_WINDOW, that needs
+ * L4_CAP_SEQ32. Returns the window in effect, or -1 while a message is
+ * being sent.
+ */
+int  l4bulk_set_window( L4Bulk* bulk, int frames );
+
+/* Sends a message of len bytes and blocks until the peer has
+ * acknowledged all of it. With L4_CAP_SEGMENT, the payload size is the
+ * candidate with the most payload per byte on the wire, retransmissions
+ * included, among those that still fill the bandwidth-delay product
+ * with the window. Returns len, or L4_SEND_FAILED if the oldest
+ * unacknowledged frame was sent L4_BULK_MAX_TRIES times without an ACK.
+ */
+int  l4bulk_send( L4Bulk* bulk, const uint8_t* data, uint32_t len );
+
+/* Waits for the next complete message, at most for timeout (NULL waits
+ * forever). On success, *data points to the message, which the caller
+ * must free, and the length is returned. Returns L4_TIMEOUT otherwise.
+ */
+int  l4bulk_recv( L4Bulk* bulk, uint8_t** data, struct timeval* timeout );
+
+void l4bulk_destroy( L4Bulk* bulk );
+
+#endif
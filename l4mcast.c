@@ -0,0 +1,358 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "l4mcast.h"
+#include "prof.h"
+
+// Timers only, so steps of the wall clock do not move them
+static uint64_t now_us( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t frame_count( uint32_t len ) {
+    return len == 0 ? 1 : (len + L4McastPayloadsize - 1) / L4McastPayloadsize;
+}
+
+static void fill_header( uint8_t* frame, uint8_t type, uint16_t msgid, uint32_t msg_len, uint32_t seq ) {
+    L4Header* header = (L4Header*)frame;
+    header->type = type;
+    header->seqno = 0;
+    header->ackno = 0;
+    header->mbz = 0;
+    L4McastHeader* mc_header = (L4McastHeader*)(frame + L4Headersize);
+    mc_header->msgid = htons(msgid);
+    mc_header->mbz = 0;
+    mc_header->msg_len = htonl(msg_len);
+    mc_header->seq = htonl(seq);
+}
+
+static void send_data( L4Mcast* mc, const uint8_t* data, uint32_t len, uint32_t seq ) {
+    uint8_t frame[L4Framesize];
+    uint32_t offset = seq * L4McastPayloadsize;
+    uint32_t payload = len - offset < (uint32_t)L4McastPayloadsize ? len - offset : (uint32_t)L4McastPayloadsize;
+    fill_header(frame, L4_MCAST, mc->tx_msgid, len, seq);
+    uint64_t t0 = prof_now();
+    memcpy(frame + L4McastHeadersize, data + offset, payload);
+    prof_add(PROF_COPY, t0);
+    l2sap_sendto(mc->l2, frame, L4McastHeadersize + payload);
+}
+
+/* Returns the number of ranges in a NACK or NCF of msgid, or -1 if the
+ * frame is something else.
+ */
+static int nack_ranges( const uint8_t* frame, int len, uint16_t msgid ) {
+    const L4McastHeader* mc_header = (const L4McastHeader*)(frame + L4Headersize);
+    if (len < L4McastHeadersize || ntohs(mc_header->msgid) != msgid) return -1;
+    uint32_t n = ntohl(mc_header->seq);
+    if (n > L4_MCAST_NACK_RANGES || len < L4McastHeadersize + (int)(n * sizeof(L4McastRange))) return -1;
+    return n;
+}
+
+/* Repairs the frames of a NACK that were not repaired just before, and
+ * confirms it to the whole group if it asked for anything new. A NACK
+ * that other receivers sent for the same loss costs nothing else.
+ */
+static void handle_nack( L4Mcast* mc, uint8_t* frame, int len, const uint8_t* data, uint32_t msg_len ) {
+    int n = nack_ranges(frame, len, mc->tx_msgid);
+    if (n < 0) return;
+    mc->stats.nacks++;
+
+    uint32_t frames = frame_count(msg_len);
+    const L4McastRange* ranges = (const L4McastRange*)(frame + L4McastHeadersize);
+    int confirmed = 0;
+    for (int r = 0; r < n; r++) {
+        uint32_t first = ntohl(ranges[r].first);
+        uint32_t count = ntohl(ranges[r].count);
+        for (uint32_t seq = first; seq < frames && seq - first < count; seq++) {
+            uint64_t now = now_us();
+            if (mc->tx_repaired_us[seq] != 0 && now - mc->tx_repaired_us[seq] < L4_MCAST_HOLDOFF_US) continue;
+            if (!confirmed) {
+                ((L4Header*)frame)->type = L4_MCAST_NCF;
+                l2sap_sendto(mc->l2, frame, L4McastHeadersize + n * sizeof(L4McastRange));
+                confirmed = 1;
+            }
+            mc->tx_repaired_us[seq] = now;
+            mc->stats.repairs++;
+            send_data(mc, data, msg_len, seq);
+        }
+    }
+}
+
+/* Handles the NACKs that arrive within wait_us, and the ones that are
+ * queued behind them. Returns the number of NACKs.
+ */
+static int poll_nacks( L4Mcast* mc, const uint8_t* data, uint32_t msg_len, uint64_t wait_us ) {
+    uint8_t frame[L4Framesize];
+    int nacks = 0;
+    while (1) {
+        struct timeval timeout = { wait_us / 1000000, wait_us % 1000000 };
+        int len = l2sap_recvfrom_timeout(mc->l2, frame, sizeof(frame), &timeout);
+        if (len == L2_TIMEOUT) return nacks;
+        wait_us = 0;
+        if (len < L4Headersize || ((L4Header*)frame)->type != L4_MCAST_NACK) continue;
+        handle_nack(mc, frame, len, data, msg_len);
+        nacks++;
+    }
+}
+
+// Frames that are sent between two checks for NACKs
+#define L4_MCAST_BURST 32
+
+// Frames that a receiver's socket buffer holds
+#define L4_MCAST_RX_FRAMES 1024
+
+int l4mcast_send( L4Mcast* mc, const uint8_t* data, uint32_t len ) {
+    if (!mc || mc->receiver || !data || len == 0 || len > L4_MCAST_MAX_MSG) {
+        fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
+        return -1;
+    }
+    uint32_t frames = frame_count(len);
+    mc->tx_repaired_us = calloc(frames, sizeof(uint64_t));
+    if (mc->tx_repaired_us == NULL) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        return -1;
+    }
+    mc->tx_msgid++;
+
+    for (uint32_t seq = 0; seq < frames; seq++) {
+        send_data(mc, data, len, seq);
+        mc->stats.data_sent++;
+        if ((seq + 1) % L4_MCAST_BURST == 0) {
+            poll_nacks(mc, data, len, 0);
+        }
+    }
+
+    // Linger until the receivers are quiet
+    uint64_t quiet_us = now_us() + L4_MCAST_LINGER_US;
+    uint64_t heartbeat_us = now_us() + L4_MCAST_HEARTBEAT_US;
+    while (1) {
+        uint64_t now = now_us();
+        if (now >= quiet_us) break;
+        if (now >= heartbeat_us) {
+            send_data(mc, data, len, frames - 1);
+            heartbeat_us = now + L4_MCAST_HEARTBEAT_US;
+        }
+        uint64_t until = heartbeat_us < quiet_us ? heartbeat_us : quiet_us;
+        if (poll_nacks(mc, data, len, until - now) > 0) {
+            quiet_us = now_us() + L4_MCAST_LINGER_US;
+        }
+    }
+
+    free(mc->tx_repaired_us);
+    mc->tx_repaired_us = NULL;
+    return len;
+}
+
+// Sends a NACK for the missing frames below rx_highest, if there are any
+static void send_nack( L4Mcast* mc ) {
+    uint8_t frame[L4McastHeadersize + L4_MCAST_NACK_RANGES * sizeof(L4McastRange)];
+    L4McastRange* ranges = (L4McastRange*)(frame + L4McastHeadersize);
+    int n = 0;
+    for (uint32_t seq = 0; seq < mc->rx_highest && n < L4_MCAST_NACK_RANGES; seq++) {
+        if (mc->rx_have[seq]) continue;
+        uint32_t first = seq;
+        while (seq + 1 < mc->rx_highest && !mc->rx_have[seq + 1]) seq++;
+        ranges[n].first = htonl(first);
+        ranges[n].count = htonl(seq - first + 1);
+        n++;
+    }
+    if (n == 0) {
+        mc->rx_nack_us = 0;
+        return;
+    }
+    fill_header(frame, L4_MCAST_NACK, mc->rx_msgid, 0, n);
+    l2sap_sendto(mc->l2, frame, L4McastHeadersize + n * sizeof(L4McastRange));
+    mc->stats.nacks++;
+    mc->rx_nacked = 1;
+    mc->rx_nack_us = now_us() + L4_MCAST_NACK_RETRY_US;
+}
+
+static void schedule_nack( L4Mcast* mc ) {
+    if (mc->rx_nack_us == 0) {
+        mc->rx_nack_us = now_us() + rand_r(&mc->rand_seed) % L4_MCAST_NACK_DELAY_US;
+        mc->rx_nacked = 0;
+    }
+}
+
+// Another receiver asked for frames: wait for their repair
+static void handle_ncf( L4Mcast* mc, const uint8_t* frame, int len ) {
+    if (!mc->rx_active || mc->rx_nack_us == 0) return;
+    int n = nack_ranges(frame, len, mc->rx_msgid);
+    const L4McastRange* ranges = (const L4McastRange*)(frame + L4McastHeadersize);
+    for (int r = 0; r < n; r++) {
+        uint32_t first = ntohl(ranges[r].first);
+        uint32_t count = ntohl(ranges[r].count);
+        for (uint32_t seq = first; seq < mc->rx_highest && seq - first < count; seq++) {
+            if (!mc->rx_have[seq]) {
+                // Our own NACK only delays the retry
+                mc->stats.suppressed += !mc->rx_nacked;
+                mc->rx_nack_us = now_us() + L4_MCAST_NACK_RETRY_US;
+                return;
+            }
+        }
+    }
+}
+
+static int start_message( L4Mcast* mc, uint16_t msgid, uint32_t msg_len ) {
+    if (msg_len == 0 || msg_len > L4_MCAST_MAX_MSG) {
+        fprintf(stderr, "%s: ERROR: message of %u bytes is not supported\n", __FUNCTION__, msg_len);
+        return -1;
+    }
+    // A new message ends the previous one, complete or not
+    free(mc->rx_data);
+    free(mc->rx_have);
+    mc->rx_frames = frame_count(msg_len);
+    mc->rx_data = malloc(msg_len);
+    mc->rx_have = calloc(mc->rx_frames, 1);
+    if (!mc->rx_data || !mc->rx_have) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        free(mc->rx_data);
+        free(mc->rx_have);
+        mc->rx_data = NULL;
+        mc->rx_have = NULL;
+        mc->rx_active = 0;
+        return -1;
+    }
+    mc->rx_active = 1;
+    mc->rx_msgid = msgid;
+    mc->rx_len = msg_len;
+    mc->rx_count = 0;
+    mc->rx_highest = 0;
+    mc->rx_nack_us = 0;
+    return 0;
+}
+
+// Returns 1 when the message is complete
+static int handle_data( L4Mcast* mc, const uint8_t* frame, int len ) {
+    const L4McastHeader* mc_header = (const L4McastHeader*)(frame + L4Headersize);
+    uint16_t msgid = ntohs(mc_header->msgid);
+    uint32_t msg_len = ntohl(mc_header->msg_len);
+    uint32_t seq = ntohl(mc_header->seq);
+
+    if (mc->rx_done_valid && msgid == mc->rx_done_msgid) return 0;
+    if (!mc->rx_active || msgid != mc->rx_msgid) {
+        if (start_message(mc, msgid, msg_len) < 0) return 0;
+    }
+
+    uint32_t offset = seq * L4McastPayloadsize;
+    if (seq >= mc->rx_frames || msg_len != mc->rx_len) return 0;
+    uint32_t expected = mc->rx_len - offset < (uint32_t)L4McastPayloadsize ? mc->rx_len - offset
+                                                                          : (uint32_t)L4McastPayloadsize;
+    if ((uint32_t)(len - L4McastHeadersize) != expected) return 0;
+    if (mc->rx_have[seq]) {
+        mc->stats.duplicates++;
+        return 0;
+    }
+
+    uint64_t t0 = prof_now();
+    memcpy(mc->rx_data + offset, frame + L4McastHeadersize, expected);
+    prof_add(PROF_COPY, t0);
+    mc->rx_have[seq] = 1;
+    mc->rx_count++;
+    if (seq > mc->rx_highest) {
+        schedule_nack(mc);
+    }
+    if (seq >= mc->rx_highest) {
+        mc->rx_highest = seq + 1;
+    }
+    return mc->rx_count == mc->rx_frames;
+}
+
+int l4mcast_recv( L4Mcast* mc, uint8_t** data, struct timeval* timeout ) {
+    if (!mc || !mc->receiver || !data) {
+        fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
+        return -1;
+    }
+    uint64_t deadline = timeout ? now_us() + timeout->tv_sec * 1000000ull + timeout->tv_usec : 0;
+    uint8_t frame[L4Framesize];
+
+    while (1) {
+        uint64_t now = now_us();
+        if (timeout && now >= deadline) return L4_TIMEOUT;
+
+        // Wake up for the next NACK or the caller's deadline
+        uint64_t until = timeout ? deadline : 0;
+        if (mc->rx_nack_us != 0 && (until == 0 || mc->rx_nack_us < until)) until = mc->rx_nack_us;
+        struct timeval wait = { 0, 0 };
+        if (until > now) {
+            wait.tv_sec = (until - now) / 1000000;
+            wait.tv_usec = (until - now) % 1000000;
+        }
+        int len = l2sap_recvfrom_timeout(mc->l2, frame, sizeof(frame), until ? &wait : NULL);
+        if (len == L2_TIMEOUT) {
+            // Only NACK when the queued frames are handled: they may hold
+            // the repair, or the NCF for another receiver's NACK
+            if (mc->rx_nack_us != 0 && now_us() >= mc->rx_nack_us) send_nack(mc);
+            continue;
+        }
+        if (len < L4McastHeadersize) continue;
+
+        uint8_t type = ((L4Header*)frame)->type;
+        if (type == L4_MCAST_NCF) {
+            handle_ncf(mc, frame, len);
+        } else if (type == L4_MCAST && handle_data(mc, frame, len)) {
+            *data = mc->rx_data;
+            free(mc->rx_have);
+            mc->rx_data = NULL;
+            mc->rx_have = NULL;
+            mc->rx_active = 0;
+            mc->rx_nack_us = 0;
+            mc->rx_done_valid = 1;
+            mc->rx_done_msgid = mc->rx_msgid;
+            return mc->rx_len;
+        }
+    }
+}
+
+static L4Mcast* create( const char* group_ip, int port, const char* if_ip, int receiver ) {
+    if (!group_ip || !if_ip || port < 1024) {
+        fprintf(stderr, "%s: ERROR: invalid group, interface or port\n", __FUNCTION__);
+        return NULL;
+    }
+    L4Mcast* mc = calloc(1, sizeof(L4Mcast));
+    if (mc == NULL) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        return NULL;
+    }
+    mc->l2 = l2sap_mcast_create(group_ip, port, if_ip, receiver);
+    if (mc->l2 == NULL) {
+        free(mc);
+        return NULL;
+    }
+    // Receivers cannot slow the sender down, so they buffer more
+    l2sap_tune_buffers(mc->l2, receiver ? L4_MCAST_RX_FRAMES : L4_MCAST_BURST,
+                       L2_DEFAULT_RTT_US, L2_DEFAULT_BANDWIDTH);
+    mc->receiver = receiver;
+    mc->tx_msgid = (uint16_t)(getpid() ^ time(NULL));
+    // Receivers in one process draw different NACK delays
+    mc->rand_seed = (unsigned int)(getpid() ^ time(NULL) ^ (uintptr_t)mc);
+    return mc;
+}
+
+L4Mcast* l4mcast_sender_create( const char* group_ip, int port, const char* if_ip ) {
+    return create(group_ip, port, if_ip, 0);
+}
+
+L4Mcast* l4mcast_receiver_create( const char* group_ip, int port, const char* if_ip ) {
+    return create(group_ip, port, if_ip, 1);
+}
+
+void l4mcast_destroy( L4Mcast* mc ) {
+    if (mc == NULL) return;
+    if (mc->receiver) {
+        fprintf(stderr, "L4Mcast receiver: %" PRIu64 " NACKs sent, %" PRIu64 " suppressed, %" PRIu64 " duplicates\n",
+                mc->stats.nacks, mc->stats.suppressed, mc->stats.duplicates);
+    } else {
+        fprintf(stderr, "L4Mcast sender: %" PRIu64 " frames sent, %" PRIu64 " NACKs, %" PRIu64 " repairs\n",
+                mc->stats.data_sent, mc->stats.nacks, mc->stats.repairs);
+    }
+    l2sap_destroy(mc->l2);
+    free(mc->rx_data);
+    free(mc->rx_have);
+    free(mc);
+}
@@ -0,0 +1,127 @@
+#ifndef L4MCAST_H
+#define L4MCAST_H
+
+#include "l4sap.h"
+
+/* Reliable multicast of messages, e.g. one maze to many clients.
+ *
+ * The sender sends every frame of a message once to a multicast group,
+ * however many receivers there are. Receivers do not acknowledge what
+ * arrives; they ask for what is missing. A receiver that sees a gap in
+ * the frame numbers waits for a random time below L4_MCAST_NACK_DELAY_US
+ * and then sends an L4_MCAST_NACK with the missing ranges to the sender.
+ * The sender confirms a NACK to the whole group with an L4_MCAST_NCF
+ * and multicasts the repairs. Receivers that hear the NCF for frames
+ * they miss as well do not send their own NACK (suppression), and the
+ * sender repairs a frame at most once per L4_MCAST_HOLDOFF_US; NACKs
+ * that only ask for such frames are not confirmed again. So one loss
+ * costs the sender about one repair, not one per receiver.
+ *
+ * After the last frame, the sender lingers and answers NACKs until none
+ * arrived for L4_MCAST_LINGER_US. Meanwhile it repeats the last frame
+ * every L4_MCAST_HEARTBEAT_US, so that receivers that lost the end of
+ * the message find out. The sender does not know its receivers, so a
+ * receiver that misses frames for longer than that gets no repair and
+ * drops the message.
+ */
+
+#define L4_MCAST            (0x1 << 5)
+#define L4_MCAST_NACK       (L4_MCAST | L4_ACK)
+#define L4_MCAST_NCF        (L4_MCAST | L4_RESET)
+
+#define L4_MCAST_MAX_MSG        (64 * 1024 * 1024)
+
+/* Ranges of missing frames in one NACK. Later ranges wait for the next. */
+#define L4_MCAST_NACK_RANGES    32
+
+#define L4_MCAST_NACK_DELAY_US  2000
+#define L4_MCAST_NACK_RETRY_US  20000
+#define L4_MCAST_HOLDOFF_US     5000
+#define L4_MCAST_LINGER_US      200000
+#define L4_MCAST_HEARTBEAT_US   20000
+
+/* Follows the L4Header in every multicast frame. In NACKs and NCFs,
+ * seq is the number of L4McastRanges that follow.
+ */
+typedef struct L4McastHeader L4McastHeader;
+struct L4McastHeader
+{
+    uint16_t msgid;     /* network byte order */
+    uint16_t mbz;
+    uint32_t msg_len;   /* network byte order */
+    uint32_t seq;       /* frame number, network byte order */
+};
+
+typedef struct L4McastRange L4McastRange;
+struct L4McastRange
+{
+    uint32_t first;     /* network byte order */
+    uint32_t count;
+};
+
+#define L4McastHeadersize  (int)(L4Headersize + sizeof(L4McastHeader))
+#define L4McastPayloadsize (int)(L4Framesize - L4McastHeadersize)
+
+typedef struct L4McastStats L4McastStats;
+struct L4McastStats
+{
+    uint64_t data_sent;         /* first transmissions */
+    uint64_t repairs;
+    uint64_t nacks;             /* sent by a receiver, received by the sender */
+    uint64_t suppressed;        /* NACKs that a receiver did not send after an NCF */
+    uint64_t duplicates;        /* frames that a receiver had already */
+};
+
+typedef struct L4Mcast L4Mcast;
+struct L4Mcast
+{
+    L2SAP*       l2;
+    int          receiver;
+
+    /* Sending: time of the last repair per frame. */
+    uint16_t     tx_msgid;
+    uint64_t*    tx_repaired_us;
+
+    /* Receiving. rx_have has one byte per frame, rx_highest is one past
+     * the highest frame that arrived, and a NACK is due at rx_nack_us
+     * (0 if nothing is missing).
+     */
+    int          rx_active;
+    uint16_t     rx_msgid;
+    uint32_t     rx_len;
+    uint32_t     rx_frames;
+    uint32_t     rx_count;
+    uint32_t     rx_highest;
+    uint8_t*     rx_data;
+    uint8_t*     rx_have;
+    uint64_t     rx_nack_us;
+    int          rx_nacked;     /* the NACK for the current gaps was sent */
+    int          rx_done_valid;
+    uint16_t     rx_done_msgid;
+    unsigned int rand_seed;     /* for rand_r, the application's rand() is left alone */
+
+    L4McastStats stats;
+};
+
+/* Create the sender for the group group_ip:port, sending over the
+ * interface with address if_ip.
+ */
+L4Mcast* l4mcast_sender_create( const char* group_ip, int port, const char* if_ip );
+
+/* Join the group group_ip:port on the interface with address if_ip. */
+L4Mcast* l4mcast_receiver_create( const char* group_ip, int port, const char* if_ip );
+
+/* Multicasts a message of len bytes and returns len after the linger
+ * time, or -1 on error.
+ */
+int  l4mcast_send( L4Mcast* mc, const uint8_t* data, uint32_t len );
+
+/* Waits for the next complete message, at most for timeout (NULL waits
+ * forever). On success, *data points to the message, which the caller
+ * must free, and the length is returned. Returns L4_TIMEOUT otherwise.
+ */
+int  l4mcast_recv( L4Mcast* mc, uint8_t** data, struct timeval* timeout );
+
+void l4mcast_destroy( L4Mcast* mc );
+
+#endif
@@ -4,16 +4,275 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #include "l4sap.h"
 #include "l2sap.h"
+#include "prof.h"
+#include "probes.h"
 
-/* Create an L4 client.
- * It returns a dynamically allocated struct L4SAP that contains the
- * data of this L4 entity (including the pointer to the L2 entity
- * used).
+static int hello_frame( uint8_t* frame, uint8_t type, uint8_t ackno, const L4Caps* ours, const L4Ticket* ticket );
+
+// The capabilities of L4SAP itself; tickets need a file to keep them
+static void l4_local_caps( const L4SAP* l4, L4Caps* caps ) {
+    l4_legacy_caps(caps);
+    caps->version = L4_VERSION;
+    caps->flags = L4_CAP_BUNDLE | L4_CAP_BUSY | L4_CAP_DEADLINE | (l4->ticket_file ? L4_CAP_TICKET : 0);
+}
+
+/* Prepares the header prediction for the next in-order DATA frame: its
+ * L4Header without the ackno, which DATA does not use, and its ACK.
  */
-L4SAP* l4sap_create( const char* server_ip, int server_port ) {
+static void predict( L4SAP* l4 ) {
+    L4Header h = { L4_DATA, l4->expected_seqno, 0, 0 };
+    L4Header mask = { 0xff, 0xff, 0, 0xff };
+    memcpy(&l4->rx_predicted, &h, sizeof(h));
+    memcpy(&l4->rx_predict_mask, &mask, sizeof(mask));
+    l4->rx_ack.type = L4_ACK;
+    l4->rx_ack.seqno = 0;
+    l4->rx_ack.ackno = 1 - l4->expected_seqno;
+    l4->rx_ack.mbz = 0;
+}
+
+/* Sends the frames in l4->tx_bundle. Returns the number of bytes sent,
+ * 0 if there were none, or -1.
+ */
+static int flush_bundle( L4SAP* l4 ) {
+    L4Bundle* b = &l4->tx_bundle;
+    if (b->units == 0) return 0;
+    if (b->units > 1) {
+        l4->stats.bundles_sent++;
+        l4->stats.units_bundled += b->units;
+    }
+    const uint8_t* frame;
+    int len = l4_bundle_frame(b, &frame);
+    int sent = l2sap_sendto(l4->l2, frame, len);
+    l4_bundle_init(b);
+    return sent;
+}
+
+static uint64_t mono_us( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* l4sap_recv hands len bytes to the caller, whose answer may take the
+ * ACK along.
+ */
+static int delivered( L4SAP* l4, int len ) {
+    l4->ack_at_us = mono_us();
+    return len;
+}
+
+/* Called when the caller comes back after delivered(): the time since
+ * then is a sample of how long it takes to answer. One late answer
+ * stops the holding of ACKs, a few quick ones resume it. A waiting ACK
+ * that is older than L4_ACK_HOLD_US goes out now.
+ */
+static void answer_time( L4SAP* l4 ) {
+    if (l4->ack_at_us == 0) return;
+    uint64_t took = mono_us() - l4->ack_at_us;
+    l4->ack_at_us = 0;
+    if (took >= L4_ACK_HOLD_US) {
+        l4->answer_us = 2 * L4_ACK_HOLD_US;
+        flush_bundle(l4);
+        return;
+    }
+    l4->answer_us = (3 * l4->answer_us + took) / 4;
+}
+
+/* Sends an L4 frame. With bundling, it joins the frames that wait in
+ * l4->tx_bundle; an ACK waits there for the next frame if the caller
+ * usually answers within L4_ACK_HOLD_US, other frames go out at once.
+ */
+static int send_frame( L4SAP* l4, const uint8_t* frame, int len ) {
+    if (!l4->bundling) return l2sap_sendto(l4->l2, frame, len);
+
+    if (!l4_bundle_add(&l4->tx_bundle, frame, len)) {
+        if (flush_bundle(l4) < 0) return -1;
+        if (!l4_bundle_add(&l4->tx_bundle, frame, len)) return l2sap_sendto(l4->l2, frame, len);
+    }
+    if (((const L4Header*)frame)->type == L4_ACK && l4->answer_us < L4_ACK_HOLD_US) return len;
+    return flush_bundle(l4) < 0 ? -1 : len;
+}
+
+/* Receives the next L4 frame like l2sap_recvfrom_timeout_ts, and takes
+ * L4_BUNDLE frames apart. The frames that wait in the bundle are sent
+ * before it blocks.
+ */
+static int recv_frame( L4SAP* l4, uint8_t* frame, int len, struct timeval* timeout, struct timespec* rx_time ) {
+    while (1) {
+        int unit_len = l4_bundle_next(&l4->rx_bundle, frame, len);
+        if (unit_len > 0) {
+            if (rx_time) *rx_time = l4->rx_bundle_time;
+            return unit_len;
+        }
+
+        flush_bundle(l4);
+        struct timespec t;
+        int recv_len = l2sap_recvfrom_timeout_ts(l4->l2, frame, len, timeout, &t);
+        if (rx_time) *rx_time = t;
+        if (recv_len < L4Headersize || ((const L4Header*)frame)->type != L4_BUNDLE) return recv_len;
+        if (l4_bundle_open(&l4->rx_bundle, frame, recv_len)) l4->rx_bundle_time = t;
+    }
+}
+
+/* Entries of the ticket file, see l4sap_create_resume. A line is
+ *   <ip>:<port> <saved> <version> <flags> <checksum> <max_frame> <window> <ticket>
+ * with the time it was saved in seconds since the epoch, the agreed
+ * L4Caps, and the ticket in hex.
+ */
+#define TICKET_NONE     0
+#define TICKET_RESUME   1
+
+// The key of the peer of l4 in the ticket file
+static void ticket_key( const L4SAP* l4, char* key, size_t size ) {
+    snprintf(key, size, "%s:%u", inet_ntoa(l4->l2->peer_addr.sin_addr), ntohs(l4->l2->peer_addr.sin_port));
+}
+
+/* Looks up the peer of l4. Returns TICKET_RESUME with the capabilities
+ * and the ticket, or TICKET_NONE if there is no entry within
+ * L4_TICKET_LIFETIME_S.
+ */
+static int ticket_load( const L4SAP* l4, L4Caps* caps, L4Ticket* ticket ) {
+    FILE* f = fopen(l4->ticket_file, "r");
+    if (f == NULL) return TICKET_NONE;
+
+    char key[32], line[256], name[32], hex[2 * sizeof(L4Ticket) + 1];
+    ticket_key(l4, key, sizeof(key));
+    long now = (long)time(NULL);
+    int kind = TICKET_NONE;
+    while (kind == TICKET_NONE && fgets(line, sizeof(line), f)) {
+        long saved;
+        unsigned version, flags, checksum, max_frame, window;
+        if (sscanf(line, "%31s %ld %u %u %u %u %u %40s", name, &saved, &version, &flags, &checksum,
+                   &max_frame, &window, hex) != 8 ||
+            strcmp(name, key) != 0 || now - saved >= L4_TICKET_LIFETIME_S) {
+            continue;
+        }
+        uint8_t* bytes = (uint8_t*)ticket;
+        size_t n = 0;
+        while (n < sizeof(L4Ticket) && sscanf(hex + 2 * n, "%2hhx", &bytes[n]) == 1) n++;
+        if (n < sizeof(L4Ticket) || version == 0 || window == 0) continue;
+        caps->version = version;
+        caps->flags = flags;
+        caps->checksum = checksum;
+        caps->mbz = 0;
+        caps->max_frame = max_frame;
+        caps->window = window;
+        kind = TICKET_RESUME;
+    }
+    fclose(f);
+    return kind;
+}
+
+/* Replaces the entry of the peer of l4 with one of the given kind, and
+ * drops entries that are too old. The new file is renamed over the old
+ * one, so concurrent clients never read half of it.
+ */
+static void ticket_store( const L4SAP* l4, int kind, const L4Ticket* ticket ) {
+    char key[32], tmp[4096], line[256], name[32];
+    ticket_key(l4, key, sizeof(key));
+    snprintf(tmp, sizeof(tmp), "%s.%d", l4->ticket_file, (int)getpid());
+    FILE* out = fopen(tmp, "w");
+    if (out == NULL) {
+        fprintf(stderr, "%s: ERROR: cannot write %s\n", __FUNCTION__, tmp);
+        return;
+    }
+    long now = (long)time(NULL);
+    FILE* in = fopen(l4->ticket_file, "r");
+    while (in && fgets(line, sizeof(line), in)) {
+        long saved;
+        if (sscanf(line, "%31s %ld", name, &saved) == 2 && strcmp(name, key) != 0 &&
+            now - saved < L4_TICKET_LIFETIME_S) {
+            fputs(line, out);
+        }
+    }
+    if (in) fclose(in);
+
+    if (kind == TICKET_RESUME) {
+        const L4Caps* c = &l4->caps;
+        fprintf(out, "%s %ld %u %u %u %u %u ", key, now, c->version, c->flags, c->checksum, c->max_frame, c->window);
+        for (size_t n = 0; n < sizeof(L4Ticket); n++) fprintf(out, "%02x", ((const uint8_t*)ticket)[n]);
+        fputc('\n', out);
+    }
+    if (fclose(out) != 0 || rename(tmp, l4->ticket_file) != 0) {
+        fprintf(stderr, "%s: ERROR: cannot replace %s\n", __FUNCTION__, l4->ticket_file);
+        unlink(tmp);
+    }
+}
+
+/* Sends the L4_HELLO with our ticket and a DATA frame in one L4_BUNDLE,
+ * or the L4_HELLO alone if frame is NULL. Until the server answers, every
+ * transmission of the first DATA goes out like this, so that a lost
+ * bundle is repeated as a whole. Returns len, or -1.
+ */
+static int send_early( L4SAP* l4, const uint8_t* frame, int len ) {
+    flush_bundle(l4);
+    L4Bundle b;
+    l4_bundle_init(&b);
+    if (frame == NULL || !(l4->caps.flags & L4_CAP_BUNDLE) ||
+        !l4_bundle_add(&b, l4->early_hello, L4HelloTicketFramesize) || !l4_bundle_add(&b, frame, len)) {
+        // Without the bundle, the DATA is taken as from a client without a ticket
+        if (l2sap_sendto(l4->l2, l4->early_hello, L4HelloTicketFramesize) < 0) return -1;
+        return frame ? l2sap_sendto(l4->l2, frame, len) : 0;
+    }
+    l4->stats.bundles_sent++;
+    l4->stats.units_bundled += b.units;
+    const uint8_t* out;
+    int out_len = l4_bundle_frame(&b, &out);
+    return l2sap_sendto(l4->l2, out, out_len) < 0 ? -1 : len;
+}
+
+/* Gives up on the ticket when the server did not answer the first
+ * transmission of our early DATA within the RTO: it may have forgotten
+ * the ticket, or no longer take L4_HELLO or bundles. Like a client
+ * without a ticket, we send a plain L4_HELLO and go on with the legacy
+ * capabilities, and frame, the DATA of len payload bytes, loses its
+ * deadline. The entry in the ticket file was removed when the ticket
+ * was used. Returns the header length of frame.
+ */
+static int forget_ticket( L4SAP* l4, uint8_t* frame, int len, int header_len ) {
+    fprintf(stderr, "%s: no answer to our ticket, sending plain DATA\n", __FUNCTION__);
+    flush_bundle(l4);
+    l4->early = 0;
+    l4->negotiated = 0;
+    l4->bundling = 0;
+    l4_legacy_caps(&l4->caps);
+    L4Caps ours;
+    l4_local_caps(l4, &ours);
+    l4_hello_send(l4->l2, L4_HELLO, 0, &ours, NULL);
+    if (((const L4Header*)frame)->type != L4_DATA_DEADLINE) return header_len;
+    memmove(frame + L4Headersize, frame + header_len, len);
+    ((L4Header*)frame)->type = L4_DATA;
+    return L4Headersize;
+}
+
+/* Takes an L4_HELLO or L4_HELLO_ACK that arrives after l4sap_create. The
+ * L4_HELLO_ACK brings the next ticket. Returns 1 if it says that the
+ * server dropped our early DATA.
+ */
+static int handle_hello( L4SAP* l4, const uint8_t* frame, int len ) {
+    L4Caps ours;
+    l4_local_caps(l4, &ours);
+    if (!l4_hello_reply(l4->l2, frame, len, &ours, &l4->caps)) return 0;
+    l4->negotiated = 1;
+
+    const L4Header* header = (const L4Header*)frame;
+    if (header->type != L4_HELLO_ACK) return 0;
+    L4Ticket ticket;
+    if (l4->ticket_file && l4_hello_ticket(frame, len, &ticket)) {
+        ticket_store(l4, TICKET_RESUME, &ticket);
+    }
+    int rejected = l4->early && header->ackno != L4_HELLO_EARLY_OK;
+    l4->early = 0;
+    return rejected;
+}
+
+// Sets up an L4 client without the L4_HELLO
+static L4SAP* create( const char* server_ip, int server_port ) {
     // Log creation attempt
     fprintf(stderr, "%s: Creating L4SAP for %s:%d\n", __FUNCTION__, server_ip, server_port);
 
@@ -41,13 +300,134 @@ L4SAP* l4sap_create( const char* server_ip, int server_port ) {
     // Initialize L4SAP fields
     l4->send_seqno = 0;
     l4->expected_seqno = 0;
+    predict(l4);
     l4->pending_data = 0;
     l4->pending_pl_len = 0;
+    l4->bundling = 0;
+    l4->ack_at_us = 0;
+    l4->answer_us = 0;
+    l4_bundle_init(&l4->tx_bundle);
+    l4_bundle_init(&l4->rx_bundle);
+    memset(&l4->stats, 0, sizeof(l4->stats));
+    l4->stats.rto_us = L4_MAX_RTO_US;
+    l4->negotiated = 0;
+    l4_legacy_caps(&l4->caps);
+    l4->busy_retry_ms = 0;
+    l4->deadline_us = 0;
+    l4->ticket_file = NULL;
+    l4->early = 0;
+    return l4;
+}
+
+/* Create an L4 client.
+ * It returns a dynamically allocated struct L4SAP that contains the
+ * data of this L4 entity (including the pointer to the L2 entity
+ * used).
+ */
+L4SAP* l4sap_create( const char* server_ip, int server_port ) {
+    L4SAP* l4 = create(server_ip, server_port);
+    if (l4 == NULL) return NULL;
+
+    // Stop-and-wait needs nothing beyond the legacy capabilities, but the
+    // peer learns our version and whether it may send us bundles. The
+    // L4_HELLO_ACK is taken by handle_hello whenever it arrives.
+    L4Caps ours;
+    l4_local_caps(l4, &ours);
+    l4_hello_send(l4->l2, L4_HELLO, 0, &ours, NULL);
 
     fprintf(stderr, "%s: L4SAP created successfully\n", __FUNCTION__);
     return l4;
 }
 
+L4SAP* l4sap_create_resume( const char* server_ip, int server_port, const char* ticket_file ) {
+    if (!ticket_file) {
+        fprintf(stderr, "%s: ERROR: no ticket file\n", __FUNCTION__);
+        return NULL;
+    }
+    L4SAP* l4 = create(server_ip, server_port);
+    if (l4 == NULL) return NULL;
+    l4->ticket_file = strdup(ticket_file);
+    if (l4->ticket_file == NULL) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        l4sap_destroy(l4);
+        return NULL;
+    }
+
+    L4Caps ours;
+    l4_local_caps(l4, &ours);
+    L4Ticket ticket;
+    int kind = ticket_load(l4, &l4->caps, &ticket);
+    if (kind == TICKET_RESUME) {
+        // Tickets are used once; the L4_HELLO_ACK brings the next
+        ticket_store(l4, TICKET_NONE, NULL);
+        hello_frame(l4->early_hello, L4_HELLO, 0, &ours, &ticket);
+        l4->negotiated = 1;
+        l4->early = 1;
+        fprintf(stderr, "%s: L4SAP created, resuming with a ticket\n", __FUNCTION__);
+        return l4;
+    }
+
+    // As in l4sap_create; handle_hello stores the ticket of the answer
+    l4_hello_send(l4->l2, L4_HELLO, 0, &ours, NULL);
+    fprintf(stderr, "%s: L4SAP created successfully\n", __FUNCTION__);
+    return l4;
+}
+
+static uint64_t timespec_us( const struct timespec* ts ) {
+    return (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+/* Points *timeout at the time left until the deadline and returns 1, or
+ * returns 0 once it has passed. Without a deadline, *timeout is NULL.
+ */
+static int deadline_timeout( const L4SAP* l4, struct timeval* left, struct timeval** timeout ) {
+    *timeout = NULL;
+    if (!l4->deadline_us) return 1;
+    uint64_t t = mono_us();
+    if (t >= l4->deadline_us) return 0;
+    left->tv_sec = (l4->deadline_us - t) / 1000000;
+    left->tv_usec = (l4->deadline_us - t) % 1000000;
+    *timeout = left;
+    return 1;
+}
+
+// Writes the budget that is left into an L4_DATA_DEADLINE frame
+static void stamp_deadline( const L4SAP* l4, uint8_t* frame, uint64_t now_us ) {
+    if (((const L4Header*)frame)->type != L4_DATA_DEADLINE) return;
+    uint64_t left_us = l4->deadline_us > now_us ? l4->deadline_us - now_us : 1;
+    uint32_t budget = htonl(left_us > UINT32_MAX ? UINT32_MAX : (uint32_t)left_us);
+    memcpy(frame + L4Headersize, &budget, sizeof(budget));
+}
+
+/* Adds an RTT sample to the histogram and updates SRTT, RTTVAR and
+ * the RTO as in RFC 6298.
+ */
+void l4_rtt_sample( L4Stats* st, uint64_t rtt_us ) {
+    int bucket = 0;
+    while (bucket < L4_RTT_BUCKETS - 1 && (rtt_us >> (bucket + 1)) != 0) bucket++;
+    st->rtt_hist[bucket]++;
+
+    if (rtt_us > L4_MAX_RTO_US) rtt_us = L4_MAX_RTO_US;
+    if (st->rtt_samples++ == 0) {
+        st->srtt_us = rtt_us;
+        st->rttvar_us = rtt_us / 2;
+    } else {
+        uint32_t err = st->srtt_us > rtt_us ? st->srtt_us - rtt_us : rtt_us - st->srtt_us;
+        st->rttvar_us = (3 * st->rttvar_us + err) / 4;
+        st->srtt_us = (7 * st->srtt_us + rtt_us) / 8;
+    }
+    st->rto_us = st->srtt_us + 4 * st->rttvar_us;
+    if (st->rto_us < L4_MIN_RTO_US) st->rto_us = L4_MIN_RTO_US;
+    if (st->rto_us > L4_MAX_RTO_US) st->rto_us = L4_MAX_RTO_US;
+}
+
+uint64_t l4_probe_time( const L4Stats* st, uint64_t sent_us, uint64_t deadline_us ) {
+    if (st->rtt_samples == 0) return 0;
+    uint64_t pto = 2 * (uint64_t)st->srtt_us;
+    if (pto < L4_TLP_MIN_US) pto = L4_TLP_MIN_US;
+    return sent_us + pto < deadline_us ? sent_us + pto : 0;
+}
+
 /* The functions sends a packet to the network. The packet's payload
  * is copied from the buffer that it is passed as an argument from
  * the caller at L5.
@@ -59,11 +439,15 @@ L4SAP* l4sap_create( const char* server_ip, int server_port ) {
  * When a suitable ACK arrives, the function returns the number of bytes
  * that were accepted for sending (the potentially truncated packet length).
  *
- * Waiting for a correct ACK may fail after a timeout of 1 second
- * (timeval.tv_sec = 1, timeval.tv_usec = 0). The function retransmits
- * the packet in that case.
+ * Waiting for a correct ACK may fail after the retransmission timeout,
+ * which is 1 second until RTT samples exist, and doubles after each
+ * timeout. The function retransmits the packet in that case. Before the
+ * first timeout, a tail-loss probe sends it once more after 2 SRTT.
+ * Frames that are not the expected ACK do not restart the timer.
  * The function attempts up to 4 retransmissions. If the last retransmission
  * fails with a timeout as well, the function returns L4_SEND_FAILED.
+ * With a deadline, it retransmits until the deadline and then returns
+ * L4_EXPIRED.
  *
  * The function may also return:
  * - L4_QUIT if the peer entity has sent an L4_RESET packet.
@@ -78,103 +462,193 @@ int l4sap_send( L4SAP* l4, const uint8_t* data, int len ) {
         fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
         return L4_SEND_FAILED;
     }
+    answer_time(l4);
+
+    // A peer that takes deadlines gets the budget in front of the payload
+    int with_deadline = l4->deadline_us && (l4->caps.flags & L4_CAP_DEADLINE);
+    int header_len = with_deadline ? L4DeadlineHeadersize : L4Headersize;
 
-    // Truncate payload if it exceeds L4Payloadsize
-    if (len > L4Payloadsize) len = L4Payloadsize;
+    // Truncate payload if it exceeds the space in the frame
+    if (len > L4Framesize - header_len) len = L4Framesize - header_len;
 
     uint8_t packet[L4Framesize]; // Buffer for packet
+    uint64_t t0 = prof_now();
     memset(packet, 0, L4Framesize);
     struct L4Header* header = (struct L4Header*)packet; // Packet header
 
-    header->type = L4_DATA;          // Set packet type to data
+    header->type = with_deadline ? L4_DATA_DEADLINE : L4_DATA; // Set packet type to data
     header->seqno = l4->send_seqno;  // Set sequence number
     header->ackno = 0;               // Acknowledgment number (not used for L4_DATA)
     header->mbz = 0;                 // Must-be-zero field
-    memcpy(packet + sizeof(*header), data, len); // Copy payload
+    memcpy(packet + header_len, data, len); // Copy payload
+    prof_add(PROF_COPY, t0);
 
-    // Set timeout for receiving ACK
-    struct timeval timeout = {1, 0};
     uint8_t recv_buffer[L4Framesize];
     int max_retries = 5;
 
-    // Retry sending packet up to max_retries times
-    for (int attempt = 0; attempt < max_retries; attempt++) {
-        // Send packet via L2SAP
-        int sent = l2sap_sendto(l4->l2, packet, len + sizeof(*header));
+    // Retry sending packet up to max_retries times, or until the deadline
+    for (int attempt = 0; l4->deadline_us || attempt < max_retries; attempt++) {
+        // Send packet via L2SAP. The timers run on sent_us; sent_at is
+        // on the clock of the kernel's receive timestamps, for the RTT
+        struct timespec sent_at;
+        clock_gettime(CLOCK_REALTIME, &sent_at);
+        uint64_t sent_us = mono_us();
+        if (l4->deadline_us && sent_us >= l4->deadline_us) {
+            fprintf(stderr, "%s: deadline passed after %d attempts\n", __FUNCTION__, attempt);
+            return L4_EXPIRED;
+        }
+        if (attempt > 0) {
+            l4->stats.retransmits++;
+            PROBE2(l4_retransmit, header->seqno, attempt);
+        }
+        stamp_deadline(l4, packet, sent_us);
+        int sent = l4->early ? send_early(l4, packet, len + header_len)
+                             : send_frame(l4, packet, len + header_len);
         if (sent < 0) {
             fprintf(stderr, "%s: ERROR: l2sap_sendto failed\n", __FUNCTION__);
             return L4_SEND_FAILED;
         }
+        l4->stats.data_sent++;
         fprintf(stderr, "%s: Sent %d bytes, attempt %d\n", __FUNCTION__, sent, attempt + 1);
 
-        // Wait for ACK or other packets
-        int recv_len = l2sap_recvfrom_timeout(l4->l2, recv_buffer, L4Framesize, &timeout);
-        if (recv_len == L2_TIMEOUT) {
-            // Handle timeout
-            fprintf(stderr, "%s: Timeout on attempt %d\n", __FUNCTION__, attempt + 1);
-            continue;
-        }
-        if (recv_len < 0) {
-            // Handle unexpected errors
-            fprintf(stderr, "%s: ERROR: l2sap_recvfrom_timeout returned error (%d)\n", __FUNCTION__, recv_len);
-            continue;
-        }
-        if (recv_len < sizeof(*header)) {
-            // Ignore invalid packets
-            fprintf(stderr, "%s: Received invalid packet (%d bytes)\n", __FUNCTION__, recv_len);
-            continue;
-        }
+        // Wait for ACK or other packets until the retransmission timeout
+        uint64_t deadline = sent_us + l4->stats.rto_us;
+        if (l4->deadline_us && l4->deadline_us < deadline) deadline = l4->deadline_us;
+        uint64_t probe_at = attempt == 0 ? l4_probe_time(&l4->stats, sent_us, deadline) : 0;
+        int probed = 0;
+        while (1) {
+            uint64_t now = mono_us();
+            if (now >= deadline) break;
+            if (probe_at && now >= probe_at) {
+                // Tail-loss probe: the frame or its ACK is probably lost
+                probe_at = 0;
+                probed = 1;
+                l4->stats.tail_probes++;
+                l4->stats.retransmits++;
+                l4->stats.data_sent++;
+                PROBE2(l4_retransmit, header->seqno, attempt);
+                stamp_deadline(l4, packet, now);
+                int sent = l4->early ? send_early(l4, packet, len + header_len)
+                                     : send_frame(l4, packet, len + header_len);
+                if (sent < 0) {
+                    fprintf(stderr, "%s: ERROR: l2sap_sendto failed\n", __FUNCTION__);
+                    return L4_SEND_FAILED;
+                }
+                continue;
+            }
+            uint64_t left = (probe_at ? probe_at : deadline) - now;
+            struct timeval timeout = { left / 1000000, left % 1000000 };
 
-        // Process received packet
-        struct L4Header* recv_header = (struct L4Header*)recv_buffer;
-        if (recv_header->type == L4_RESET) {
-            // Handle reset packet
-            fprintf(stderr, "%s: Received L4_RESET\n", __FUNCTION__);
-            return L4_QUIT;
-        }
-        if (recv_header->type == L4_ACK) {
-            // Check if ACK matches expected acknowledgment number
-            if (recv_header->ackno == (1 - l4->send_seqno)) {
-                fprintf(stderr, "%s: Success, GOOD ACK ackno=%d\n", __FUNCTION__, recv_header->ackno);
-                l4->send_seqno = 1 - l4->send_seqno; // Toggle sequence number
-                return len; // Return number of bytes sent
-            } else {
-                fprintf(stderr, "%s: BAD ACK ackno=%d, ignoring\n", __FUNCTION__, recv_header->ackno);
+            struct timespec rx_time;
+            int recv_len = recv_frame(l4, recv_buffer, L4Framesize, &timeout, &rx_time);
+            if (recv_len == L2_TIMEOUT) {
+                if (probe_at) continue;
+                break;
+            }
+            if (recv_len < 0) {
+                // Handle unexpected errors
+                fprintf(stderr, "%s: ERROR: l2sap_recvfrom_timeout returned error (%d)\n", __FUNCTION__, recv_len);
+                continue;
+            }
+            if ((size_t)recv_len < sizeof(*header)) {
+                // Ignore invalid packets
+                fprintf(stderr, "%s: Received invalid packet (%d bytes)\n", __FUNCTION__, recv_len);
                 continue;
             }
-        }
 
-        if (recv_header->type == L4_DATA) {
-            // Unexpected DATA while waiting for ACK
-            int payload_len = recv_len - sizeof(*header);
-            if (payload_len > L4Payloadsize) payload_len = L4Payloadsize;
+            // Process received packet
+            struct L4Header* recv_header = (struct L4Header*)recv_buffer;
+            if (recv_header->type == L4_RESET) {
+                // Handle reset packet
+                fprintf(stderr, "%s: Received L4_RESET\n", __FUNCTION__);
+                return L4_QUIT;
+            }
+            if (recv_header->type == L4_HELLO || recv_header->type == L4_HELLO_ACK) {
+                // The peer started after us, our L4_HELLO timed out, or it
+                // answers the L4_HELLO that came with our early DATA
+                if (handle_hello(l4, recv_buffer, recv_len)) {
+                    // The server dropped the early DATA: no need to wait
+                    fprintf(stderr, "%s: early DATA not accepted, sending it again\n", __FUNCTION__);
+                    probed = 1;
+                    l4->stats.retransmits++;
+                    l4->stats.data_sent++;
+                    stamp_deadline(l4, packet, mono_us());
+                    if (send_frame(l4, packet, len + header_len) < 0) {
+                        fprintf(stderr, "%s: ERROR: l2sap_sendto failed\n", __FUNCTION__);
+                        return L4_SEND_FAILED;
+                    }
+                }
+                continue;
+            }
+            if (recv_header->type == L4_BUSY) {
+                // The server did not take our frame and wants it later
+                if (recv_header->seqno == l4->send_seqno && recv_len >= L4BusyFramesize) {
+                    uint16_t retry_ms;
+                    memcpy(&retry_ms, recv_buffer + L4Headersize, sizeof(retry_ms));
+                    l4->busy_retry_ms = ntohs(retry_ms);
+                    fprintf(stderr, "%s: server busy, retry after %u ms\n", __FUNCTION__, l4->busy_retry_ms);
+                    return L4_SERVER_BUSY;
+                }
+                continue;
+            }
+            if (recv_header->type == L4_ACK) {
+                // Check if ACK matches expected acknowledgment number
+                if (recv_header->ackno == (1 - l4->send_seqno)) {
+                    fprintf(stderr, "%s: Success, GOOD ACK ackno=%d\n", __FUNCTION__, recv_header->ackno);
+                    PROBE1(l4_ack, recv_header->ackno);
+                    if (attempt == 0 && !probed) {
+                        uint64_t rx_us = timespec_us(&rx_time);
+                        uint64_t tx_us = timespec_us(&sent_at);
+                        l4_rtt_sample(&l4->stats, rx_us > tx_us ? rx_us - tx_us : 0);
+                    }
+                    l4->send_seqno = 1 - l4->send_seqno; // Toggle sequence number
+                    l4->early = 0;
+                    return len; // Return number of bytes sent
+                } else {
+                    fprintf(stderr, "%s: BAD ACK ackno=%d, ignoring\n", __FUNCTION__, recv_header->ackno);
+                    continue;
+                }
+            }
 
-            char payload_str[L4Payloadsize + 1];
-            memcpy(payload_str, recv_buffer + sizeof(*header), payload_len);
-            payload_str[payload_len] = '\0';
-            fprintf(stderr, "%s: ERROR: received unexpected data: '%s'\n", __FUNCTION__, payload_str);
+            if (recv_header->type == L4_DATA) {
+                // Unexpected DATA while waiting for ACK
+                int payload_len = recv_len - sizeof(*header);
+                if (payload_len > L4Payloadsize) payload_len = L4Payloadsize;
 
-            // Send ACK for unexpected DATA
-            uint8_t ack_packet[sizeof(*header)];
-            struct L4Header* ack_header = (struct L4Header*)ack_packet;
-            ack_header->type = L4_ACK;
-            ack_header->seqno = 0; 
-            ack_header->ackno = 1 - recv_header->seqno;
-            ack_header->mbz = 0;
-            l2sap_sendto(l4->l2, ack_packet, sizeof(*header));
-
-            // Store pending data for later processing
-            if (!l4->pending_data) {
-                l4->pending_data = 1;
-                l4->pending_header = *recv_header;
-                l4->pending_pl_len = payload_len;
-                memcpy(l4->pending_pl_buffer, recv_buffer + sizeof(*header), payload_len);
+                char payload_str[L4Payloadsize + 1];
+                memcpy(payload_str, recv_buffer + sizeof(*header), payload_len);
+                payload_str[payload_len] = '\0';
+                fprintf(stderr, "%s: ERROR: received unexpected data: '%s'\n", __FUNCTION__, payload_str);
+
+                // Send ACK for unexpected DATA
+                uint8_t ack_packet[sizeof(*header)];
+                struct L4Header* ack_header = (struct L4Header*)ack_packet;
+                ack_header->type = L4_ACK;
+                ack_header->seqno = 0; 
+                ack_header->ackno = 1 - recv_header->seqno;
+                ack_header->mbz = 0;
+                send_frame(l4, ack_packet, sizeof(*header));
+
+                // Store pending data for later processing
+                if (!l4->pending_data) {
+                    l4->pending_data = 1;
+                    l4->pending_header = *recv_header;
+                    l4->pending_pl_len = payload_len;
+                    memcpy(l4->pending_pl_buffer, recv_buffer + sizeof(*header), payload_len);
+                }
+                continue;
             }
-            continue;
         }
+
+        // Handle timeout: back off until the next RTT sample
+        fprintf(stderr, "%s: Timeout on attempt %d\n", __FUNCTION__, attempt + 1);
+        if (l4->early) header_len = forget_ticket(l4, packet, len, header_len);
+        l4->stats.rto_us *= 2;
+        if (l4->stats.rto_us > L4_MAX_RTO_US) l4->stats.rto_us = L4_MAX_RTO_US;
     }
 
-    fprintf(stderr, "%s: ERROR: Max send retries reached\n", __FUNCTION__);
+    fprintf(stderr, "%s: ERROR: Max send retries reached, %u frames dropped by our kernel so far\n",
+            __FUNCTION__, l4->l2->stats.kernel_drops);
     return L4_SEND_FAILED; 
 }
 
@@ -198,13 +672,21 @@ int l4sap_recv( L4SAP* l4, uint8_t* data, int len ) {
         fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
         return -1;
     }
+    answer_time(l4);
+
+    // A resumed client whose server speaks first still hands in its ticket
+    if (l4->early) {
+        send_early(l4, NULL, 0);
+    }
 
     // Check if there is pending data from previous reception
     if (l4->pending_data) {
         struct L4Header* hdr = &l4->pending_header;
         if (hdr->type == L4_DATA && hdr->seqno == l4->expected_seqno) {
             int copy_len = (l4->pending_pl_len < len) ? l4->pending_pl_len : len;
+            uint64_t t0 = prof_now();
             memcpy(data, l4->pending_pl_buffer, copy_len);
+            prof_add(PROF_COPY, t0);
 
             uint8_t ack_packet[sizeof(*hdr)];
             struct L4Header* ack_header = (struct L4Header*)ack_packet;
@@ -212,11 +694,12 @@ int l4sap_recv( L4SAP* l4, uint8_t* data, int len ) {
             ack_header->seqno = 0;
             ack_header->mbz = 0;
             ack_header->ackno = 1 - hdr->seqno;
-            l2sap_sendto(l4->l2, ack_packet, sizeof(*hdr));
+            send_frame(l4, ack_packet, sizeof(*hdr));
 
             l4->expected_seqno = 1 - l4->expected_seqno;
+            predict(l4);
             l4->pending_data = 0;
-            return copy_len;
+            return delivered(l4, copy_len);
         }
 
         // If pending data is not valid, send ACK for the last received packet
@@ -226,7 +709,7 @@ int l4sap_recv( L4SAP* l4, uint8_t* data, int len ) {
         ack_header->seqno = 0;
         ack_header->mbz = 0;
         ack_header->ackno = 1 - hdr->seqno;
-        l2sap_sendto(l4->l2, ack_packet, sizeof(*hdr));
+        send_frame(l4, ack_packet, sizeof(*hdr));
         l4->pending_data = 0;
     }
 
@@ -234,21 +717,48 @@ int l4sap_recv( L4SAP* l4, uint8_t* data, int len ) {
     uint8_t packet[L4Framesize];
     memset(packet, 0, L4Framesize);
     while (1) {
-        int recv_len = l2sap_recvfrom_timeout(l4->l2, packet, L2Framesize, NULL);
+        struct timeval left;
+        struct timeval* timeout;
+        if (!deadline_timeout(l4, &left, &timeout)) {
+            fprintf(stderr, "%s: deadline passed\n", __FUNCTION__);
+            return L4_EXPIRED;
+        }
+        int recv_len;
+        if (len >= L4Payloadsize && l4->rx_bundle.units == 0) {
+            // Header prediction: the payload goes straight to the caller,
+            // and the expected DATA frame costs one compare and the ACK
+            // that is ready
+            flush_bundle(l4);
+            recv_len = l2sap_recvfrom_split(l4->l2, packet, L4Headersize, data, len, timeout, NULL);
+            uint32_t word;
+            memcpy(&word, packet, sizeof(word));
+            if (recv_len >= L4Headersize && (word & l4->rx_predict_mask) == l4->rx_predicted) {
+                send_frame(l4, (const uint8_t*)&l4->rx_ack, L4Headersize);
+                l4->expected_seqno = 1 - l4->expected_seqno;
+                predict(l4);
+                return delivered(l4, recv_len - L4Headersize);
+            }
+
+            // Anything else takes the general path with the whole frame
+            if (recv_len > L4Headersize) {
+                memcpy(packet + L4Headersize, data, recv_len - L4Headersize);
+            }
+            if (recv_len >= L4Headersize && ((struct L4Header*)packet)->type == L4_BUNDLE) {
+                l4_bundle_open(&l4->rx_bundle, packet, recv_len);
+                continue;
+            }
+        } else {
+            recv_len = recv_frame(l4, packet, L4Framesize, timeout, NULL);
+        }
         if (recv_len == L2_TIMEOUT) {
             continue;
         }
-        if (recv_len < sizeof(struct L4Header)) {
+        if (recv_len < L4Headersize) {
             // Ignore invalid packets
             fprintf(stderr, "%s: Received invalid packet (%d bytes)\n", __FUNCTION__, recv_len);
             continue;
         }
 
-        if (recv_len < sizeof(struct L4Header)) {
-            fprintf(stderr, "%s: Received too short packet (%d bytes)\n", __FUNCTION__, recv_len);
-            continue;  
-        }
-
         // Process received packet
         struct L4Header* header = (struct L4Header*)packet;
         int payload_len = recv_len - sizeof(*header);
@@ -264,6 +774,10 @@ int l4sap_recv( L4SAP* l4, uint8_t* data, int len ) {
             fprintf(stderr, "%s: Received L4_RESET\n", __FUNCTION__);
             return L4_QUIT;
         }
+        if (header->type == L4_HELLO || header->type == L4_HELLO_ACK) {
+            handle_hello(l4, packet, recv_len);
+            continue;
+        }
         if (header->type == L4_DATA) {
             // Send ACK for L4_DATA
             uint8_t ack_packet[sizeof(*header)];
@@ -275,16 +789,19 @@ int l4sap_recv( L4SAP* l4, uint8_t* data, int len ) {
             // Check if L4_DATA has expected sequence number
             if (header->seqno == l4->expected_seqno) {
                 int copy_len = payload_len;
+                uint64_t t0 = prof_now();
                 memcpy(data, packet + sizeof(*header), copy_len); // Copy payload
+                prof_add(PROF_COPY, t0);
 
                 ack_header->ackno = 1 - header->seqno;
-                l2sap_sendto(l4->l2, ack_packet, sizeof(*header));
+                send_frame(l4, ack_packet, sizeof(*header));
 
                 l4->expected_seqno = 1 - l4->expected_seqno;
-                return copy_len; // Return number of bytes received
+                predict(l4);
+                return delivered(l4, copy_len); // Return number of bytes received
             } else {
                 ack_header->ackno = 1 - header->seqno;
-                l2sap_sendto(l4->l2, ack_packet, sizeof(*header));
+                send_frame(l4, ack_packet, sizeof(*header));
                 continue;
             }
         }
@@ -311,8 +828,224 @@ void l4sap_destroy( L4SAP* l4 ) {
     }
 
     // Clean up L2SAP and L4SAP
+    flush_bundle(l4);
+    l4sap_print_stats(l4, stderr);
     l2sap_destroy(l4->l2);
     l4->l2 = NULL; // Prevent double-free
+    free(l4->ticket_file);
     free(l4);
     fprintf(stderr, "%s: L4SAP destroyed\n", __FUNCTION__);
-}
\ No newline at end of file
+}
+
+int l4sap_set_bundling( L4SAP* l4, int on ) {
+    if (!l4) return 0;
+    if (!on) flush_bundle(l4);
+    l4->bundling = on && (l4->caps.flags & L4_CAP_BUNDLE);
+    return l4->bundling;
+}
+
+void l4sap_flush( L4SAP* l4 ) {
+    if (!l4) return;
+    l4->ack_at_us = 0;
+    flush_bundle(l4);
+}
+
+void l4sap_set_deadline( L4SAP* l4, uint32_t budget_ms ) {
+    if (!l4) return;
+    l4->deadline_us = 0;
+    if (budget_ms == 0) return;
+    l4->deadline_us = mono_us() + (uint64_t)budget_ms * 1000;
+}
+
+void l4sap_print_stats( const L4SAP* l4, FILE* out ) {
+    if (l4 == NULL) return;
+    l4_print_stats(&l4->stats, "L4SAP", out);
+}
+
+void l4_print_stats( const L4Stats* st, const char* name, FILE* out ) {
+    fprintf(out, "%s: %" PRIu64 " DATA frames sent, %" PRIu64 " retransmissions, "
+                 "%" PRIu64 " RTT samples, srtt %u us, rttvar %u us, rto %u us\n",
+            name, st->data_sent, st->retransmits, st->rtt_samples,
+            st->srtt_us, st->rttvar_us, st->rto_us);
+    if (st->tail_probes) {
+        fprintf(out, "%s: %" PRIu64 " tail-loss probes\n", name, st->tail_probes);
+    }
+    if (st->bundles_sent) {
+        fprintf(out, "%s: %" PRIu64 " bundles with %" PRIu64 " frames\n",
+                name, st->bundles_sent, st->units_bundled);
+    }
+    for (int i = 0; i < L4_RTT_BUCKETS; i++) {
+        if (st->rtt_hist[i] == 0) continue;
+        if (i == L4_RTT_BUCKETS - 1) {
+            fprintf(out, "  RTT >= %u us: %u\n", 1u << i, st->rtt_hist[i]);
+        } else {
+            fprintf(out, "  RTT %u..%u us: %u\n", i ? 1u << i : 0, (1u << (i + 1)) - 1, st->rtt_hist[i]);
+        }
+    }
+}
+
+void l4_legacy_caps( L4Caps* caps ) {
+    memset(caps, 0, sizeof(*caps));
+    caps->checksum = L4_CHECKSUM_XOR;
+    caps->max_frame = L4Framesize;
+    caps->window = 1;
+}
+
+// Fills in an L4_HELLO or L4_HELLO_ACK and returns its length
+static int hello_frame( uint8_t* frame, uint8_t type, uint8_t ackno, const L4Caps* ours, const L4Ticket* ticket ) {
+    L4Header* header = (L4Header*)frame;
+    header->type = type;
+    header->seqno = 0;
+    header->ackno = ackno;
+    header->mbz = 0;
+    L4Caps* caps = (L4Caps*)(frame + L4Headersize);
+    *caps = *ours;
+    caps->mbz = 0;
+    caps->max_frame = htons(ours->max_frame);
+    caps->window = htons(ours->window);
+    if (ticket == NULL) return L4HelloFramesize;
+    memcpy(frame + L4HelloFramesize, ticket, sizeof(*ticket));
+    return L4HelloTicketFramesize;
+}
+
+void l4_hello_send( L2SAP* l2, uint8_t type, uint8_t ackno, const L4Caps* ours, const L4Ticket* ticket ) {
+    uint8_t frame[L4HelloTicketFramesize];
+    l2sap_sendto(l2, frame, hello_frame(frame, type, ackno, ours, ticket));
+}
+
+int l4_hello_ticket( const uint8_t* frame, int len, L4Ticket* ticket ) {
+    if (len < L4HelloTicketFramesize) return 0;
+    memcpy(ticket, frame + L4HelloFramesize, sizeof(*ticket));
+    return 1;
+}
+
+int l4_hello_agree( const uint8_t* frame, int len, const L4Caps* ours, L4Caps* agreed ) {
+    if (len < L4HelloFramesize) {
+        fprintf(stderr, "%s: ERROR: L4_HELLO of %d bytes is too short\n", __FUNCTION__, len);
+        return 0;
+    }
+    const L4Caps* theirs = (const L4Caps*)(frame + L4Headersize);
+    uint16_t max_frame = ntohs(theirs->max_frame);
+    uint16_t window = ntohs(theirs->window);
+    if (theirs->version == 0 || max_frame < L4Headersize + 1 || window == 0) {
+        fprintf(stderr, "%s: ERROR: invalid capabilities in L4_HELLO\n", __FUNCTION__);
+        return 0;
+    }
+    agreed->version = theirs->version < ours->version ? theirs->version : ours->version;
+    agreed->flags = theirs->flags & ours->flags;
+    agreed->checksum = theirs->checksum == ours->checksum ? ours->checksum : L4_CHECKSUM_XOR;
+    agreed->mbz = 0;
+    agreed->max_frame = max_frame < ours->max_frame ? max_frame : ours->max_frame;
+    agreed->window = window < ours->window ? window : ours->window;
+    return 1;
+}
+
+int l4_hello( L2SAP* l2, const L4Caps* ours, L4Caps* agreed ) {
+    uint8_t frame[L4Framesize];
+
+    l4_legacy_caps(agreed);
+    for (int attempt = 0; attempt < L4_HELLO_TRIES; attempt++) {
+        l4_hello_send(l2, L4_HELLO, 0, ours, NULL);
+        uint64_t deadline = mono_us() + L4_HELLO_TIMEOUT_US;
+        while (1) {
+            uint64_t now = mono_us();
+            if (now >= deadline) break;
+            uint64_t left = deadline - now;
+            struct timeval timeout = { left / 1000000, left % 1000000 };
+
+            int len = l2sap_recvfrom_timeout(l2, frame, sizeof(frame), &timeout);
+            if (len == L2_TIMEOUT) break;
+            if (len < L4Headersize) continue;
+
+            const L4Header* header = (const L4Header*)frame;
+            if (header->type == L4_HELLO_ACK && l4_hello_agree(frame, len, ours, agreed)) {
+                return 1;
+            }
+            if (header->type == L4_HELLO && l4_hello_reply(l2, frame, len, ours, agreed)) {
+                // Both sides started at the same time
+                return 1;
+            }
+        }
+    }
+    fprintf(stderr, "%s: no answer, the peer only knows stop-and-wait\n", __FUNCTION__);
+    return 0;
+}
+
+int l4_hello_reply( L2SAP* l2, const uint8_t* frame, int len, const L4Caps* ours, L4Caps* agreed ) {
+    const L4Header* header = (const L4Header*)frame;
+    if (!l4_hello_agree(frame, len, ours, agreed)) return 0;
+    if (header->type == L4_HELLO) {
+        l4_hello_send(l2, L4_HELLO_ACK, 0, ours, NULL);
+    }
+    return 1;
+}
+
+void l4_bundle_init( L4Bundle* b ) {
+    b->len = 0;
+    b->units = 0;
+    b->off = 0;
+}
+
+int l4_bundle_add( L4Bundle* b, const uint8_t* frame, int len ) {
+    int used = b->len ? b->len : L4Headersize;
+    if (len < L4Headersize || used + L4BundleUnitHeadersize + len > L4Framesize) return 0;
+
+    L4Header* header = (L4Header*)b->frame;
+    if (b->units == 0) {
+        header->type = L4_BUNDLE;
+        header->ackno = 0;
+        header->mbz = 0;
+    }
+    uint16_t unit_len = htons(len);
+    memcpy(b->frame + used, &unit_len, sizeof(unit_len));
+    memcpy(b->frame + used + L4BundleUnitHeadersize, frame, len);
+    b->len = used + L4BundleUnitHeadersize + len;
+    b->units++;
+    header->seqno = b->units;
+    return 1;
+}
+
+int l4_bundle_frame( const L4Bundle* b, const uint8_t** frame ) {
+    if (b->units == 1) {
+        *frame = b->frame + L4Headersize + L4BundleUnitHeadersize;
+        return b->len - L4Headersize - L4BundleUnitHeadersize;
+    }
+    *frame = b->frame;
+    return b->len;
+}
+
+int l4_bundle_open( L4Bundle* b, const uint8_t* frame, int len ) {
+    l4_bundle_init(b);
+    const L4Header* header = (const L4Header*)frame;
+    if (len > L4Framesize || header->mbz != 0 || header->seqno == 0) {
+        fprintf(stderr, "%s: ERROR: malformed L4_BUNDLE of %d bytes\n", __FUNCTION__, len);
+        return 0;
+    }
+    memcpy(b->frame, frame, len);
+    b->len = len;
+    b->units = header->seqno;
+    b->off = L4Headersize;
+    return 1;
+}
+
+int l4_bundle_next( L4Bundle* b, uint8_t* frame, int len ) {
+    if (b->units == 0) return 0;
+    if (b->off + L4BundleUnitHeadersize > b->len) {
+        l4_bundle_init(b);
+        return 0;
+    }
+    uint16_t unit_len;
+    memcpy(&unit_len, b->frame + b->off, sizeof(unit_len));
+    unit_len = ntohs(unit_len);
+    int start = b->off + L4BundleUnitHeadersize;
+    if (unit_len < L4Headersize || start + unit_len > b->len) {
+        fprintf(stderr, "%s: ERROR: malformed unit in L4_BUNDLE\n", __FUNCTION__);
+        l4_bundle_init(b);
+        return 0;
+    }
+    int copy_len = unit_len < len ? unit_len : len;
+    memcpy(frame, b->frame + start, copy_len);
+    b->off = start + unit_len;
+    if (--b->units == 0) l4_bundle_init(b);
+    return copy_len;
+}
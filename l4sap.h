@@ -1,6 +1,7 @@
 #ifndef L4SAP_H
 #define L4SAP_H
 
+#include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
@@ -15,6 +16,43 @@
 #define L4_DATA     0x1 << 1
 #define L4_ACK      0x1 << 2
 
+/* Capability exchange at session start, see L4Caps. Peers that do not
+ * know this type ignore it.
+ */
+#define L4_HELLO        (0x1 << 4)
+#define L4_HELLO_ACK    (L4_HELLO | L4_ACK)
+
+/* Several L4 frames in one L2 frame, see L4Bundle. Only sent to peers
+ * that agreed on L4_CAP_BUNDLE.
+ */
+#define L4_BUNDLE       (0x1 << 6)
+
+/* Set in the type of a frame that carries 32-bit frame numbers in an
+ * L4Seq32 extension instead of the 8-bit seqno and ackno, see
+ * L4_CAP_SEQ32.
+ */
+#define L4_SEQ32        (0x1 << 7)
+
+/* Answer of an overloaded server to a DATA frame that it did not take,
+ * instead of the ACK, see l4server_set_admission. Only sent to peers
+ * that agreed on L4_CAP_BUSY. The seqno is that of the DATA frame, and
+ * the L4Header is followed by the time in milliseconds after which to
+ * send it again, 16 bits in network byte order.
+ */
+#define L4_BUSY         (L4_RESET | L4_ACK)
+#define L4BusyFramesize (int)(L4Headersize + sizeof(uint16_t))
+
+/* DATA frame of a request with a deadline, see l4sap_set_deadline. Only
+ * sent to peers that agreed on L4_CAP_DEADLINE. The L4Header is followed
+ * by the time in microseconds that the sender still waits for the
+ * answer when it sends the frame, 32 bits in network byte order, and
+ * then the payload. The clocks of the peers need not agree: the
+ * receiver counts the budget from the frame's arrival.
+ */
+#define L4_DATA_DEADLINE        (L4_DATA | L4_RESET)
+#define L4DeadlineHeadersize    (int)(L4Headersize + sizeof(uint32_t))
+#define L4DeadlinePayloadsize   (int)(L4Framesize - L4DeadlineHeadersize)
+
 /* Special error codes that L5 expects with exactly these
  * values.
  */
@@ -27,6 +65,12 @@
 #define L4_DATA_RECEIVED    -103
 #define L4_NODATA_RECEIVED  -104
 
+#define L4_SERVER_BUSY      -105
+#define L4_EXPIRED          -106
+
+#define L4_WOULD_BLOCK      -107
+#define L4_WRITABLE         -108
+
 /* The design of the L4 layer is the following:
  *
  * The L4 layer provides a reliable datagram service using
@@ -76,6 +120,146 @@ struct L4Header
  * You can add any number of data structures that are convenient for you.
  */
 
+/* Bounds of the retransmission timeout. The RTO starts at the upper
+ * bound, which is the fixed 1 second timeout of the original design,
+ * and follows the measured RTT (RFC 6298) once samples exist.
+ */
+#define L4_MIN_RTO_US   200000
+#define L4_MAX_RTO_US   1000000
+
+/* Tail-loss probe. Nothing after the last frame of a message produces
+ * duplicate ACKs, so its loss would only be noticed by the RTO. Once RTT
+ * samples exist, an unacknowledged tail is sent once more after 2 SRTT,
+ * but not before L4_TLP_MIN_US, and the ACK for the probe repairs it
+ * within a few RTTs.
+ */
+#define L4_TLP_MIN_US   10000
+
+/* With bundling, an ACK waits for the answer of the caller only while
+ * the caller answers within this time on average, so that it reaches
+ * the peer before its tail-loss probe. Otherwise it goes out at once.
+ */
+#define L4_ACK_HOLD_US  (L4_TLP_MIN_US / 2)
+
+/* Number of buckets of the RTT histogram. Bucket i counts samples
+ * from 2^i to 2^(i+1)-1 microseconds, the last one everything above.
+ */
+#define L4_RTT_BUCKETS  24
+
+/* Capabilities and tunables of an L4 entity. They follow the L4Header
+ * of L4_HELLO and L4_HELLO_ACK frames, with the 16-bit fields in network
+ * byte order. Each side sends its own; both agree on the lower version
+ * and limits and on the flags that both have.
+ *
+ * A peer that does not answer the L4_HELLO, such as the prebuilt test
+ * servers, gets the legacy capabilities: version 0, stop-and-wait, full
+ * frames, the L2 XOR checksum. l4_hello waits L4_HELLO_TRIES *
+ * L4_HELLO_TIMEOUT_US for the answer; l4sap_create does not wait.
+ */
+#define L4_VERSION          1
+
+#define L4_CAP_BULK         (0x1 << 0)  /* L4Bulk frames with a sliding window */
+#define L4_CAP_BUNDLE       (0x1 << 1)  /* accepts L4_BUNDLE frames */
+#define L4_CAP_SEQ32        (0x1 << 2)  /* L4_SEQ32 frames, windows of 128 frames and more */
+#define L4_CAP_SEGMENT      (0x1 << 3)  /* L4Bulk DATA frames carry their payload size */
+#define L4_CAP_TICKET       (0x1 << 4)  /* issues and takes L4Tickets */
+#define L4_CAP_BUSY         (0x1 << 5)  /* takes L4_BUSY */
+#define L4_CAP_DEADLINE     (0x1 << 6)  /* takes L4_DATA_DEADLINE */
+
+#define L4_CHECKSUM_XOR     0           /* only the L2 header checksum */
+
+#define L4_HELLO_TRIES      2
+#define L4_HELLO_TIMEOUT_US 100000
+
+typedef struct L4Caps L4Caps;
+struct L4Caps
+{
+    uint8_t  version;
+    uint8_t  flags;      /* L4_CAP_* */
+    uint8_t  checksum;   /* L4_CHECKSUM_* */
+    uint8_t  mbz;
+    uint16_t max_frame;  /* largest L4 frame, including the header */
+    uint16_t window;     /* frames in flight, 1 for stop-and-wait */
+};
+
+#define L4HelloFramesize (int)(L4Headersize + sizeof(L4Caps))
+
+/* Resumption (0-RTT). A server that agrees on L4_CAP_TICKET appends an
+ * L4Ticket to every L4_HELLO_ACK. A client that comes back within
+ * L4_TICKET_LIFETIME_S starts with the capabilities that it agreed on
+ * last time and does not wait for the handshake: it appends the ticket
+ * to its L4_HELLO and sends it in one L4_BUNDLE with its first DATA
+ * frame. The server takes that early DATA only if the ticket's MAC, its
+ * lifetime and the client's IP address check out and no other client
+ * used the ticket before; its L4_HELLO_ACK then has ackno
+ * L4_HELLO_EARLY_OK. Otherwise it drops the early DATA, which the client
+ * sends again at once when the L4_HELLO_ACK says so. A replayed opening
+ * frame is therefore never taken twice. Tickets are opaque to clients
+ * and used once; each L4_HELLO_ACK brings the next one.
+ */
+#define L4_TICKET_LIFETIME_S 600
+#define L4_HELLO_EARLY_OK    1
+
+typedef struct L4Ticket L4Ticket;
+struct L4Ticket
+{
+    uint32_t expiry;     /* seconds since the epoch, network byte order */
+    uint32_t nonce[2];   /* unique per ticket */
+    uint8_t  mac[8];     /* of the fields above and the client's IPv4 address */
+};
+
+#define L4HelloTicketFramesize (int)(L4HelloFramesize + sizeof(L4Ticket))
+
+/* The 8-bit seqno and ackno of the L4Header tell frames apart only
+ * within 128 frames. Frames of type L4_SEQ32 carry this extension
+ * behind the headers of their transfer mode instead, and the L4Header's
+ * seqno and ackno are 0.
+ */
+typedef struct L4Seq32 L4Seq32;
+struct L4Seq32
+{
+    uint32_t seqno;      /* network byte order */
+    uint32_t ackno;      /* network byte order */
+};
+
+/* An L4_BUNDLE frame packs small L4 frames, the units, such as an ACK
+ * and the next short DATA, so that they cost one L2 header and one
+ * system call. Its L4Header has the number of units in seqno. Each unit
+ * follows as a 16-bit length in network byte order and the L4 frame
+ * itself, with its own L4Header. A receiver handles the units in order
+ * as if they had arrived one by one.
+ */
+#define L4BundleUnitHeadersize (int)sizeof(uint16_t)
+
+typedef struct L4Bundle L4Bundle;
+struct L4Bundle
+{
+    uint8_t frame[L4Framesize];
+    int     len;        /* bytes used, 0 if empty */
+    int     units;
+    int     off;        /* next unit to unpack */
+};
+
+typedef struct L4Stats L4Stats;
+
+struct L4Stats
+{
+    uint64_t data_sent;          /* DATA frames, including retransmissions */
+    uint64_t retransmits;
+
+    /* RTT between sending DATA and the arrival of its ACK in the
+     * kernel. Retransmitted frames are not sampled (Karn). */
+    uint64_t rtt_samples;
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t rto_us;
+    uint32_t rtt_hist[L4_RTT_BUCKETS];
+
+    uint64_t tail_probes;        /* retransmissions by the tail-loss probe */
+    uint64_t bundles_sent;       /* L4_BUNDLE frames with 2 or more units */
+    uint64_t units_bundled;
+};
+
 /* The data structure for maintaining the L4 entity should
  * be called L4SAP.
  */
@@ -97,13 +281,44 @@ struct L4SAP
     uint8_t pending_data;
     int pending_pl_len;
     struct L4Header pending_header;
+    uint32_t rx_predicted;       // header of the next in-order DATA, see predict()
+    uint32_t rx_predict_mask;
+    L4Header rx_ack;             // the ACK for it
+    L4Stats stats;
+    int negotiated;              // the peer answered our L4_HELLO
+    L4Caps caps;                 // agreed capabilities, legacy ones otherwise
+    int bundling;                // l4sap_set_bundling is on and the peer agreed
+    uint64_t ack_at_us;          // when l4sap_recv last returned data, 0 once the caller came back
+    uint64_t answer_us;          // how long the caller takes to answer, smoothed
+    L4Bundle tx_bundle;          // frames that wait to go out together
+    L4Bundle rx_bundle;          // units of a received L4_BUNDLE that wait
+    struct timespec rx_bundle_time;
+    uint16_t busy_retry_ms;      // from the last L4_BUSY, see l4sap_send
+    uint64_t deadline_us;        // CLOCK_MONOTONIC, see l4sap_set_deadline, 0 if none
+    char* ticket_file;           // see l4sap_create_resume, NULL otherwise
+    int early;                   // our DATA goes out with early_hello until the server answers
+    uint8_t early_hello[L4HelloTicketFramesize];
 };
 
 
-/* Create an L4 client.
+/* Create an L4 client. It sends our L4Caps to the peer in an L4_HELLO
+ * and returns without waiting. Until l4sap_send or l4sap_recv receives
+ * the L4_HELLO_ACK, the client uses the legacy capabilities, so a peer
+ * that never answers costs nothing.
  */
 L4SAP* l4sap_create( const char* server_ip, int server_port );
 
+/* Like l4sap_create, but keeps what it learns about servers in
+ * ticket_file. A server that gave us an L4Ticket gets our first DATA
+ * together with the ticket, and the client starts with the
+ * capabilities that were agreed before. If the server does not answer
+ * the first DATA with the ticket within the RTO, the client goes on
+ * without the ticket and its capabilities. The file has one line per
+ * server and is replaced as a whole, so clients that share it may lose
+ * an update, but never see a broken one.
+ */
+L4SAP* l4sap_create_resume( const char* server_ip, int server_port, const char* ticket_file );
+
 /* l4sap_send is a blocking function that sends data to
  *l4sap_create its peer entity.
  *
@@ -115,9 +330,23 @@ L4SAP* l4sap_create( const char* server_ip, int server_port );
  * payload. If len exceed L4Payloadsize, the send is truncated
  * to L4Payloadsize. The rest is ignored.
  *
- * l4sap_send resends up to 5 times after a timeout of 1
- * second if it does not receive a correct ACK. After that, it
- * gives up and returns L4_TIMEOUT as an error code.
+ * l4sap_send resends up to 5 times after a timeout if it does
+ * not receive a correct ACK. The timeout follows the measured RTT,
+ * between L4_MIN_RTO_US and 1 second, and doubles after every
+ * timeout. After that, it gives up and returns L4_TIMEOUT as an
+ * error code.
+ *
+ * An overloaded server may answer with L4_BUSY instead of the ACK.
+ * l4sap_send then returns L4_SERVER_BUSY at once and sets
+ * l4->busy_retry_ms to the time after which the server wants the data
+ * again; the data was not delivered.
+ *
+ * With a deadline (l4sap_set_deadline), the payload is truncated to
+ * L4DeadlinePayloadsize for peers that agreed on L4_CAP_DEADLINE, and
+ * every transmission tells the peer how much of the budget is left.
+ * l4sap_send retransmits until the deadline instead of 5 times, and
+ * returns L4_EXPIRED if it passes without an ACK; the data may or may
+ * not have been delivered.
  *
  * While l4sap_send waits for a suitable ACK, it can also
  * receive DATA and RESET packets.
@@ -138,6 +367,14 @@ int l4sap_send( L4SAP* l4, const uint8_t* data, int len );
  * it truncated to len. The function returns the size that
  * was actually copied.
  *
+ * A buffer of at least L4Payloadsize bytes receives the payload
+ * directly, and the expected DATA frame takes a fast path (header
+ * prediction). Other frames may then leave data in the buffer
+ * while the function waits.
+ *
+ * With a deadline (l4sap_set_deadline), l4sap_recv returns L4_EXPIRED
+ * when it passes without DATA.
+ *
  * When a DATA packet is received, l4sap_send sends the
  * appropriate ACK. When the received DATA packet is a
  * retransmission, l4sap_recv does not return to the caller
@@ -154,11 +391,87 @@ int l4sap_send( L4SAP* l4, const uint8_t* data, int len );
  */
 int l4sap_recv( L4SAP* l4, uint8_t* data, int len );
 
+/* Turns bundling on or off. With bundling on, an ACK is not sent right
+ * away but waits for the next frame to the peer, typically the DATA of
+ * the answer, and both go out in one L2 frame. Waiting frames are sent
+ * as soon as the bundle is full, before l4sap_send or l4sap_recv blocks,
+ * and by l4sap_flush. So an ACK is delayed while the caller works on
+ * the answer. The ACK is only held while the caller has answered within
+ * L4_ACK_HOLD_US on average; a caller that takes longer once in a while
+ * should call l4sap_flush first.
+ * Returns 1 if bundling is on, and 0 if it is off or the peer did not
+ * agree on L4_CAP_BUNDLE.
+ */
+int l4sap_set_bundling( L4SAP* l4, int on );
+
+/* Sends the frames that wait in the bundle. */
+void l4sap_flush( L4SAP* l4 );
+
+/* Gives the request that the caller starts now budget_ms milliseconds,
+ * or removes the deadline with 0. Until then, l4sap_send and l4sap_recv
+ * give up with L4_EXPIRED, and a server that agreed on L4_CAP_DEADLINE
+ * learns the deadline with every DATA frame, so that it can drop the
+ * work on a request whose answer nobody waits for.
+ */
+void l4sap_set_deadline( L4SAP* l4, uint32_t budget_ms );
+
 /* Send the L4_RESET message to the peer (OK to send it several
  * times, then delete the L2 and L4 entities and all memory
  * associated with them.
  */
 void l4sap_destroy( L4SAP* l4 );
 
+/* Print the counters, RTT estimate and RTT histogram of l4->stats. */
+void l4sap_print_stats( const L4SAP* l4, FILE* out );
+
+/* Shared with the other L4 transfer modes: add an RTT sample to st and
+ * update the RTO (RFC 6298), and print st with the given name.
+ */
+void l4_rtt_sample( L4Stats* st, uint64_t rtt_us );
+
+/* Time for the tail-loss probe of a frame sent at sent_us, or 0 if there
+ * is no RTT sample yet or the RTO at deadline_us comes first.
+ */
+uint64_t l4_probe_time( const L4Stats* st, uint64_t sent_us, uint64_t deadline_us );
+void l4_print_stats( const L4Stats* st, const char* name, FILE* out );
+
+/* The capability handshake, shared with the other L4 transfer modes.
+ * l4_legacy_caps fills in what a peer without L4_HELLO supports.
+ * l4_hello sends ours to the peer of l2 and waits for its answer; it
+ * returns 1 and the agreed capabilities, or 0 and the legacy ones if
+ * the peer does not answer. Other frames that arrive meanwhile are
+ * dropped. l4_hello_reply takes an L4_HELLO or L4_HELLO_ACK that arrives
+ * later, answers the L4_HELLO, and returns 1 with the agreed
+ * capabilities, or 0 for a malformed frame.
+ */
+void l4_legacy_caps( L4Caps* caps );
+int  l4_hello( L2SAP* l2, const L4Caps* ours, L4Caps* agreed );
+int  l4_hello_reply( L2SAP* l2, const uint8_t* frame, int len, const L4Caps* ours, L4Caps* agreed );
+
+/* The parts of the handshake for servers that issue tickets.
+ * l4_hello_agree agrees on the capabilities of an L4_HELLO or
+ * L4_HELLO_ACK like l4_hello_reply without answering it. l4_hello_ticket
+ * copies the L4Ticket behind the L4Caps and returns 1, or 0 if the frame
+ * has none. l4_hello_send sends ours in a frame of the given type and
+ * ackno, followed by ticket unless it is NULL.
+ */
+int  l4_hello_agree( const uint8_t* frame, int len, const L4Caps* ours, L4Caps* agreed );
+int  l4_hello_ticket( const uint8_t* frame, int len, L4Ticket* ticket );
+void l4_hello_send( L2SAP* l2, uint8_t type, uint8_t ackno, const L4Caps* ours, const L4Ticket* ticket );
+
+/* L4Bundle, shared with L4Server. l4_bundle_add appends an L4 frame as
+ * a unit and returns 0 if it does not fit. l4_bundle_frame points
+ * *frame at what to send and returns its length: a single unit goes out
+ * as it is, without the bundle's headers. l4_bundle_open takes a
+ * received L4_BUNDLE frame and returns 0 if it is malformed.
+ * l4_bundle_next copies the next unit into frame, truncated to len, and
+ * returns its length, or 0 when none is left.
+ */
+void l4_bundle_init( L4Bundle* b );
+int  l4_bundle_add( L4Bundle* b, const uint8_t* frame, int len );
+int  l4_bundle_frame( const L4Bundle* b, const uint8_t** frame );
+int  l4_bundle_open( L4Bundle* b, const uint8_t* frame, int len );
+int  l4_bundle_next( L4Bundle* b, uint8_t* frame, int len );
+
 #endif
 
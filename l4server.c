@@ -0,0 +1,1167 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "l4server.h"
+#include "prof.h"
+#include "probes.h"
+
+static uint64_t now_us( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Moves a kernel receive timestamp, which is CLOCK_REALTIME, to the
+ * clock of now_us: the frame is as old there as it is on the wall clock.
+ */
+static uint64_t arrival_us( const struct timespec* rx_time ) {
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    uint64_t now = now_us();
+    int64_t age = (int64_t)(real.tv_sec - rx_time->tv_sec) * 1000000 + (real.tv_nsec - rx_time->tv_nsec) / 1000;
+    if (age < 0) age = 0;
+    return (uint64_t)age < now ? now - (uint64_t)age : 0;
+}
+
+static uint32_t hash_addr( const L4Server* server, uint32_t ip, uint16_t port ) {
+    uint32_t h = (ip ^ ((uint32_t)port << 16 | port)) * 2654435761u;
+    return (h ^ (h >> 16)) & (server->nbuckets - 1);
+}
+
+static void idle_unlink( L4Server* server, uint32_t i ) {
+    L4Conn* c = &server->conns[i];
+    if (c->idle_prev == L4_NONE) {
+        server->idle_head = c->idle_next;
+    } else {
+        server->conns[c->idle_prev].idle_next = c->idle_next;
+    }
+    if (c->idle_next == L4_NONE) {
+        server->idle_tail = c->idle_prev;
+    } else {
+        server->conns[c->idle_next].idle_prev = c->idle_prev;
+    }
+}
+
+static void idle_append( L4Server* server, uint32_t i ) {
+    L4Conn* c = &server->conns[i];
+    c->idle_prev = server->idle_tail;
+    c->idle_next = L4_NONE;
+    if (server->idle_tail == L4_NONE) {
+        server->idle_head = i;
+    } else {
+        server->conns[server->idle_tail].idle_next = i;
+    }
+    server->idle_tail = i;
+}
+
+// Finds the connection of a peer address, or creates it if create is set
+static uint32_t find_conn( L4Server* server, const struct sockaddr_in* addr, int create ) {
+    uint32_t ip = addr->sin_addr.s_addr;
+    uint16_t port = addr->sin_port;
+    uint32_t h = hash_addr(server, ip, port);
+    for (uint32_t i = server->buckets[h]; i != L4_NONE; i = server->conns[i].next) {
+        if (server->conns[i].ip == ip && server->conns[i].port == port) return i;
+    }
+    if (!create) return L4_NONE;
+    if (server->free_conn == L4_NONE) {
+        fprintf(stderr, "%s: ERROR: all %u connections are in use\n", __FUNCTION__, server->max_conns);
+        return L4_NONE;
+    }
+
+    uint32_t i = server->free_conn;
+    L4Conn* c = &server->conns[i];
+    server->free_conn = c->next;
+    memset(c, 0, sizeof(*c));
+    c->ip = ip;
+    c->port = port;
+    c->buffer = L4_NONE;
+    c->deadline_ms = 0;
+    c->flow = L4_NONE;
+    c->ticket_use = L4_NONE;
+    c->next = server->buckets[h];
+    server->buckets[h] = i;
+    idle_append(server, i);
+    server->nconns++;
+    return i;
+}
+
+static void release_buffer( L4Server* server, L4Conn* c ) {
+    if (c->buffer == L4_NONE) return;
+    server->free_buffers[server->nfree++] = c->buffer;
+    c->buffer = L4_NONE;
+}
+
+// Clears L4_CONN_ACK_WAITING of conn i. Returns 1 if it was set.
+static int take_ack( L4Server* server, uint32_t i ) {
+    if (!(server->conns[i].state & L4_CONN_ACK_WAITING)) return 0;
+    server->conns[i].state &= ~L4_CONN_ACK_WAITING;
+    for (uint32_t n = 0; n < server->nack_waiting; n++) {
+        if (server->ack_waiting[n] == i) {
+            server->ack_waiting[n] = server->ack_waiting[--server->nack_waiting];
+            break;
+        }
+    }
+    return 1;
+}
+
+static void drr_push( L4Server* server, uint32_t f ) {
+    server->flows[f].next = L4_NONE;
+    server->flows[f].in_drr = 1;
+    if (server->drr_tail == L4_NONE) {
+        server->drr_head = f;
+    } else {
+        server->flows[server->drr_tail].next = f;
+    }
+    server->drr_tail = f;
+}
+
+static uint32_t drr_pop( L4Server* server ) {
+    uint32_t f = server->drr_head;
+    server->drr_head = server->flows[f].next;
+    if (server->drr_head == L4_NONE) server->drr_tail = L4_NONE;
+    server->flows[f].in_drr = 0;
+    return f;
+}
+
+// Adds flow f to the flows in flight
+static void tx_link( L4Server* server, uint32_t f ) {
+    L4Flow* fl = &server->flows[f];
+    fl->tx_prev = L4_NONE;
+    fl->tx_next = server->tx_head;
+    if (server->tx_head != L4_NONE) server->flows[server->tx_head].tx_prev = f;
+    server->tx_head = f;
+    server->inflight++;
+}
+
+static void tx_unlink( L4Server* server, uint32_t f ) {
+    L4Flow* fl = &server->flows[f];
+    if (fl->tx_prev == L4_NONE) {
+        server->tx_head = fl->tx_next;
+    } else {
+        server->flows[fl->tx_prev].tx_next = fl->tx_next;
+    }
+    if (fl->tx_next != L4_NONE) server->flows[fl->tx_next].tx_prev = fl->tx_prev;
+    server->inflight--;
+}
+
+/* Hands conn i to l4server_recv as L4_WRITABLE if l4server_queue
+ * refused frames for it.
+ */
+static void wake_writer( L4Server* server, uint32_t i ) {
+    L4Conn* c = &server->conns[i];
+    if (!(c->state & L4_CONN_BLOCKED)) return;
+    c->state &= ~L4_CONN_BLOCKED;
+    if (c->state & L4_CONN_WRITABLE) return;
+    c->state |= L4_CONN_WRITABLE;
+    server->writable[server->nwritable++] = i;
+}
+
+// Returns the flow of conn i, with a new one if it has none, or L4_NONE
+static uint32_t get_flow( L4Server* server, uint32_t i ) {
+    if (server->conns[i].flow != L4_NONE) return server->conns[i].flow;
+    if (server->free_flow == L4_NONE) {
+        uint32_t n = server->nflows ? 2 * server->nflows : 16;
+        L4Flow* flows = realloc(server->flows, n * sizeof(L4Flow));
+        if (flows == NULL) return L4_NONE;
+        for (uint32_t f = server->nflows; f < n; f++) {
+            flows[f].conn = L4_NONE;
+            flows[f].next = f + 1 < n ? f + 1 : L4_NONE;
+        }
+        server->free_flow = server->nflows;
+        server->flows = flows;
+        server->nflows = n;
+    }
+    uint32_t f = server->free_flow;
+    L4Flow* fl = &server->flows[f];
+    server->free_flow = fl->next;
+    memset(fl, 0, sizeof(*fl));
+    fl->conn = i;
+    fl->next = L4_NONE;
+    server->conns[i].flow = f;
+    return f;
+}
+
+// Frees flow f with the frames that it still has, and returns their number
+static uint32_t drop_flow( L4Server* server, uint32_t f ) {
+    L4Flow* fl = &server->flows[f];
+    uint32_t dropped = 0;
+    while (fl->head) {
+        L4TxFrame* next = fl->head->next;
+        free(fl->head);
+        fl->head = next;
+        dropped++;
+    }
+    if (fl->sent_us) tx_unlink(server, f);
+    if (fl->in_drr) {
+        uint32_t prev = L4_NONE;
+        for (uint32_t g = server->drr_head; g != f; g = server->flows[g].next) prev = g;
+        if (prev == L4_NONE) {
+            server->drr_head = fl->next;
+        } else {
+            server->flows[prev].next = fl->next;
+        }
+        if (server->drr_tail == f) server->drr_tail = prev;
+    }
+    server->conns[fl->conn].flow = L4_NONE;
+    fl->conn = L4_NONE;
+    fl->next = server->free_flow;
+    server->free_flow = f;
+    return dropped;
+}
+
+// Ends the repeats of the opening bundle of conn i, see use_ticket
+static void forget_ticket_use( L4Server* server, uint32_t i ) {
+    L4Conn* c = &server->conns[i];
+    if (c->ticket_use == L4_NONE) return;
+    if (server->ticket_uses[c->ticket_use].conn == i) server->ticket_uses[c->ticket_use].conn = L4_NONE;
+    c->ticket_use = L4_NONE;
+}
+
+static void close_conn( L4Server* server, uint32_t i ) {
+    take_ack(server, i);
+    if (server->conns[i].flow != L4_NONE) drop_flow(server, server->conns[i].flow);
+    L4Conn* c = &server->conns[i];
+    uint32_t* link = &server->buckets[hash_addr(server, c->ip, c->port)];
+    while (*link != i) link = &server->conns[*link].next;
+    *link = c->next;
+    idle_unlink(server, i);
+    forget_ticket_use(server, i);
+    if (c->state & L4_CONN_WRITABLE) {
+        for (uint32_t n = 0; n < server->nwritable; n++) {
+            if (server->writable[n] == i) {
+                server->writable[n] = server->writable[--server->nwritable];
+                break;
+            }
+        }
+    }
+
+    if (c->buffer != L4_NONE) {
+        // Take it out of the ready FIFO, whose slots are the pool's buffers
+        uint32_t kept = 0;
+        for (uint32_t n = 0; n < server->ready_count; n++) {
+            uint32_t conn = server->ready[(server->ready_head + n) % server->pool_size];
+            if (conn != i) server->ready[(server->ready_head + kept++) % server->pool_size] = conn;
+        }
+        server->ready_count = kept;
+        release_buffer(server, c);
+    }
+    c->ip = 0;
+    c->next = server->free_conn;
+    server->free_conn = i;
+    server->nconns--;
+}
+
+// The deadline of the request of conn i, 0 if it has none
+static uint64_t conn_deadline( const L4Server* server, uint32_t i ) {
+    uint32_t ms = server->conns[i].deadline_ms;
+    return ms ? server->epoch_us + (uint64_t)ms * 1000 : 0;
+}
+
+/* The retransmission timeout of conn c: RFC 6298 from its own samples,
+ * or the RTO of all peers before it has one, doubled per backoff.
+ */
+static uint64_t conn_rto( const L4Server* server, const L4Conn* c ) {
+    uint64_t rto = server->stats.rto_us;
+    if (c->srtt_us) {
+        rto = (uint64_t)c->srtt_us + 4 * (uint64_t)c->rttvar_us;
+        if (rto < L4_MIN_RTO_US) rto = L4_MIN_RTO_US;
+    }
+    rto <<= c->backoff;
+    return rto < L4_MAX_RTO_US ? rto : L4_MAX_RTO_US;
+}
+
+// Takes an RTT sample of conn c, for it and for the server's statistics
+static void conn_rtt_sample( L4Server* server, L4Conn* c, uint64_t rtt_us ) {
+    l4_rtt_sample(&server->stats, rtt_us);
+    if (rtt_us > L4_MAX_RTO_US) rtt_us = L4_MAX_RTO_US;
+    if (c->srtt_us == 0) {
+        c->srtt_us = rtt_us ? (uint32_t)rtt_us : 1;
+        c->rttvar_us = (uint32_t)rtt_us / 2;
+    } else {
+        uint32_t err = c->srtt_us > rtt_us ? c->srtt_us - (uint32_t)rtt_us : (uint32_t)rtt_us - c->srtt_us;
+        c->rttvar_us = (3 * c->rttvar_us + err) / 4;
+        c->srtt_us = (7 * c->srtt_us + (uint32_t)rtt_us) / 8;
+        if (c->srtt_us == 0) c->srtt_us = 1;
+    }
+}
+
+// Like l4_probe_time, with the SRTT of conn c
+static uint64_t conn_probe_time( const L4Conn* c, uint64_t sent_us, uint64_t deadline_us ) {
+    if (c->srtt_us == 0) return 0;
+    uint64_t pto = 2 * (uint64_t)c->srtt_us;
+    if (pto < L4_TLP_MIN_US) pto = L4_TLP_MIN_US;
+    return sent_us + pto < deadline_us ? sent_us + pto : 0;
+}
+
+// Sends to the peer of conn i
+static int send_to( L4Server* server, uint32_t i, const uint8_t* frame, int len ) {
+    server->l2->peer_addr.sin_family = AF_INET;
+    server->l2->peer_addr.sin_addr.s_addr = server->conns[i].ip;
+    server->l2->peer_addr.sin_port = server->conns[i].port;
+    return l2sap_sendto(server->l2, frame, len);
+}
+
+static void send_ack( L4Server* server, uint32_t i, uint8_t ackno ) {
+    L4Header ack;
+    ack.type = L4_ACK;
+    ack.seqno = 0;
+    ack.ackno = ackno;
+    ack.mbz = 0;
+    send_to(server, i, (const uint8_t*)&ack, sizeof(ack));
+}
+
+// Sends a frame to conn i, in one bundle with its waiting ACK if both fit
+static int send_with_ack( L4Server* server, uint32_t i, const uint8_t* frame, int len ) {
+    if (!take_ack(server, i)) return send_to(server, i, frame, len);
+
+    L4Header ack = { L4_ACK, 0, server->conns[i].expected_seqno, 0 };
+    L4Bundle bundle;
+    l4_bundle_init(&bundle);
+    l4_bundle_add(&bundle, (const uint8_t*)&ack, sizeof(ack));
+    if (!l4_bundle_add(&bundle, frame, len)) {
+        send_to(server, i, (const uint8_t*)&ack, sizeof(ack));
+        return send_to(server, i, frame, len);
+    }
+    server->stats.bundles_sent++;
+    server->stats.units_bundled += bundle.units;
+    const uint8_t* out;
+    int out_len = l4_bundle_frame(&bundle, &out);
+    return send_to(server, i, out, out_len) < 0 ? -1 : len;
+}
+
+// Sends the ACKs that wait for an answer to bundle with
+static void flush_acks( L4Server* server ) {
+    for (uint32_t n = 0; n < server->nack_waiting; n++) {
+        uint32_t i = server->ack_waiting[n];
+        server->conns[i].state &= ~L4_CONN_ACK_WAITING;
+        send_ack(server, i, server->conns[i].expected_seqno);
+    }
+    server->nack_waiting = 0;
+}
+
+// Sends the head of flow f, with the conn's waiting ACK if it fits
+static int flow_transmit( L4Server* server, uint32_t f, uint64_t now ) {
+    L4Flow* fl = &server->flows[f];
+    ((L4Header*)fl->head->frame)->seqno = server->conns[fl->conn].send_seqno;
+    if (fl->attempts > 0) {
+        server->stats.retransmits++;
+        PROBE2(l4_retransmit, server->conns[fl->conn].send_seqno, fl->attempts);
+    }
+    if (!fl->sent_us) tx_link(server, f);
+    fl->sent_us = now;
+    fl->attempts++;
+    server->stats.data_sent++;
+    uint64_t due = now + conn_rto(server, &server->conns[fl->conn]);
+    if (!server->tx_due || due < server->tx_due) server->tx_due = due;
+    return send_with_ack(server, fl->conn, fl->head->frame, fl->head->len);
+}
+
+// Takes an ACK for the frame in flight of conn i's flow
+static void flow_ack( L4Server* server, uint32_t i, const L4Header* header, uint64_t rx_us ) {
+    L4Conn* c = &server->conns[i];
+    if (c->flow == L4_NONE) return;
+    L4Flow* fl = &server->flows[c->flow];
+    if (!fl->sent_us || header->ackno != 1 - c->send_seqno) return;
+
+    PROBE1(l4_ack, header->ackno);
+    if (fl->attempts == 1) conn_rtt_sample(server, c, rx_us > fl->sent_us ? rx_us - fl->sent_us : 0);
+    c->backoff = 0;
+    c->send_seqno = 1 - c->send_seqno;
+    L4TxFrame* done = fl->head;
+    fl->head = done->next;
+    if (fl->head == NULL) fl->tail = NULL;
+    free(done);
+    tx_unlink(server, c->flow);
+    fl->sent_us = 0;
+    fl->attempts = 0;
+    fl->frames--;
+    if (fl->frames <= L4_FLOW_MAX_FRAMES / 2) wake_writer(server, i);
+    // An empty flow leaves the DRR round with its deficit
+    if (fl->head) {
+        drr_push(server, c->flow);
+    } else {
+        drop_flow(server, c->flow);
+    }
+}
+
+/* The egress scheduler: retransmits the frames whose ACK is overdue, and
+ * sends up to L4_EGRESS_BURST new frames of the flows in DRR order. The
+ * writer of a flow that is dropped for its deadline learns it from
+ * l4server_queue. Returns when the next retransmission is due at the
+ * earliest, 0 if nothing is in flight.
+ */
+static uint64_t egress( L4Server* server ) {
+    uint64_t now = now_us();
+    if (server->inflight > 0 && now >= server->tx_due) {
+        server->tx_due = 0;
+        uint32_t next_f;
+        for (uint32_t f = server->tx_head; f != L4_NONE; f = next_f) {
+            L4Flow* fl = &server->flows[f];
+            next_f = fl->tx_next;
+            uint64_t expiry = conn_deadline(server, fl->conn);
+            if (expiry && now >= expiry) {
+                wake_writer(server, fl->conn);
+                server->expired_tx += drop_flow(server, f);
+                continue;
+            }
+            L4Conn* c = &server->conns[fl->conn];
+            uint64_t due = fl->sent_us + conn_rto(server, c);
+            if (now < due) {
+                if (!server->tx_due || due < server->tx_due) server->tx_due = due;
+                continue;
+            }
+            if (fl->attempts >= 5) {
+                fprintf(stderr, "%s: ERROR: no ACK from connection %u\n", __FUNCTION__, fl->conn);
+                server->egress_failed++;
+                l4server_close(server, fl->conn);
+                continue;
+            }
+            if (c->backoff < 8) c->backoff++;
+            flow_transmit(server, f, now);
+        }
+    }
+
+    int burst = 0;
+    while (server->drr_head != L4_NONE && burst < L4_EGRESS_BURST) {
+        uint32_t f = drr_pop(server);
+        L4Flow* fl = &server->flows[f];
+        uint64_t expiry = conn_deadline(server, fl->conn);
+        if (expiry && now >= expiry) {
+            wake_writer(server, fl->conn);
+            server->expired_tx += drop_flow(server, f);
+            continue;
+        }
+        fl->deficit += L4_EGRESS_QUANTUM;
+        if (fl->deficit < (uint32_t)fl->head->len) {
+            drr_push(server, f);
+            continue;
+        }
+        fl->deficit -= fl->head->len;
+        flow_transmit(server, f, now);
+        burst++;
+    }
+    return server->inflight > 0 ? server->tx_due : 0;
+}
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3)                                        \
+    do {                                                                \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);   \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                        \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                        \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);   \
+    } while (0)
+
+// SipHash-2-4 of data with a 128-bit key, the MAC of tickets
+static uint64_t siphash( const uint64_t key[2], const uint8_t* data, size_t len ) {
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ull;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ull;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ull;
+    uint64_t last = (uint64_t)len << 56;
+    size_t n = 0;
+    for (; n + 8 <= len; n += 8) {
+        uint64_t m = 0;
+        for (int k = 0; k < 8; k++) m |= (uint64_t)data[n + k] << (8 * k);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    for (int k = 0; n + k < len; k++) last |= (uint64_t)data[n + k] << (8 * k);
+    v3 ^= last;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (int k = 0; k < 4; k++) SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// The MAC of a ticket for a client with the given address
+static void ticket_mac( const L4Server* server, const L4Ticket* t, uint32_t ip, uint8_t mac[8] ) {
+    uint8_t data[sizeof(t->expiry) + sizeof(t->nonce) + sizeof(ip)];
+    memcpy(data, &t->expiry, sizeof(t->expiry));
+    memcpy(data + sizeof(t->expiry), t->nonce, sizeof(t->nonce));
+    memcpy(data + sizeof(t->expiry) + sizeof(t->nonce), &ip, sizeof(ip));
+    uint64_t h = siphash(server->ticket_key, data, sizeof(data));
+    for (int k = 0; k < 8; k++) mac[k] = (uint8_t)(h >> (8 * k));
+}
+
+static void issue_ticket( L4Server* server, const L4Conn* c, L4Ticket* t ) {
+    uint64_t nonce = server->ticket_nonce++;
+    t->expiry = htonl((uint32_t)time(NULL) + L4_TICKET_LIFETIME_S);
+    t->nonce[0] = (uint32_t)nonce;
+    t->nonce[1] = (uint32_t)(nonce >> 32);
+    ticket_mac(server, t, c->ip, t->mac);
+}
+
+/* Checks that we issued the ticket to the address of conn i, that it
+ * has not expired, and that no other connection used it. Remembers its
+ * use until conn i is closed. Returns 1 if the early DATA may be taken.
+ */
+static int use_ticket( L4Server* server, const L4Ticket* t, uint32_t i ) {
+    if (server->ticket_uses == NULL) return 0;
+    const L4Conn* c = &server->conns[i];
+    uint8_t mac[8], diff = 0;
+    ticket_mac(server, t, c->ip, mac);
+    for (int k = 0; k < 8; k++) diff |= mac[k] ^ t->mac[k];
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t expiry = ntohl(t->expiry);
+    if (diff != 0 || expiry <= now || expiry > now + L4_TICKET_LIFETIME_S) return 0;
+
+    uint32_t h = (t->nonce[0] ^ t->nonce[1] * 2654435761u) * 2654435761u;
+    L4TicketUse* free_slot = NULL;
+    for (uint32_t n = 0; n < L4_TICKET_PROBES; n++) {
+        L4TicketUse* u = &server->ticket_uses[(h + n) & (L4_TICKET_USES - 1)];
+        if (u->expiry <= now) {
+            if (free_slot == NULL) free_slot = u;
+        } else if (u->nonce[0] == t->nonce[0] && u->nonce[1] == t->nonce[1]) {
+            // The same client repeats its opening bundle, or a replay
+            return u->conn == i;
+        }
+    }
+    if (free_slot == NULL) return 0;
+    forget_ticket_use(server, i);
+    free_slot->nonce[0] = t->nonce[0];
+    free_slot->nonce[1] = t->nonce[1];
+    free_slot->expiry = expiry;
+    free_slot->conn = i;
+    server->conns[i].ticket_use = (uint32_t)(free_slot - server->ticket_uses);
+    return 1;
+}
+
+static void local_caps( const L4Server* server, L4Caps* caps ) {
+    l4_legacy_caps(caps);
+    caps->version = L4_VERSION;
+    caps->flags = L4_CAP_BUNDLE | L4_CAP_BUSY | L4_CAP_DEADLINE | (server->ticket_uses ? L4_CAP_TICKET : 0);
+}
+
+/* Agrees on the capabilities of an L4_HELLO or L4_HELLO_ACK and answers
+ * an L4_HELLO, with a new ticket for peers that take them. A ticket in
+ * the L4_HELLO decides whether the early DATA that follows it in the
+ * same bundle is taken.
+ */
+static void handle_hello( L4Server* server, uint32_t i, const uint8_t* frame, int len ) {
+    L4Caps ours, agreed;
+    local_caps(server, &ours);
+    if (!l4_hello_agree(frame, len, &ours, &agreed)) return;
+    L4Conn* c = &server->conns[i];
+    c->version = agreed.version;
+    c->flags = agreed.flags;
+    if (((const L4Header*)frame)->type != L4_HELLO) return;
+
+    uint8_t ackno = 0;
+    L4Ticket ticket;
+    if (l4_hello_ticket(frame, len, &ticket)) {
+        if (use_ticket(server, &ticket, i)) {
+            ackno = L4_HELLO_EARLY_OK;
+            server->early_accepted++;
+        } else {
+            server->early_refused++;
+            if (server->rx_bundle.units > 0) c->state |= L4_CONN_EARLY_DROP;
+        }
+    }
+    L4Ticket next;
+    if (agreed.flags & L4_CAP_TICKET) issue_ticket(server, c, &next);
+    l4_hello_send(server->l2, L4_HELLO_ACK, ackno, &ours, (agreed.flags & L4_CAP_TICKET) ? &next : NULL);
+}
+
+static uint64_t isqrt( uint64_t x ) {
+    uint64_t r = x, y = (x + 1) / 2;
+    while (y < r) {
+        r = y;
+        y = (r + x / r) / 2;
+    }
+    return r;
+}
+
+// The CoDel control law: the next refusal interval/sqrt(count) after t
+static uint64_t codel_next( const L4Server* server, uint64_t t ) {
+    uint64_t root = isqrt((uint64_t)server->codel_count << 20);
+    return t + ((uint64_t)server->codel_interval_us << 10) / (root ? root : 1);
+}
+
+/* Takes the sojourn time of a frame that l4server_recv hands out, and
+ * starts or ends shedding as CoDel's dequeue does.
+ */
+static void codel_taken( L4Server* server, uint64_t now, uint32_t sojourn_us ) {
+    server->codel_sojourn_us = sojourn_us;
+    if (sojourn_us > server->max_sojourn_us) server->max_sojourn_us = sojourn_us;
+    if (server->codel_target_us == 0) return;
+
+    int above = 0;
+    if (sojourn_us < server->codel_target_us) {
+        server->codel_first_above_us = 0;
+    } else if (server->codel_first_above_us == 0) {
+        server->codel_first_above_us = now + server->codel_interval_us;
+    } else if (now >= server->codel_first_above_us) {
+        above = 1;
+    }
+    if (server->codel_shedding && !above) {
+        server->codel_shedding = 0;
+    } else if (!server->codel_shedding && above) {
+        // Resume at the rate that was reached last time if that was recent
+        uint32_t delta = server->codel_count - server->codel_last_count;
+        int recent = (int64_t)(now - server->codel_shed_next_us) < 16 * (int64_t)server->codel_interval_us;
+        server->codel_count = delta > 1 && recent ? delta : 1;
+        server->codel_last_count = server->codel_count;
+        server->codel_shed_next_us = codel_next(server, now);
+        server->codel_shedding = 1;
+    }
+}
+
+// Whether admission control turns away a DATA frame that arrives now
+static int codel_refuse( L4Server* server, uint64_t now ) {
+    if (!server->codel_shedding || now < server->codel_shed_next_us) return 0;
+    server->codel_count++;
+    server->codel_shed_next_us = codel_next(server, server->codel_shed_next_us);
+    return 1;
+}
+
+/* Refuses the DATA frame seqno of conn i without ACK, with L4_BUSY if
+ * the peer takes it. It may send again after the current sojourn time.
+ */
+static void refuse_data( L4Server* server, uint32_t i, uint8_t seqno ) {
+    server->shed++;
+    PROBE1(l4_shed, seqno);
+    if (!(server->conns[i].flags & L4_CAP_BUSY)) return;
+
+    uint32_t wait_us = server->codel_sojourn_us > server->codel_target_us ? server->codel_sojourn_us
+                                                                          : server->codel_target_us;
+    uint32_t wait_ms = (wait_us + 999) / 1000;
+    uint16_t retry_ms = htons(wait_ms > 0xffff ? 0xffff : wait_ms);
+    uint8_t frame[L4BusyFramesize];
+    L4Header* header = (L4Header*)frame;
+    header->type = L4_BUSY;
+    header->seqno = seqno;
+    header->ackno = 0;
+    header->mbz = 0;
+    memcpy(frame + L4Headersize, &retry_ms, sizeof(retry_ms));
+    send_with_ack(server, i, frame, sizeof(frame));
+}
+
+/* Keeps the payload of an expected DATA or L4_DATA_DEADLINE frame for
+ * l4server_recv.
+ */
+static void handle_data( L4Server* server, uint32_t i, const uint8_t* frame, int len, uint64_t rx_us ) {
+    const L4Header* header = (const L4Header*)frame;
+    L4Conn* c = &server->conns[i];
+    int header_len = L4Headersize;
+    uint64_t deadline = 0;
+    if (header->type == L4_DATA_DEADLINE) {
+        if (len < L4DeadlineHeadersize) return;
+        uint32_t budget;
+        memcpy(&budget, frame + L4Headersize, sizeof(budget));
+        header_len = L4DeadlineHeadersize;
+        deadline = rx_us + ntohl(budget);
+    }
+    if (header->seqno != c->expected_seqno) {
+        // Our ACK was lost, or waited for the answer for too long
+        take_ack(server, i);
+        send_ack(server, i, 1 - header->seqno);
+        return;
+    }
+    if (c->buffer != L4_NONE) {
+        return; // the previous frame was not taken yet
+    }
+    if (deadline && now_us() >= deadline) {
+        // Nobody waits for the answer: take the frame, but not the work
+        server->expired_rx++;
+        c->expected_seqno = 1 - c->expected_seqno;
+        send_ack(server, i, c->expected_seqno);
+        return;
+    }
+    if (server->nfree == 0) {
+        server->pool_exhausted++;
+        return;
+    }
+    if (codel_refuse(server, now_us())) {
+        refuse_data(server, i, header->seqno);
+        return;
+    }
+
+    int payload_len = len - header_len;
+    c->buffer = server->free_buffers[--server->nfree];
+    c->buffer_len = payload_len;
+    server->arrival_us[c->buffer] = rx_us;
+    server->deadline_us[c->buffer] = deadline;
+    uint64_t t0 = prof_now();
+    memcpy(server->pool + (size_t)c->buffer * L4Payloadsize, frame + header_len, payload_len);
+    prof_add(PROF_COPY, t0);
+    server->ready[(server->ready_head + server->ready_count++) % server->pool_size] = i;
+
+    c->expected_seqno = 1 - c->expected_seqno;
+    if (server->bundling && (c->flags & L4_CAP_BUNDLE) && server->nack_waiting < server->pool_size) {
+        c->state |= L4_CONN_ACK_WAITING;
+        server->ack_waiting[server->nack_waiting++] = i;
+    } else {
+        send_ack(server, i, c->expected_seqno);
+    }
+}
+
+/* Handles a frame from the peer in l2->peer_addr and returns its type,
+ * or 0 if it was ignored. Of the ACKs, it takes only those for queued
+ * frames. *conn is the peer's connection, L4_NONE if it has none. rx_us
+ * is the time when the frame arrived in the kernel.
+ */
+static int handle_frame( L4Server* server, const uint8_t* frame, int len, uint64_t rx_us, uint32_t* conn ) {
+    const L4Header* header = (const L4Header*)frame;
+    *conn = L4_NONE;
+    if (len < L4Headersize || header->mbz != 0) return 0;
+
+    int create = header->type == L4_DATA || header->type == L4_DATA_DEADLINE || header->type == L4_HELLO;
+    uint32_t i = find_conn(server, &server->l2->peer_addr, create);
+    *conn = i;
+    if (i == L4_NONE) return 0;
+    server->conns[i].last_ms = (uint32_t)((rx_us > server->epoch_us ? rx_us - server->epoch_us : 0) / 1000);
+    idle_unlink(server, i);
+    idle_append(server, i);
+
+    // Only the frame right after a refused ticket is early DATA
+    int early_drop = server->conns[i].state & L4_CONN_EARLY_DROP;
+    server->conns[i].state &= ~L4_CONN_EARLY_DROP;
+
+    if (header->type == L4_RESET) {
+        close_conn(server, i);
+    } else if (header->type == L4_DATA || header->type == L4_DATA_DEADLINE) {
+        if (early_drop) return 0;
+        handle_data(server, i, frame, len, rx_us);
+    } else if (header->type == L4_HELLO || header->type == L4_HELLO_ACK) {
+        handle_hello(server, i, frame, len);
+    } else if (header->type == L4_ACK) {
+        flow_ack(server, i, header, rx_us);
+    } else {
+        return 0;
+    }
+    return header->type;
+}
+
+/* Receives the next L4 frame like l2sap_recvfrom_timeout_ts, and takes
+ * L4_BUNDLE frames apart. l2->peer_addr is the sender of the frame, and
+ * *rx_us its arrival on the clock of now_us.
+ */
+static int recv_frame( L4Server* server, uint8_t* frame, int len, struct timeval* timeout, uint64_t* rx_us ) {
+    while (1) {
+        int unit_len = l4_bundle_next(&server->rx_bundle, frame, len);
+        if (unit_len > 0) {
+            server->l2->peer_addr = server->rx_bundle_addr;
+            *rx_us = server->rx_bundle_us;
+            return unit_len;
+        }
+
+        struct timespec t;
+        int recv_len = l2sap_recvfrom_timeout_ts(server->l2, frame, len, timeout, &t);
+        if (recv_len < 0) return recv_len;
+        *rx_us = arrival_us(&t);
+        if (recv_len < L4Headersize || ((const L4Header*)frame)->type != L4_BUNDLE) return recv_len;
+        if (l4_bundle_open(&server->rx_bundle, frame, recv_len)) {
+            server->rx_bundle_addr = server->l2->peer_addr;
+            server->rx_bundle_us = *rx_us;
+        }
+    }
+}
+
+/* Closes the connections that heard nothing from their peer for
+ * L4_CONN_IDLE_MS, oldest first. One that still has a frame waiting in
+ * either direction counts as heard from now, which keeps the list in
+ * order; its flow is closed by the egress scheduler if the peer is gone.
+ */
+static void expire_idle( L4Server* server ) {
+    uint32_t now_ms = (uint32_t)((now_us() - server->epoch_us) / 1000);
+    for (uint32_t n = 0; n < L4_CONN_IDLE_SCAN && server->idle_head != L4_NONE; n++) {
+        uint32_t i = server->idle_head;
+        L4Conn* c = &server->conns[i];
+        if (now_ms - c->last_ms < L4_CONN_IDLE_MS) break;
+        if (c->buffer != L4_NONE || c->flow != L4_NONE || (c->state & L4_CONN_ACK_WAITING)) {
+            c->last_ms = now_ms;
+            idle_unlink(server, i);
+            idle_append(server, i);
+            continue;
+        }
+        server->idle_closed++;
+        l4server_close(server, i);
+    }
+}
+
+L4Server* l4server_create( int port, uint32_t max_conns, uint32_t pool_size ) {
+    if (port < 1024 || max_conns == 0 || max_conns >= L4_NONE / 2 || pool_size == 0) {
+        fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
+        return NULL;
+    }
+    L4Server* server = calloc(1, sizeof(L4Server));
+    if (server == NULL) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        return NULL;
+    }
+    server->epoch_us = now_us();
+    server->idle_head = L4_NONE;
+    server->idle_tail = L4_NONE;
+    server->free_flow = L4_NONE;
+    server->drr_head = L4_NONE;
+    server->drr_tail = L4_NONE;
+    server->tx_head = L4_NONE;
+    server->max_conns = max_conns;
+    server->pool_size = pool_size;
+    server->nbuckets = 1;
+    while (server->nbuckets < max_conns) server->nbuckets <<= 1;
+
+    server->conns = malloc(max_conns * sizeof(L4Conn));
+    server->buckets = malloc(server->nbuckets * sizeof(uint32_t));
+    server->pool = malloc((size_t)pool_size * L4Payloadsize);
+    server->free_buffers = malloc(pool_size * sizeof(uint32_t));
+    server->ready = malloc(pool_size * sizeof(uint32_t));
+    server->ack_waiting = malloc(pool_size * sizeof(uint32_t));
+    server->arrival_us = malloc(pool_size * sizeof(uint64_t));
+    server->deadline_us = malloc(pool_size * sizeof(uint64_t));
+    if (!server->conns || !server->buckets || !server->pool || !server->free_buffers || !server->ready ||
+        !server->ack_waiting || !server->arrival_us || !server->deadline_us) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        l4server_destroy(server);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < max_conns; i++) {
+        server->conns[i].ip = 0;
+        server->conns[i].next = i + 1 < max_conns ? i + 1 : L4_NONE;
+    }
+    server->free_conn = 0;
+    memset(server->buckets, 0xff, server->nbuckets * sizeof(uint32_t));
+    for (uint32_t i = 0; i < pool_size; i++) {
+        server->free_buffers[i] = pool_size - 1 - i;
+    }
+    server->nfree = pool_size;
+    l4_bundle_init(&server->rx_bundle);
+    server->stats.rto_us = L4_MAX_RTO_US;
+
+    // Without a secret key, there are no tickets
+    FILE* random = fopen("/dev/urandom", "r");
+    if (random && fread(server->ticket_key, sizeof(server->ticket_key), 1, random) == 1 &&
+        fread(&server->ticket_nonce, sizeof(server->ticket_nonce), 1, random) == 1) {
+        server->ticket_uses = calloc(L4_TICKET_USES, sizeof(L4TicketUse));
+    }
+    if (random) fclose(random);
+    if (server->ticket_uses == NULL) {
+        fprintf(stderr, "%s: ERROR: no resumption tickets\n", __FUNCTION__);
+    }
+
+    server->l2 = l2sap_server_create(port);
+    if (server->l2 == NULL) {
+        l4server_destroy(server);
+        return NULL;
+    }
+    // Every buffer of the pool can be in flight at the same time
+    l2sap_tune_buffers(server->l2, pool_size, L2_DEFAULT_RTT_US, L2_DEFAULT_BANDWIDTH);
+
+    fprintf(stderr, "%s: L4Server on port %d for %u connections, %zu bytes\n",
+            __FUNCTION__, port, max_conns, l4server_memory(server));
+    return server;
+}
+
+int l4server_recv( L4Server* server, uint32_t* conn, uint8_t* data, int len, struct timeval* timeout ) {
+    if (!server || !conn || !data || len <= 0) {
+        fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
+        return -1;
+    }
+    uint64_t deadline = timeout ? now_us() + timeout->tv_sec * 1000000ull + timeout->tv_usec : 0;
+    uint8_t frame[L4Framesize];
+
+    while (1) {
+        expire_idle(server);
+        uint64_t next_tx = egress(server);
+        if (server->nwritable > 0) {
+            uint32_t i = server->writable[--server->nwritable];
+            server->conns[i].state &= ~L4_CONN_WRITABLE;
+            *conn = i;
+            return L4_WRITABLE;
+        }
+        if (server->ready_count > 0) {
+            uint32_t i = server->ready[server->ready_head];
+            server->ready_head = (server->ready_head + 1) % server->pool_size;
+            server->ready_count--;
+
+            L4Conn* c = &server->conns[i];
+            uint64_t now = now_us();
+            uint64_t arrival = server->arrival_us[c->buffer];
+            codel_taken(server, now, now > arrival ? (uint32_t)(now - arrival) : 0);
+            uint64_t deadline = server->deadline_us[c->buffer];
+            if (deadline && now >= deadline) {
+                // Expired while it waited in the queue
+                server->expired_rx++;
+                release_buffer(server, c);
+                continue;
+            }
+            // Rounded up, so that a deadline is never 0
+            c->deadline_ms = deadline ? (uint32_t)((deadline - server->epoch_us + 999) / 1000) : 0;
+            int copy_len = c->buffer_len < len ? c->buffer_len : len;
+            uint64_t t0 = prof_now();
+            memcpy(data, server->pool + (size_t)c->buffer * L4Payloadsize, copy_len);
+            prof_add(PROF_COPY, t0);
+            release_buffer(server, c);
+            *conn = i;
+            return copy_len;
+        }
+
+        // Nothing to answer before the next frame arrives
+        if (server->rx_bundle.units == 0) flush_acks(server);
+
+        // Wake up for the caller's timeout, the next retransmission, or at
+        // once while flows wait for their turn
+        uint64_t now = now_us();
+        if (timeout && now >= deadline) return L4_TIMEOUT;
+        uint64_t until = timeout ? deadline : 0;
+        if (server->drr_head != L4_NONE) {
+            until = now;
+        } else if (next_tx && (!until || next_tx < until)) {
+            until = next_tx;
+        }
+        struct timeval left;
+        if (until) {
+            uint64_t wait = until > now ? until - now : 0;
+            left.tv_sec = wait / 1000000;
+            left.tv_usec = wait % 1000000;
+        }
+        uint64_t rx_us;
+        int recv_len = recv_frame(server, frame, sizeof(frame), until ? &left : NULL, &rx_us);
+        if (recv_len < 0) continue;
+
+        uint32_t i;
+        if (handle_frame(server, frame, recv_len, rx_us, &i) == L4_RESET) {
+            *conn = i;
+            return L4_QUIT;
+        }
+    }
+}
+
+int l4server_send( L4Server* server, uint32_t conn, const uint8_t* data, int len ) {
+    if (!server || conn >= server->max_conns || server->conns[conn].ip == 0 || !data || len <= 0) {
+        fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
+        return L4_SEND_FAILED;
+    }
+    if (server->conns[conn].flow != L4_NONE) {
+        fprintf(stderr, "%s: ERROR: frames are queued for connection %u\n", __FUNCTION__, conn);
+        return L4_SEND_FAILED;
+    }
+    if (len > L4Payloadsize) len = L4Payloadsize;
+    uint64_t expiry = conn_deadline(server, conn);
+    if (expiry && now_us() >= expiry) {
+        server->expired_tx++;
+        return L4_EXPIRED;
+    }
+
+    uint8_t packet[L4Framesize];
+    L4Header* header = (L4Header*)packet;
+    header->type = L4_DATA;
+    header->seqno = server->conns[conn].send_seqno;
+    header->ackno = 0;
+    header->mbz = 0;
+    uint64_t t0 = prof_now();
+    memcpy(packet + L4Headersize, data, len);
+    prof_add(PROF_COPY, t0);
+
+    uint8_t frame[L4Framesize];
+    for (int attempt = 0; attempt < 5; attempt++) {
+        if (attempt > 0) {
+            server->stats.retransmits++;
+            PROBE2(l4_retransmit, header->seqno, attempt);
+        }
+        uint64_t sent_us = now_us();
+        if (send_with_ack(server, conn, packet, len + L4Headersize) < 0) {
+            return L4_SEND_FAILED;
+        }
+        server->stats.data_sent++;
+
+        L4Conn* c = &server->conns[conn];
+        uint64_t deadline = sent_us + conn_rto(server, c);
+        if (expiry && expiry < deadline) deadline = expiry;
+        uint64_t probe_at = attempt == 0 ? conn_probe_time(c, sent_us, deadline) : 0;
+        int probed = 0;
+        while (1) {
+            uint64_t now = now_us();
+            if (now >= deadline) break;
+            if (probe_at && now >= probe_at) {
+                // Tail-loss probe, as in l4sap_send
+                probe_at = 0;
+                probed = 1;
+                server->stats.tail_probes++;
+                server->stats.retransmits++;
+                server->stats.data_sent++;
+                PROBE2(l4_retransmit, header->seqno, attempt);
+                if (send_to(server, conn, packet, len + L4Headersize) < 0) {
+                    return L4_SEND_FAILED;
+                }
+                continue;
+            }
+            uint64_t until = probe_at ? probe_at : deadline;
+            struct timeval timeout = { (until - now) / 1000000, (until - now) % 1000000 };
+
+            uint64_t rx_us;
+            int recv_len = recv_frame(server, frame, sizeof(frame), &timeout, &rx_us);
+            if (recv_len == L2_TIMEOUT) {
+                if (probe_at) continue;
+                break;
+            }
+            if (recv_len < 0) continue;
+
+            // Frames of other peers are handled as in l4server_recv
+            uint32_t i;
+            int type = handle_frame(server, frame, recv_len, rx_us, &i);
+            if (i != conn) continue;
+            if (type == L4_RESET) return L4_QUIT;
+
+            const L4Header* recv_header = (const L4Header*)frame;
+            if (type == L4_ACK && recv_header->ackno == 1 - header->seqno) {
+                PROBE1(l4_ack, recv_header->ackno);
+                if (attempt == 0 && !probed) {
+                    conn_rtt_sample(server, c, rx_us > sent_us ? rx_us - sent_us : 0);
+                }
+                c->backoff = 0;
+                c->send_seqno = 1 - c->send_seqno;
+                return len;
+            }
+        }
+
+        if (expiry && now_us() >= expiry) {
+            // The peer gave up on the answer
+            server->expired_tx++;
+            return L4_EXPIRED;
+        }
+        if (c->backoff < 8) c->backoff++;
+    }
+    fprintf(stderr, "%s: ERROR: no ACK from connection %u\n", __FUNCTION__, conn);
+    return L4_SEND_FAILED;
+}
+
+int l4server_queue( L4Server* server, uint32_t conn, const uint8_t* data, int len ) {
+    if (!server || conn >= server->max_conns || server->conns[conn].ip == 0 || !data || len <= 0) {
+        fprintf(stderr, "%s: ERROR: invalid parameters\n", __FUNCTION__);
+        return L4_SEND_FAILED;
+    }
+    if (len > L4Payloadsize) len = L4Payloadsize;
+    uint64_t expiry = conn_deadline(server, conn);
+    if (expiry && now_us() >= expiry) {
+        server->expired_tx++;
+        return L4_EXPIRED;
+    }
+    L4Conn* c = &server->conns[conn];
+    if (c->flow != L4_NONE && server->flows[c->flow].frames >= L4_FLOW_MAX_FRAMES) {
+        if (server->writable == NULL) {
+            server->writable = malloc(server->max_conns * sizeof(uint32_t));
+            if (server->writable == NULL) {
+                fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+                return L4_SEND_FAILED;
+            }
+        }
+        c->state |= L4_CONN_BLOCKED;
+        return L4_WOULD_BLOCK;
+    }
+
+    L4TxFrame* t = malloc(sizeof(L4TxFrame) + L4Headersize + len);
+    uint32_t f = t ? get_flow(server, conn) : L4_NONE;
+    if (f == L4_NONE) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        free(t);
+        return L4_SEND_FAILED;
+    }
+    L4Header header = { L4_DATA, 0, 0, 0 };
+    memcpy(t->frame, &header, sizeof(header));
+    uint64_t t0 = prof_now();
+    memcpy(t->frame + L4Headersize, data, len);
+    prof_add(PROF_COPY, t0);
+    t->len = L4Headersize + len;
+    t->next = NULL;
+
+    // A new flow joins the DRR round; others are in it or wait for an ACK
+    L4Flow* fl = &server->flows[f];
+    if (fl->tail) {
+        fl->tail->next = t;
+    } else {
+        fl->head = t;
+        drr_push(server, f);
+    }
+    fl->tail = t;
+    fl->frames++;
+    return len;
+}
+
+void l4server_set_bundling( L4Server* server, int on ) {
+    if (!server) return;
+    if (!on) flush_acks(server);
+    server->bundling = on;
+}
+
+void l4server_set_admission( L4Server* server, uint32_t target_us, uint32_t interval_us ) {
+    if (!server) return;
+    server->codel_target_us = interval_us ? target_us : 0;
+    server->codel_interval_us = interval_us;
+    server->codel_first_above_us = 0;
+    server->codel_shedding = 0;
+}
+
+int64_t l4server_time_left( const L4Server* server, uint32_t conn ) {
+    if (!server || conn >= server->max_conns) return -1;
+    uint64_t deadline = conn_deadline(server, conn);
+    if (!deadline) return -1;
+    uint64_t now = now_us();
+    return now < deadline ? (int64_t)(deadline - now) : 0;
+}
+
+void l4server_close( L4Server* server, uint32_t conn ) {
+    if (!server || conn >= server->max_conns || server->conns[conn].ip == 0) return;
+
+    L4Header reset;
+    reset.type = L4_RESET;
+    reset.seqno = 0;
+    reset.ackno = 0;
+    reset.mbz = 0;
+    send_with_ack(server, conn, (const uint8_t*)&reset, sizeof(reset));
+    close_conn(server, conn);
+}
+
+size_t l4server_memory( const L4Server* server ) {
+    return sizeof(L4Server) + (size_t)server->max_conns * sizeof(L4Conn) +
+           (size_t)server->nbuckets * sizeof(uint32_t) +
+           (size_t)server->pool_size * (L4Payloadsize + 3 * sizeof(uint32_t) + 2 * sizeof(uint64_t)) +
+           (size_t)server->nflows * sizeof(L4Flow) +
+           (server->writable ? (size_t)server->max_conns * sizeof(uint32_t) : 0) +
+           (server->ticket_uses ? L4_TICKET_USES * sizeof(L4TicketUse) : 0);
+}
+
+void l4server_destroy( L4Server* server ) {
+    if (server == NULL) return;
+
+    if (server->l2) {
+        flush_acks(server);
+        l4_print_stats(&server->stats, "L4Server", stderr);
+        fprintf(stderr, "L4Server: %u connections, %" PRIu64 " frames dropped for lack of buffers\n",
+                server->nconns, server->pool_exhausted);
+        fprintf(stderr, "L4Server: early DATA of %" PRIu64 " tickets taken, of %" PRIu64 " refused\n",
+                server->early_accepted, server->early_refused);
+        fprintf(stderr, "L4Server: %" PRIu64 " DATA frames refused by admission control, longest sojourn %u us\n",
+                server->shed, server->max_sojourn_us);
+        fprintf(stderr, "L4Server: %" PRIu64 " requests dropped after their deadline, %" PRIu64 " answers\n",
+                server->expired_rx, server->expired_tx);
+        fprintf(stderr, "L4Server: %u egress flows, %" PRIu64 " connections closed without ACK for queued frames\n",
+                server->nflows, server->egress_failed);
+        fprintf(stderr, "L4Server: %" PRIu64 " connections closed after %u ms without a frame\n",
+                server->idle_closed, L4_CONN_IDLE_MS);
+        l2sap_destroy(server->l2);
+    }
+    for (uint32_t f = 0; f < server->nflows; f++) {
+        if (server->flows[f].conn != L4_NONE) drop_flow(server, f);
+    }
+    free(server->flows);
+    free(server->conns);
+    free(server->buckets);
+    free(server->pool);
+    free(server->free_buffers);
+    free(server->ready);
+    free(server->ack_waiting);
+    free(server->writable);
+    free(server->ticket_uses);
+    free(server->arrival_us);
+    free(server->deadline_us);
+    free(server);
+}
@@ -0,0 +1,334 @@
+#ifndef L4SERVER_H
+#define L4SERVER_H
+
+#include "l4sap.h"
+
+/* A stop-and-wait L4 server for many peers on one socket.
+ *
+ * L4SAP has one L2SAP, and so one socket, per peer, and keeps a full
+ * payload buffer for a DATA frame that arrives while it sends. An
+ * L4Server instead binds one L2SAP and tells its peers apart by their
+ * address. Each peer has an L4Conn record of a few bytes. A payload
+ * buffer is borrowed from a shared pool only while a DATA frame waits
+ * for l4server_recv, so memory grows with the traffic in flight and not
+ * with the number of sessions.
+ *
+ * The protocol on the wire is the one of L4SAP, so L4SAP clients and
+ * the test clients talk to an L4Server unchanged. When the pool is
+ * empty, or a peer's previous frame has not been taken yet, a DATA frame
+ * is dropped without ACK and its sender retransmits it later.
+ *
+ * With l4server_set_bundling, the ACK for a DATA frame from a peer that
+ * agreed on L4_CAP_BUNDLE waits for the answer to that peer and goes out
+ * in the same L2 frame, see L4Bundle. ACKs that still wait are sent
+ * before l4server_recv blocks.
+ *
+ * Peers that agree on L4_CAP_TICKET get an L4Ticket with every
+ * L4_HELLO_ACK and may resume with early DATA, see L4Ticket. The server
+ * keeps no state per ticket until it is used; then it remembers the
+ * ticket and the connection that used it in a table of L4_TICKET_USES
+ * slots until the ticket expires. That connection may send the opening
+ * bundle again while it is open; anyone else, and anyone after it was
+ * closed, gets the early DATA dropped. When the table has no room near
+ * a ticket's slot, early DATA is refused as well.
+ * Clients without a ticket, or without L4_HELLO, are served as before.
+ *
+ * Every connection keeps its own SRTT, RTTVAR and backoff, so a peer
+ * that stops answering does not slow down the retransmissions to the
+ * others; a new connection starts from the RTO of all peers. The
+ * connections are kept in the order of their peer's last frame. A
+ * connection from which nothing arrived for L4_CONN_IDLE_MS is closed
+ * with L4_RESET unless it has a frame waiting in either direction, so
+ * peers that went away, and spoofed sources, do not keep their slots.
+ *
+ * Admission control (l4server_set_admission) keeps the queue in front of
+ * l4server_recv short under overload, like CoDel (RFC 8289) does for a
+ * router queue. The sojourn time of a DATA frame runs from its arrival
+ * in the kernel to l4server_recv, so it covers the socket buffer and the
+ * ready FIFO. Once it has stayed above the target for an interval, the
+ * server turns DATA frames away at the CoDel rate, interval/sqrt(count)
+ * apart, until a frame is taken below the target again. A refused frame
+ * gets no ACK; peers that agreed on L4_CAP_BUSY get L4_BUSY with the
+ * current sojourn time as the time to wait, the others time out and
+ * retransmit. Retransmissions of frames that were taken are ACKed as
+ * usual.
+ *
+ * Requests with a deadline arrive in L4_DATA_DEADLINE frames, which the
+ * server takes from any peer. Work whose deadline has passed is dropped
+ * wherever the server finds it: a frame that arrives too late is ACKed
+ * but not kept, l4server_recv skips frames that expired in the queue,
+ * and l4server_send neither sends nor retransmits an answer after the
+ * deadline of the request that it answers. The application asks
+ * l4server_time_left before it starts on a request.
+ *
+ * l4server_send blocks until the peer ACKs, so an answer of many frames
+ * to one peer holds up all others. l4server_queue instead hands the
+ * frame to the egress scheduler and returns. A connection with queued
+ * frames has an L4Flow, which sends its next frame when the previous
+ * one is ACKed, stop-and-wait as before. The flows whose next frame may
+ * go out take turns by deficit round robin (DRR): a turn adds
+ * L4_EGRESS_QUANTUM bytes to the flow's deficit, and the flow sends
+ * when its deficit covers the frame. So each flow gets the same bytes
+ * per round whatever the size of its frames, and a peer with short
+ * answers waits for at most one round. l4server_recv sends at most
+ * L4_EGRESS_BURST frames before it looks at the input again, and
+ * retransmits the frames whose ACK is overdue; it only looks at the
+ * flows with a frame in flight, and only once the earliest of their
+ * retransmissions is due. Frames of an expired request are dropped
+ * before they go out.
+ *
+ * A flow holds at most L4_FLOW_MAX_FRAMES frames. Beyond that,
+ * l4server_queue returns L4_WOULD_BLOCK, and once the peer has ACKed
+ * half of them, l4server_recv returns L4_WRITABLE for the connection, so
+ * that a long answer is produced as fast as the peer takes it instead
+ * of all at once.
+ */
+
+/* Marks the end of a hash chain or free list, and a connection
+ * without a buffer.
+ */
+#define L4_NONE             0xffffffffu
+
+/* Set in L4Conn.state while the ACK for the peer's last DATA frame
+ * waits to be bundled with the answer.
+ */
+#define L4_CONN_ACK_WAITING 0x01
+
+/* Set in L4Conn.state when an L4_HELLO with a ticket that was refused
+ * came in a bundle: the early DATA frame that follows in the bundle is
+ * dropped.
+ */
+#define L4_CONN_EARLY_DROP  0x02
+
+/* Set in L4Conn.state while l4server_queue refuses frames for the
+ * connection, and while it waits in L4Server.writable to be returned by
+ * l4server_recv.
+ */
+#define L4_CONN_BLOCKED     0x04
+#define L4_CONN_WRITABLE    0x08
+
+/* A connection is closed after this time without a frame from its
+ * peer. l4server_recv looks at no more than L4_CONN_IDLE_SCAN of the
+ * oldest connections per wake-up.
+ */
+#define L4_CONN_IDLE_MS     30000
+#define L4_CONN_IDLE_SCAN   64
+
+#define L4_CODEL_TARGET_US      5000
+#define L4_CODEL_INTERVAL_US    100000
+
+/* Bytes per DRR turn, and frames per round of the egress scheduler. */
+#define L4_EGRESS_QUANTUM   256
+#define L4_EGRESS_BURST     8
+
+/* Frames that l4server_queue keeps per connection. */
+#define L4_FLOW_MAX_FRAMES  64
+
+#define L4_TICKET_USES      4096    /* a power of 2 */
+#define L4_TICKET_PROBES    16
+
+typedef struct L4TicketUse L4TicketUse;
+struct L4TicketUse
+{
+    uint32_t nonce[2];
+    uint32_t expiry;        /* host byte order; the slot is free after it */
+    uint32_t conn;          /* the connection that used the ticket, L4_NONE once it closed */
+};
+
+/* A frame in the egress queue of a connection, with its L4Header. The
+ * seqno is set when it goes out.
+ */
+typedef struct L4TxFrame L4TxFrame;
+struct L4TxFrame
+{
+    L4TxFrame* next;
+    int        len;
+    uint8_t    frame[];
+};
+
+typedef struct L4Flow L4Flow;
+struct L4Flow
+{
+    L4TxFrame* head;        /* in flight if sent_us is set */
+    L4TxFrame* tail;
+    uint64_t   sent_us;     /* last transmission of head, 0 if not in flight */
+    uint32_t   conn;        /* L4_NONE if the flow is free */
+    uint32_t   next;        /* DRR list, or free list */
+    uint32_t   tx_prev;     /* list of the flows in flight */
+    uint32_t   tx_next;
+    uint32_t   deficit;     /* bytes */
+    uint32_t   frames;      /* in the queue, head included */
+    uint8_t    attempts;    /* transmissions of head */
+    uint8_t    in_drr;
+};
+
+typedef struct L4Conn L4Conn;
+struct L4Conn
+{
+    uint32_t ip;            /* peer address, network byte order; 0 if free */
+    uint16_t port;          /* network byte order */
+    uint8_t  send_seqno;
+    uint8_t  expected_seqno;
+    uint32_t next;          /* hash chain, or free list */
+    uint32_t buffer;        /* pool buffer with a DATA payload, or L4_NONE */
+    uint16_t buffer_len;
+    uint8_t  version;       /* agreed with L4_HELLO, 0 for legacy peers */
+    uint8_t  flags;         /* agreed L4_CAP_* */
+    uint8_t  state;         /* L4_CONN_ACK_WAITING, L4_CONN_EARLY_DROP, L4_CONN_BLOCKED, L4_CONN_WRITABLE */
+    uint32_t deadline_ms;   /* of the last request taken, after L4Server.epoch_us; 0 if none */
+    uint32_t flow;          /* L4Flow with queued frames, or L4_NONE */
+    uint32_t ticket_use;    /* L4TicketUse of the ticket it resumed with, or L4_NONE */
+    uint32_t last_ms;       /* arrival of the peer's last frame, after L4Server.epoch_us */
+    uint32_t idle_prev;     /* list of the connections by last_ms */
+    uint32_t idle_next;
+    uint32_t srtt_us;       /* 0 until the first RTT sample */
+    uint32_t rttvar_us;
+    uint8_t  backoff;       /* RTO doublings since the last ACK */
+};
+
+typedef struct L4Server L4Server;
+struct L4Server
+{
+    L2SAP*    l2;
+
+    L4Conn*   conns;
+    uint32_t  max_conns;
+    uint32_t  nconns;
+    uint32_t  free_conn;
+    uint32_t* buckets;      /* hash of the peer address to the first L4Conn */
+    uint32_t  nbuckets;     /* a power of 2 */
+    uint32_t  idle_head;    /* the connection that was heard from longest ago */
+    uint32_t  idle_tail;
+
+    /* Payload buffers of L4Payloadsize bytes. free_buffers is a stack
+     * of the unused ones. ready is a FIFO of the connections whose
+     * buffer waits for l4server_recv.
+     */
+    uint8_t*  pool;
+    uint32_t  pool_size;
+    uint32_t* free_buffers;
+    uint32_t  nfree;
+    uint32_t* ready;
+    uint32_t  ready_head;
+    uint32_t  ready_count;
+    uint64_t* arrival_us;   /* per buffer: kernel arrival time of its frame */
+    uint64_t* deadline_us;  /* per buffer: deadline of its request, 0 if none */
+    uint64_t  epoch_us;     /* time 0 of L4Conn.deadline_ms, on CLOCK_MONOTONIC */
+
+    /* Admission control, target 0 if off. first_above_us is when the
+     * sojourn time may have been above the target for an interval, 0 if
+     * it is below; count frames were refused since shedding began.
+     */
+    uint32_t  codel_target_us;
+    uint32_t  codel_interval_us;
+    uint64_t  codel_first_above_us;
+    uint64_t  codel_shed_next_us;
+    uint32_t  codel_count;
+    uint32_t  codel_last_count;
+    int       codel_shedding;
+    uint32_t  codel_sojourn_us;     /* of the last frame taken */
+
+    /* Bundling: the connections with L4_CONN_ACK_WAITING, at most
+     * pool_size, and the units of a received L4_BUNDLE with its sender.
+     */
+    int       bundling;
+    uint32_t* ack_waiting;
+    uint32_t  nack_waiting;
+    L4Bundle  rx_bundle;
+    struct sockaddr_in rx_bundle_addr;
+    uint64_t           rx_bundle_us;
+
+    /* Egress scheduler: the flows, which grow on demand, the DRR list
+     * of the flows whose next frame may go out, and the list of the
+     * inflight flows that wait for an ACK, whose first retransmission is
+     * due at tx_due at the earliest. writable holds the connections
+     * with L4_CONN_WRITABLE; it has max_conns slots once a flow was
+     * full.
+     */
+    L4Flow*   flows;
+    uint32_t  nflows;
+    uint32_t  free_flow;
+    uint32_t  drr_head;
+    uint32_t  drr_tail;
+    uint32_t  tx_head;
+    uint32_t  inflight;
+    uint64_t  tx_due;
+    uint32_t* writable;
+    uint32_t  nwritable;
+
+    /* Resumption tickets: the MAC key, the nonce of the next ticket, and
+     * the tickets that were used, NULL without tickets.
+     */
+    uint64_t     ticket_key[2];
+    uint64_t     ticket_nonce;
+    L4TicketUse* ticket_uses;
+
+    L4Stats   stats;
+    uint64_t  pool_exhausted;   /* DATA frames dropped for lack of a buffer */
+    uint64_t  early_accepted;   /* tickets whose early DATA was taken */
+    uint64_t  early_refused;
+    uint64_t  shed;             /* DATA frames refused by admission control */
+    uint64_t  expired_rx;       /* requests dropped on arrival or in the queue after their deadline */
+    uint64_t  expired_tx;       /* answers not sent, or no longer retransmitted, after it */
+    uint64_t  egress_failed;    /* connections closed without ACK for a queued frame */
+    uint64_t  idle_closed;      /* connections closed after L4_CONN_IDLE_MS */
+    uint32_t  max_sojourn_us;
+};
+
+/* Create a server on the given UDP port for up to max_conns peers, with
+ * pool_size payload buffers.
+ */
+L4Server* l4server_create( int port, uint32_t max_conns, uint32_t pool_size );
+
+/* Waits for the next DATA frame from any peer, at most for timeout (NULL
+ * waits forever). It copies at most len bytes of the payload into data,
+ * sets *conn to the sender and returns the number of bytes copied.
+ * Returns L4_TIMEOUT if nothing arrived, L4_QUIT with *conn set when
+ * a peer sent L4_RESET; its connection is closed then, and L4_WRITABLE
+ * with *conn set when l4server_queue takes frames for conn again.
+ */
+int  l4server_recv( L4Server* server, uint32_t* conn, uint8_t* data, int len, struct timeval* timeout );
+
+/* Sends data to the peer conn and waits for its ACK like l4sap_send.
+ * DATA frames from other peers are kept for l4server_recv meanwhile.
+ * Returns L4_EXPIRED once the deadline of conn's request has passed.
+ * Fails while frames are queued for conn.
+ */
+int  l4server_send( L4Server* server, uint32_t conn, const uint8_t* data, int len );
+
+/* Queues data for the peer conn behind the frames that wait for it, and
+ * returns the bytes queued, at most L4Payloadsize, without waiting. The
+ * frames go out in l4server_recv, see L4Flow; while l4server_send
+ * blocks, their ACKs are taken but nothing is sent. A peer that does not
+ * ACK a frame after 5 transmissions is closed. Returns L4_WOULD_BLOCK
+ * while L4_FLOW_MAX_FRAMES frames wait for conn; l4server_recv returns
+ * L4_WRITABLE for it when there is room again.
+ */
+int  l4server_queue( L4Server* server, uint32_t conn, const uint8_t* data, int len );
+
+/* Turns bundling of ACKs with answers on or off for the peers that
+ * agreed on L4_CAP_BUNDLE, see l4sap_set_bundling.
+ */
+void l4server_set_bundling( L4Server* server, int on );
+
+/* Turns admission control on with the given target sojourn time and
+ * interval, e.g. L4_CODEL_TARGET_US and L4_CODEL_INTERVAL_US, or off
+ * with a target of 0.
+ */
+void l4server_set_admission( L4Server* server, uint32_t target_us, uint32_t interval_us );
+
+/* Returns the microseconds left until the deadline of the request that
+ * l4server_recv took last from conn, 0 if it has passed, or -1 if the
+ * request has no deadline.
+ */
+int64_t l4server_time_left( const L4Server* server, uint32_t conn );
+
+/* Sends L4_RESET to the peer and forgets it. */
+void l4server_close( L4Server* server, uint32_t conn );
+
+/* Memory that the connection records and the pool take, in bytes. */
+size_t l4server_memory( const L4Server* server );
+
+void l4server_destroy( L4Server* server );
+
+#endif
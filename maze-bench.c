@@ -0,0 +1,456 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "maze.h"
+
+/* Measures the throughput of solving a batch of mazes: first one after
+ * the other in this thread with mazeSolveWith, which allocates the
+ * memory of DFS and BFS per maze like mazeSolve, and then with a
+ * MazePool. The mazes are perfect mazes made with a randomized
+ * depth-first search; with -l, a share of the remaining walls is opened
+ * so that the mazes have loops. Every run starts from the same mazes.
+ *
+ * With -c, nothing is measured. Instead, every maze gets a MazeLPA that
+ * is solved once and then repaired after the given number of random
+ * wall changes, one to three at a time. Each repaired path must be as
+ * long as the distance that a breadth-first search finds. Before that,
+ * the distance fields of every maze, and of a copy with one square
+ * walled in, must match the same search square by square, and
+ * mazeDistanceField16 must refuse a maze of 65536 squares. The program
+ * fails on the first mismatch.
+ */
+
+static uint64_t now_ns( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void usage( const char* name )
+{
+    fprintf( stderr, "Usage: %s [-s <solver>] [-l <percent>] [-c <changes>] <edgeLen> <mazes> [<workers>]\n"
+                     "       -s solver - auto (default), dfs, wall, deadend or bfs\n"
+                     "       -l percent- Open this share of the walls that remain, for loops\n"
+                     "       -c changes- Check distance fields, and LPA* repairs over this many wall changes per maze\n"
+                     "       edgeLen   - Squares in each direction\n"
+                     "       mazes     - Number of mazes in the batch\n"
+                     "       workers   - Threads of the pool (default one per CPU)\n" , name );
+    exit( -1 );
+}
+
+static const int gen_bits[4] = { up, right, down, left };
+static const int gen_dx[4]   = {  0,     1,    0,   -1 };
+static const int gen_dy[4]   = { -1,     0,    1,    0 };
+
+/* Carves a perfect maze into maze->maze with an explicit stack, from
+ * the top left to the bottom right corner.
+ */
+static int generate( struct Maze* maze, uint32_t n, unsigned int seed, int loops )
+{
+    maze->edgeLen = n;
+    maze->size    = n * n;
+    maze->startX  = 0;
+    maze->startY  = 0;
+    maze->endX    = n - 1;
+    maze->endY    = n - 1;
+    maze->maze    = calloc( maze->size, 1 );
+    uint32_t* stack = malloc( maze->size * sizeof(uint32_t) );
+    if( maze->maze == NULL || stack == NULL )
+    {
+        fprintf( stderr, "%s: ERROR: Could not allocate a maze of %u squares\n", __FUNCTION__, maze->size );
+        free( stack );
+        return -1;
+    }
+
+    // tmark is the visited flag while carving
+    uint32_t top = 0;
+    stack[top++] = 0;
+    maze->maze[0] |= tmark;
+    while( top > 0 )
+    {
+        uint32_t cur = stack[top-1];
+        int x = cur % n;
+        int y = cur / n;
+        int dirs[4];
+        int count = 0;
+        for( int d=0; d<4; d++ )
+        {
+            int nx = x + gen_dx[d];
+            int ny = y + gen_dy[d];
+            if( nx < 0 || ny < 0 || nx >= (int)n || ny >= (int)n ) continue;
+            if( maze->maze[ny*n+nx] & tmark ) continue;
+            dirs[count++] = d;
+        }
+        if( count == 0 )
+        {
+            top--;
+            continue;
+        }
+        int d = dirs[rand_r( &seed ) % count];
+        uint32_t next = (y + gen_dy[d]) * n + (x + gen_dx[d]);
+        maze->maze[cur]  |= gen_bits[d];
+        maze->maze[next] |= gen_bits[(d+2)%4] | tmark;
+        stack[top++] = next;
+    }
+    free( stack );
+
+    for( uint32_t i=0; i<maze->size; i++ )
+    {
+        maze->maze[i] &= ~tmark;
+        if( loops == 0 ) continue;
+        // Only walls to the right and down, so each is considered once
+        int x = i % n;
+        if( x + 1 < (int)n && !(maze->maze[i] & right) && (int)(rand_r( &seed ) % 100) < loops )
+        {
+            maze->maze[i]   |= right;
+            maze->maze[i+1] |= left;
+        }
+        if( i + n < maze->size && !(maze->maze[i] & down) && (int)(rand_r( &seed ) % 100) < loops )
+        {
+            maze->maze[i]   |= down;
+            maze->maze[i+n] |= up;
+        }
+    }
+    return 0;
+}
+
+static void reset( struct Maze* mazes, char** grids, int count )
+{
+    for( int i=0; i<count; i++ )
+    {
+        memcpy( mazes[i].maze, grids[i], mazes[i].size );
+    }
+}
+
+/* Steps from start to end along open passages, by breadth-first search,
+ * or -1 if the end cannot be reached. dist is left with the steps to
+ * every square, UINT32_MAX where there is no way. With only_marked,
+ * only the squares with the mark bit count.
+ */
+static int64_t bfs_steps( const struct Maze* maze, int only_marked, uint32_t* dist, uint32_t* queue )
+{
+    uint32_t n = maze->edgeLen;
+    uint32_t start = maze->startY * n + maze->startX;
+    uint32_t end   = maze->endY * n + maze->endX;
+    if( only_marked && !(maze->maze[start] & mark) ) return -1;
+    for( uint32_t i=0; i<maze->size; i++ ) dist[i] = UINT32_MAX;
+    uint32_t head = 0, tail = 0;
+    dist[start] = 0;
+    queue[tail++] = start;
+    while( head < tail )
+    {
+        uint32_t cur = queue[head++];
+        int x = cur % n;
+        int y = cur / n;
+        for( int d=0; d<4; d++ )
+        {
+            int nx = x + gen_dx[d];
+            int ny = y + gen_dy[d];
+            if( nx < 0 || ny < 0 || nx >= (int)n || ny >= (int)n ) continue;
+            uint32_t next = ny * n + nx;
+            if( !(maze->maze[cur] & gen_bits[d]) || !(maze->maze[next] & gen_bits[(d+2)%4]) ) continue;
+            if( only_marked && !(maze->maze[next] & mark) ) continue;
+            if( dist[next] != UINT32_MAX ) continue;
+            dist[next] = dist[cur] + 1;
+            queue[tail++] = next;
+        }
+    }
+    return dist[end] == UINT32_MAX ? -1 : (int64_t)dist[end];
+}
+
+static uint32_t count_marked( const struct Maze* maze )
+{
+    uint32_t count = 0;
+    for( uint32_t i=0; i<maze->size; i++ )
+    {
+        if( maze->maze[i] & mark ) count++;
+    }
+    return count;
+}
+
+/* Compares mazeDistanceField and mazeDistanceField16 with the distances
+ * of a breadth-first search, square by square. Returns -1 on the first
+ * mismatch.
+ */
+static int check_field( const struct Maze* maze, uint32_t* dist, uint32_t* queue,
+                        uint32_t* field, uint16_t* field16 )
+{
+    bfs_steps( maze, 0, dist, queue );
+    uint32_t reachable = 0;
+    for( uint32_t i=0; i<maze->size; i++ )
+    {
+        if( dist[i] != UINT32_MAX ) reachable++;
+    }
+
+    int got = mazeDistanceField( maze, field );
+    int got16 = maze->size < MAZE_DIST16_UNREACHABLE ? mazeDistanceField16( maze, field16 ) : (int)reachable;
+    if( got != (int)reachable || got16 != (int)reachable )
+    {
+        fprintf( stderr, "%s: ERROR: %u squares are reachable, distance fields report %d and %d\n",
+                 __FUNCTION__, reachable, got, got16 );
+        return -1;
+    }
+    for( uint32_t i=0; i<maze->size; i++ )
+    {
+        // MAZE_DIST_UNREACHABLE is UINT32_MAX, like dist
+        int bad = field[i] != dist[i];
+        if( maze->size < MAZE_DIST16_UNREACHABLE )
+        {
+            bad |= field16[i] != (dist[i] == UINT32_MAX ? MAZE_DIST16_UNREACHABLE : dist[i]);
+        }
+        if( bad )
+        {
+            fprintf( stderr, "%s: ERROR: square %u is %u steps away, distance fields say %u and %u\n",
+                     __FUNCTION__, i, dist[i], field[i], (unsigned)field16[i] );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Runs check_field on maze and on a copy in which one square other
+ * than the start is walled in and must come out as
+ * MAZE_DIST_UNREACHABLE.
+ */
+static int check_fields( const struct Maze* maze, unsigned int seed )
+{
+    uint32_t n = maze->edgeLen;
+    uint32_t* dist    = malloc( maze->size * sizeof(uint32_t) );
+    uint32_t* queue   = malloc( maze->size * sizeof(uint32_t) );
+    uint32_t* field   = malloc( maze->size * sizeof(uint32_t) );
+    uint16_t* field16 = calloc( maze->size, sizeof(uint16_t) );
+    struct Maze walled = *maze;
+    walled.maze = malloc( maze->size );
+    if( dist == NULL || queue == NULL || field == NULL || field16 == NULL || walled.maze == NULL )
+    {
+        fprintf( stderr, "%s: ERROR: Could not allocate the check of a maze of %u squares\n", __FUNCTION__, maze->size );
+        free( dist );
+        free( queue );
+        free( field );
+        free( field16 );
+        free( walled.maze );
+        return -1;
+    }
+
+    int result = check_field( maze, dist, queue, field, field16 );
+
+    uint32_t start = maze->startY * n + maze->startX;
+    uint32_t cut = start;
+    while( cut == start ) cut = rand_r( &seed ) % maze->size;
+    memcpy( walled.maze, maze->maze, maze->size );
+    int x = cut % n;
+    int y = cut / n;
+    for( int d=0; d<4; d++ )
+    {
+        int nx = x + gen_dx[d];
+        int ny = y + gen_dy[d];
+        walled.maze[cut] &= ~gen_bits[d];
+        if( nx < 0 || ny < 0 || nx >= (int)n || ny >= (int)n ) continue;
+        walled.maze[ny*n+nx] &= ~gen_bits[(d+2)%4];
+    }
+    if( result == 0 ) result = check_field( &walled, dist, queue, field, field16 );
+    if( result == 0 && field[cut] != MAZE_DIST_UNREACHABLE )
+    {
+        fprintf( stderr, "%s: ERROR: walled-in square %u is %u steps away\n", __FUNCTION__, cut, field[cut] );
+        result = -1;
+    }
+
+    free( dist );
+    free( queue );
+    free( field );
+    free( field16 );
+    free( walled.maze );
+    return result;
+}
+
+/* Solves maze with a MazeLPA, changes walls at random and repairs the
+ * path, and compares every path with a breadth-first search: it must
+ * exist exactly when the end can be reached, and it must be a shortest
+ * one, whose marked squares connect start and end. Returns -1 on the
+ * first mismatch.
+ */
+static int check_lpa( struct Maze* maze, int changes, unsigned int seed,
+                      uint64_t* first_expanded, uint64_t* repair_expanded, uint64_t* repairs )
+{
+    uint32_t* dist  = malloc( maze->size * sizeof(uint32_t) );
+    uint32_t* queue = malloc( maze->size * sizeof(uint32_t) );
+    MazeLPA*  lpa   = mazeLpaCreate( maze );
+    if( dist == NULL || queue == NULL || lpa == NULL )
+    {
+        fprintf( stderr, "%s: ERROR: Could not allocate the check of a maze of %u squares\n", __FUNCTION__, maze->size );
+        free( dist );
+        free( queue );
+        mazeLpaDestroy( lpa );
+        return -1;
+    }
+
+    int result = 0;
+    int done = 0;
+    while( result == 0 )
+    {
+        int found = mazeLpaSolve( lpa );
+        if( done == 0 )
+        {
+            *first_expanded += mazeLpaExpanded( lpa );
+        }
+        else
+        {
+            *repair_expanded += mazeLpaExpanded( lpa );
+            (*repairs)++;
+        }
+
+        int64_t expected = bfs_steps( maze, 0, dist, queue );
+        int64_t marked   = found ? bfs_steps( maze, 1, dist, queue ) : -1;
+        uint32_t squares = count_marked( maze );
+        if( found != (expected >= 0) || marked != expected ||
+            squares != (found ? (uint32_t)expected + 1 : 0) )
+        {
+            fprintf( stderr, "%s: ERROR: after %d wall changes, LPA* found %d with %u marked squares, "
+                             "BFS %" PRId64 " steps\n", __FUNCTION__, done, found, squares, expected );
+            result = -1;
+        }
+        if( done == changes ) break;
+
+        int batch = 1 + rand_r( &seed ) % 3;
+        for( int k=0; k<batch && done<changes; k++, done++ )
+        {
+            uint32_t x = rand_r( &seed ) % maze->edgeLen;
+            uint32_t y = rand_r( &seed ) % maze->edgeLen;
+            mazeLpaSetWall( lpa, x, y, gen_bits[rand_r( &seed ) % 4], rand_r( &seed ) % 2 );
+        }
+    }
+
+    mazeLpaDestroy( lpa );
+    free( dist );
+    free( queue );
+    return result;
+}
+
+static void report( const char* what, int count, int found, uint64_t ns )
+{
+    printf( "%-24s %8.1f ms %10.1f mazes/s, %d of %d solved\n",
+            what, ns / 1e6, count * 1e9 / ns, found, count );
+}
+
+int main( int argc, char *argv[] )
+{
+    MazeSolver solver = MAZE_SOLVER_AUTO;
+    int loops = 0;
+    int changes = -1;
+    int a = 1;
+    while( a < argc && argv[a][0] == '-' )
+    {
+        if( strcmp( argv[a], "-s" ) == 0 && a + 1 < argc )
+        {
+            int s = mazeSolverFromName( argv[++a] );
+            if( s < 0 ) usage( argv[0] );
+            solver = (MazeSolver)s;
+        }
+        else if( strcmp( argv[a], "-l" ) == 0 && a + 1 < argc ) loops = atoi( argv[++a] );
+        else if( strcmp( argv[a], "-c" ) == 0 && a + 1 < argc ) changes = atoi( argv[++a] );
+        else usage( argv[0] );
+        a++;
+    }
+    if( argc - a < 2 || argc - a > 3 ) usage( argv[0] );
+
+    uint32_t n       = (uint32_t)atoi( argv[a] );
+    int      count   = atoi( argv[a+1] );
+    int      workers = argc > a+2 ? atoi( argv[a+2] ) : 0;
+    if( n < 2 || count < 1 ) usage( argv[0] );
+
+    struct Maze* mazes = calloc( count, sizeof(struct Maze) );
+    char**       grids = calloc( count, sizeof(char*) );
+    if( mazes == NULL || grids == NULL )
+    {
+        fprintf( stderr, "%s: ERROR: Could not allocate %d mazes\n", __FUNCTION__, count );
+        return -1;
+    }
+    for( int i=0; i<count; i++ )
+    {
+        if( generate( &mazes[i], n, (unsigned int)i + 1, loops ) < 0 ) return -1;
+        grids[i] = malloc( mazes[i].size );
+        if( grids[i] == NULL ) return -1;
+        memcpy( grids[i], mazes[i].maze, mazes[i].size );
+    }
+
+    int rc = 0;
+    if( changes >= 0 )
+    {
+        // Only the size is looked at before mazeDistanceField16 gives up
+        struct Maze large = mazes[0];
+        large.edgeLen = 256;
+        large.size    = 256 * 256;
+        uint16_t none;
+        if( mazeDistanceField16( &large, &none ) != -1 )
+        {
+            fprintf( stderr, "%s: ERROR: mazeDistanceField16 accepted %u squares\n", __FUNCTION__, large.size );
+            rc = -1;
+        }
+
+        uint64_t first = 0, repaired = 0, repairs = 0;
+        for( int i=0; i<count && rc == 0; i++ )
+        {
+            rc = check_fields( &mazes[i], (unsigned int)i + 1 );
+            if( rc == 0 ) rc = check_lpa( &mazes[i], changes, (unsigned int)i + 1, &first, &repaired, &repairs );
+        }
+        if( rc == 0 )
+        {
+            printf( "LPA*: %d mazes, %.1f squares expanded per first search, %.1f per repair of %" PRIu64 "\n",
+                    count, (double)first / count, repairs ? (double)repaired / repairs : 0.0, repairs );
+        }
+        goto done;
+    }
+
+    MazeSolveStats stats;
+    int found = 0;
+    uint64_t start = now_ns( );
+    for( int i=0; i<count; i++ )
+    {
+        found += mazeSolveWith( &mazes[i], solver, NULL, &stats );
+    }
+    report( "sequential", count, found, now_ns( ) - start );
+
+    reset( mazes, grids, count );
+    MazeScratch* scratch = mazeScratchCreate( );
+    found = 0;
+    start = now_ns( );
+    for( int i=0; i<count; i++ )
+    {
+        found += mazeSolveWith( &mazes[i], solver, scratch, &stats );
+    }
+    report( "sequential, scratch", count, found, now_ns( ) - start );
+    mazeScratchDestroy( scratch );
+
+    reset( mazes, grids, count );
+    MazePool* pool = mazePoolCreate( workers, solver );
+    if( pool == NULL )
+    {
+        fprintf( stderr, "%s: ERROR: Could not create the worker pool\n", __FUNCTION__ );
+        return -1;
+    }
+    start = now_ns( );
+    for( int i=0; i<count; i++ )
+    {
+        if( mazePoolSubmit( pool, &mazes[i], NULL ) < 0 ) break;
+    }
+    found = (int)mazePoolWait( pool );
+    char what[32];
+    snprintf( what, sizeof(what), "pool, %d workers", mazePoolWorkers( pool ) );
+    report( what, count, found, now_ns( ) - start );
+    mazePoolDestroy( pool );
+
+done:
+    for( int i=0; i<count; i++ )
+    {
+        free( mazes[i].maze );
+        free( grids[i] );
+    }
+    free( mazes );
+    free( grids );
+    return rc;
+}
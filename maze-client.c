@@ -5,6 +5,7 @@
 
 #include "l4sap.h"
 #include "maze.h"
+#include "prof.h"
 
 #define MAZE_HEADER_LEN (6*sizeof(uint32_t))
 
@@ -16,18 +17,36 @@ static int maxi( int a, int b )
 
 void usage( const char* name )
 {
-    fprintf( stderr, "Usage: %s <serverip> <port> <maze-seed>\n"
+    fprintf( stderr, "Usage: %s <serverip> <port> <maze-seed> [solver] [-t <ticketfile>]\n"
                      "       serverip - IPv4 address of the server in dotted decimal notation\n"
                      "       port     - The server's port\n"
-                     "       maze-seed - random number generator seed\n", name );
+                     "       maze-seed - random number generator seed\n"
+                     "       solver   - optional path search strategy: auto (default),\n"
+                     "                  dfs, wall, deadend or bfs\n"
+                     "       -t       - Keep resumption tickets in ticketfile and send the\n"
+                     "                  request without a handshake round trip when possible\n", name );
     exit( -1 );
 }
 
 int main( int argc, char *argv[] )
 {
-    if( argc != 4 ) usage( argv[0] );
+    const char* ticket_file = NULL;
+    if( argc >= 6 && strcmp( argv[argc-2], "-t" ) == 0 )
+    {
+        ticket_file = argv[argc-1];
+        argc -= 2;
+    }
+    if( argc != 4 && argc != 5 ) usage( argv[0] );
 
-    L4SAP* l4 = l4sap_create( argv[1], atoi(argv[2]) );
+    if( argc == 5 )
+    {
+        int solver = mazeSolverFromName( argv[4] );
+        if( solver < 0 ) usage( argv[0] );
+        mazeSetSolver( (MazeSolver)solver );
+    }
+
+    L4SAP* l4 = ticket_file ? l4sap_create_resume( argv[1], atoi(argv[2]), ticket_file )
+                            : l4sap_create( argv[1], atoi(argv[2]) );
     if( !l4 )
     {
         fprintf( stderr, "%s: Failed to create server\n", __FUNCTION__ );
@@ -36,6 +55,8 @@ int main( int argc, char *argv[] )
 
     long maze_seed = strtol( argv[3], NULL, 10 );
 
+    prof_request_begin( );
+
     char buffer[1024];
     snprintf( buffer, 1024, "MAZE %ld", maze_seed );
 
@@ -97,9 +118,13 @@ int main( int argc, char *argv[] )
                     {
                         memcpy( maze->maze, &buffer[MAZE_HEADER_LEN], maze->size );
 
+                        uint64_t t0 = prof_now( );
                         mazePlot( maze );
+                        prof_add( PROF_PLOT, t0 );
 
+                        t0 = prof_now( );
                         mazeSolve( maze );
+                        prof_add( PROF_SOLVE, t0 );
 
                         uint32_t* header = (uint32_t*)buffer;
                         header[0] = htonl( maze->edgeLen );
@@ -122,6 +147,8 @@ int main( int argc, char *argv[] )
 
     l4sap_send( l4, (uint8_t*)"QUIT", 5 );
 
+    prof_request_end( );
+
     l4sap_destroy( l4 );
 }
 
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "maze.h"
+
+/* Incremental path search with Lifelong Planning A* (Koenig, Likhachev
+ * and Furcy, 2004). The planner keeps g (distance found so far) and rhs
+ * (one-step lookahead) for every square. A wall change only makes its two
+ * squares inconsistent, and the next search only expands squares whose
+ * distance from the start actually changed.
+ * Start and end are fixed for the lifetime of the planner.
+ */
+
+#define LPA_INF      UINT32_MAX
+#define LPA_KEY_INF  UINT64_MAX
+
+static const int lpa_bits[4] = { up, right, down, left };
+static const int lpa_dx[4]   = {  0,     1,    0,   -1 };
+static const int lpa_dy[4]   = { -1,     0,    1,    0 };
+
+struct MazeLPA
+{
+    struct Maze* maze;
+    uint32_t     start;
+    uint32_t     goal;
+
+    uint32_t*    g;
+    uint32_t*    rhs;
+
+    /* binary min-heap of squares, ordered by heap_key; heap_pos[s] is
+     * the position of s in the heap plus 1, or 0 if s is not queued */
+    uint32_t*    heap;
+    uint64_t*    heap_key;
+    uint32_t*    heap_pos;
+    uint32_t     heap_len;
+
+    /* the squares that are currently marked, so that they can be
+     * unmarked when the path changes */
+    uint32_t*    path;
+    uint32_t     path_len;
+
+    uint32_t     expanded;
+};
+
+// Same rule as mazeSolve: both squares must agree that the passage is open
+static int32_t lpa_neighbour( const struct Maze* maze, uint32_t s, int d ) {
+    int n = maze->edgeLen;
+    int nx = (int)(s % n) + lpa_dx[d];
+    int ny = (int)(s / n) + lpa_dy[d];
+    if (!(maze->maze[s] & lpa_bits[d]) || nx < 0 || ny < 0 || nx >= n || ny >= n) {
+        return -1;
+    }
+    if (!(maze->maze[ny * n + nx] & lpa_bits[(d + 2) % 4])) {
+        return -1;
+    }
+    return ny * n + nx;
+}
+
+static uint64_t lpa_key( const MazeLPA* lpa, uint32_t s ) {
+    uint32_t k2 = lpa->g[s] < lpa->rhs[s] ? lpa->g[s] : lpa->rhs[s];
+    if (k2 == LPA_INF) return LPA_KEY_INF;
+
+    int n = lpa->maze->edgeLen;
+    int dx = (int)(s % n) - (int)(lpa->goal % n);
+    int dy = (int)(s / n) - (int)(lpa->goal / n);
+    uint64_t h = (uint64_t)(dx < 0 ? -dx : dx) + (uint64_t)(dy < 0 ? -dy : dy);
+    return ((k2 + h) << 32) | k2;
+}
+
+static void heap_swap( MazeLPA* lpa, uint32_t a, uint32_t b ) {
+    uint32_t s = lpa->heap[a];
+    uint64_t k = lpa->heap_key[a];
+    lpa->heap[a] = lpa->heap[b];
+    lpa->heap_key[a] = lpa->heap_key[b];
+    lpa->heap[b] = s;
+    lpa->heap_key[b] = k;
+    lpa->heap_pos[lpa->heap[a]] = a + 1;
+    lpa->heap_pos[lpa->heap[b]] = b + 1;
+}
+
+static void heap_sift( MazeLPA* lpa, uint32_t i ) {
+    while (i > 0 && lpa->heap_key[(i - 1) / 2] > lpa->heap_key[i]) {
+        heap_swap(lpa, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        uint32_t l = 2 * i + 1;
+        uint32_t smallest = i;
+        if (l < lpa->heap_len && lpa->heap_key[l] < lpa->heap_key[smallest]) smallest = l;
+        if (l + 1 < lpa->heap_len && lpa->heap_key[l + 1] < lpa->heap_key[smallest]) smallest = l + 1;
+        if (smallest == i) break;
+        heap_swap(lpa, i, smallest);
+        i = smallest;
+    }
+}
+
+static void heap_remove( MazeLPA* lpa, uint32_t s ) {
+    uint32_t i = lpa->heap_pos[s] - 1;
+    lpa->heap_len--;
+    if (i != lpa->heap_len) {
+        heap_swap(lpa, i, lpa->heap_len);
+        lpa->heap_pos[s] = 0;
+        heap_sift(lpa, i);
+    } else {
+        lpa->heap_pos[s] = 0;
+    }
+}
+
+static void update_vertex( MazeLPA* lpa, uint32_t s ) {
+    if (s != lpa->start) {
+        uint32_t best = LPA_INF;
+        for (int d = 0; d < 4; d++) {
+            int32_t p = lpa_neighbour(lpa->maze, s, d);
+            if (p >= 0 && lpa->g[p] != LPA_INF && lpa->g[p] + 1 < best) {
+                best = lpa->g[p] + 1;
+            }
+        }
+        lpa->rhs[s] = best;
+    }
+
+    if (lpa->g[s] == lpa->rhs[s]) {
+        if (lpa->heap_pos[s]) heap_remove(lpa, s);
+        return;
+    }
+    if (!lpa->heap_pos[s]) {
+        lpa->heap[lpa->heap_len] = s;
+        lpa->heap_pos[s] = ++lpa->heap_len;
+    }
+    lpa->heap_key[lpa->heap_pos[s] - 1] = lpa_key(lpa, s);
+    heap_sift(lpa, lpa->heap_pos[s] - 1);
+}
+
+static void compute_shortest_path( MazeLPA* lpa ) {
+    uint32_t goal = lpa->goal;
+    while (lpa->heap_len > 0 &&
+           (lpa->heap_key[0] < lpa_key(lpa, goal) || lpa->rhs[goal] != lpa->g[goal])) {
+        uint32_t s = lpa->heap[0];
+        heap_remove(lpa, s);
+        lpa->expanded++;
+
+        if (lpa->g[s] > lpa->rhs[s]) {
+            lpa->g[s] = lpa->rhs[s];
+        } else {
+            lpa->g[s] = LPA_INF;
+            update_vertex(lpa, s);
+        }
+        for (int d = 0; d < 4; d++) {
+            int32_t next = lpa_neighbour(lpa->maze, s, d);
+            if (next >= 0) update_vertex(lpa, next);
+        }
+    }
+}
+
+MazeLPA* mazeLpaCreate( struct Maze* maze ) {
+    if (maze == NULL || maze->maze == NULL || maze->size == 0) {
+        fprintf(stderr, "%s: ERROR: invalid maze\n", __FUNCTION__);
+        return NULL;
+    }
+
+    MazeLPA* lpa = calloc(1, sizeof(MazeLPA));
+    if (lpa == NULL) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        return NULL;
+    }
+    lpa->maze = maze;
+    lpa->start = maze->startY * maze->edgeLen + maze->startX;
+    lpa->goal = maze->endY * maze->edgeLen + maze->endX;
+    lpa->g = malloc(maze->size * sizeof(uint32_t));
+    lpa->rhs = malloc(maze->size * sizeof(uint32_t));
+    lpa->heap = malloc(maze->size * sizeof(uint32_t));
+    lpa->heap_key = malloc(maze->size * sizeof(uint64_t));
+    lpa->heap_pos = calloc(maze->size, sizeof(uint32_t));
+    lpa->path = malloc(maze->size * sizeof(uint32_t));
+    if (!lpa->g || !lpa->rhs || !lpa->heap || !lpa->heap_key || !lpa->heap_pos || !lpa->path) {
+        fprintf(stderr, "%s: ERROR: malloc failed\n", __FUNCTION__);
+        mazeLpaDestroy(lpa);
+        return NULL;
+    }
+
+    memset(lpa->g, 0xff, maze->size * sizeof(uint32_t));
+    memset(lpa->rhs, 0xff, maze->size * sizeof(uint32_t));
+    lpa->rhs[lpa->start] = 0;
+    update_vertex(lpa, lpa->start);
+    return lpa;
+}
+
+void mazeLpaDestroy( MazeLPA* lpa ) {
+    if (lpa == NULL) return;
+    free(lpa->g);
+    free(lpa->rhs);
+    free(lpa->heap);
+    free(lpa->heap_key);
+    free(lpa->heap_pos);
+    free(lpa->path);
+    free(lpa);
+}
+
+void mazeLpaSetWall( MazeLPA* lpa, uint32_t x, uint32_t y, int direction, int open ) {
+    struct Maze* maze = lpa->maze;
+    int d;
+    for (d = 0; d < 4 && lpa_bits[d] != direction; d++);
+    if (d == 4 || x >= maze->edgeLen || y >= maze->edgeLen) {
+        fprintf(stderr, "%s: ERROR: invalid wall (%u, %u, %d)\n", __FUNCTION__, x, y, direction);
+        return;
+    }
+    int nx = (int)x + lpa_dx[d];
+    int ny = (int)y + lpa_dy[d];
+    if (nx < 0 || ny < 0 || nx >= (int)maze->edgeLen || ny >= (int)maze->edgeLen) {
+        return; // the outer wall cannot be opened
+    }
+
+    uint32_t s = y * maze->edgeLen + x;
+    uint32_t t = ny * maze->edgeLen + nx;
+    if (open) {
+        maze->maze[s] |= lpa_bits[d];
+        maze->maze[t] |= lpa_bits[(d + 2) % 4];
+    } else {
+        maze->maze[s] &= ~lpa_bits[d];
+        maze->maze[t] &= ~lpa_bits[(d + 2) % 4];
+    }
+    update_vertex(lpa, s);
+    update_vertex(lpa, t);
+}
+
+int mazeLpaSolve( MazeLPA* lpa ) {
+    lpa->expanded = 0;
+    compute_shortest_path(lpa);
+
+    for (uint32_t i = 0; i < lpa->path_len; i++) {
+        lpa->maze->maze[lpa->path[i]] &= ~mark;
+    }
+    lpa->path_len = 0;
+    if (lpa->g[lpa->goal] == LPA_INF) {
+        return 0;
+    }
+
+    // Walk back from the goal along decreasing g
+    uint32_t s = lpa->goal;
+    lpa->path[lpa->path_len++] = s;
+    while (s != lpa->start && lpa->path_len < lpa->maze->size) {
+        for (int d = 0; d < 4; d++) {
+            int32_t p = lpa_neighbour(lpa->maze, s, d);
+            if (p >= 0 && lpa->g[p] != LPA_INF && lpa->g[p] + 1 == lpa->g[s]) {
+                s = p;
+                break;
+            }
+        }
+        lpa->path[lpa->path_len++] = s;
+    }
+    for (uint32_t i = 0; i < lpa->path_len; i++) {
+        lpa->maze->maze[lpa->path[i]] |= mark;
+    }
+    return s == lpa->start;
+}
+
+uint32_t mazeLpaExpanded( const MazeLPA* lpa ) {
+    return lpa->expanded;
+}
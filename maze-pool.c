@@ -0,0 +1,186 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "maze.h"
+
+/* A work queue of mazes in front of a fixed set of threads. The queue is
+ * a ring buffer that doubles when it is full, protected by one mutex;
+ * a solve takes far longer than taking a job, so the lock is not
+ * contended. Each worker creates its MazeScratch once and solves job
+ * after job with it.
+ */
+
+typedef struct MazePoolJob MazePoolJob;
+struct MazePoolJob
+{
+    struct Maze*    maze;
+    MazeSolveStats* stats;
+};
+
+struct MazePool
+{
+    MazeSolver      solver;
+    int             nworkers;
+    pthread_t*      threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  work;       // a job was queued, or quit was set
+    pthread_cond_t  idle;       // pending dropped to 0
+
+    MazePoolJob*    jobs;
+    uint32_t        capacity;
+    uint32_t        head;       // next job to take
+    uint32_t        count;      // jobs in the queue
+    uint32_t        pending;    // jobs queued or being solved
+    uint32_t        found;      // solved with a path since the last mazePoolWait
+    int             quit;
+};
+
+static void* pool_worker( void* arg ) {
+    MazePool* pool = arg;
+    // If this fails, mazeSolveWith allocates the memory per maze
+    MazeScratch* scratch = mazeScratchCreate();
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->count == 0 && !pool->quit) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->count == 0) break;
+
+        MazePoolJob job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        MazeSolveStats local;
+        int found = mazeSolveWith(job.maze, pool->solver, scratch,
+                                  job.stats ? job.stats : &local);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->found += found;
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    mazeScratchDestroy(scratch);
+    return NULL;
+}
+
+// Called with the lock held. Unwraps the ring into a buffer twice as large.
+static int pool_grow( MazePool* pool ) {
+    uint32_t capacity = pool->capacity ? 2 * pool->capacity : 64;
+    MazePoolJob* jobs = malloc(capacity * sizeof(MazePoolJob));
+    if (jobs == NULL) return -1;
+    for (uint32_t i = 0; i < pool->count; i++) {
+        jobs[i] = pool->jobs[(pool->head + i) % pool->capacity];
+    }
+    free(pool->jobs);
+    pool->jobs = jobs;
+    pool->capacity = capacity;
+    pool->head = 0;
+    return 0;
+}
+
+MazePool* mazePoolCreate( int nworkers, MazeSolver solver ) {
+    if (nworkers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = cpus > 0 ? (int)cpus : 1;
+    }
+
+    MazePool* pool = calloc(1, sizeof(MazePool));
+    if (pool == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for %s.\n", __FUNCTION__);
+        return NULL;
+    }
+    pool->solver = solver;
+    pool->threads = calloc(nworkers, sizeof(pthread_t));
+    if (pool->threads == NULL || pool_grow(pool) < 0) {
+        fprintf(stderr, "Error: Memory allocation failed for %s.\n", __FUNCTION__);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    // The default stack size follows the stack limit of the process
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, MAZE_POOL_STACK_SIZE);
+    for (int i = 0; i < nworkers; i++) {
+        int err = pthread_create(&pool->threads[i], &attr, pool_worker, pool);
+        if (err != 0) {
+            fprintf(stderr, "%s: ERROR: cannot start worker %d: %s\n", __FUNCTION__, i, strerror(err));
+            break;
+        }
+        pool->nworkers++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (pool->nworkers == 0) {
+        mazePoolDestroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int mazePoolSubmit( MazePool* pool, struct Maze* maze, MazeSolveStats* stats ) {
+    if (pool == NULL || maze == NULL || maze->maze == NULL) {
+        fprintf(stderr, "Error: NULL pointer passed to %s.\n", __FUNCTION__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->capacity && pool_grow(pool) < 0) {
+        pthread_mutex_unlock(&pool->lock);
+        fprintf(stderr, "Error: Memory allocation failed for %s.\n", __FUNCTION__);
+        return -1;
+    }
+    pool->jobs[(pool->head + pool->count) % pool->capacity] = (MazePoolJob){ maze, stats };
+    pool->count++;
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+uint32_t mazePoolWait( MazePool* pool ) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    uint32_t found = pool->found;
+    pool->found = 0;
+    pthread_mutex_unlock(&pool->lock);
+    return found;
+}
+
+int mazePoolWorkers( const MazePool* pool ) {
+    return pool->nworkers;
+}
+
+void mazePoolDestroy( MazePool* pool ) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->jobs);
+    free(pool);
+}
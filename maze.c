@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "maze.h"
+#include "probes.h"
 
 // Helper functions
 int is_valid(int x, int y, int n) {
@@ -83,25 +85,502 @@ int dfs(struct Maze* maze, int x, int y, uint8_t* visited) {
     return 0;
 }
 
-// Main function to solve the maze
-void mazeSolve( struct Maze* maze ) {
+// Directions in clockwise order, used by the wall follower
+static const int dir_bits[4] = { up, right, down, left };
+static const int dir_dx[4]   = {  0,     1,    0,   -1 };
+static const int dir_dy[4]   = { -1,     0,    1,    0 };
+
+// Names of the solvers, indexed by MazeSolver
+static const char* solver_names[] = { "dfs", "wall", "deadend", "bfs", "auto" };
+
+static MazeSolver current_solver = MAZE_SOLVER_AUTO;
+static MazeSolveStats last_stats;
+
+/* Memory that DFS and BFS need for one solve. It grows to the largest
+ * maze seen and is reused for the next one, so a thread that solves
+ * many mazes does not allocate per maze.
+ */
+struct MazeScratch
+{
+    uint8_t*  flags;        // visited (DFS) or from (BFS), one byte per square
+    uint32_t* queue;        // BFS queue
+    uint32_t  flags_size;
+    uint32_t  queue_size;
+};
+
+/* Returns the index of the neighbour of (x,y) in direction d (0..3
+ * in clockwise order starting with up), or -1 if there is a wall
+ * in between. Like dfs, both squares must agree that the passage
+ * is open.
+ */
+static int32_t neighbour( const struct Maze* maze, int x, int y, int d ) {
+    int n = maze->edgeLen;
+    int nx = x + dir_dx[d];
+    int ny = y + dir_dy[d];
+    if (!(maze->maze[y * n + x] & dir_bits[d]) || !is_valid(nx, ny, n)) {
+        return -1;
+    }
+    if (!(maze->maze[ny * n + nx] & dir_bits[(d + 2) % 4])) {
+        return -1;
+    }
+    return ny * n + nx;
+}
+
+// Removes the mark bit from every square
+static void clear_marks( struct Maze* maze ) {
+    for (uint32_t i = 0; i < maze->size; i++) {
+        maze->maze[i] &= ~mark;
+    }
+}
+
+/* Checks that the marked squares form exactly one simple path from
+ * start to end. Uses constant memory: the path is walked from the
+ * start, and every step must have exactly one marked neighbour that
+ * we did not come from. The walk must cover all marked squares.
+ */
+static int marks_form_path( const struct Maze* maze ) {
+    uint32_t marked = 0;
+    for (uint32_t i = 0; i < maze->size; i++) {
+        if (maze->maze[i] & mark) marked++;
+    }
+
     int n = maze->edgeLen;
-    uint8_t* visited = calloc(n * n, sizeof(uint8_t));
+    int x = maze->startX;
+    int y = maze->startY;
+    int from = -1;
+    uint32_t len = 1;
+    if (!(maze->maze[y * n + x] & mark)) return 0;
+
+    while (x != (int)maze->endX || y != (int)maze->endY) {
+        int next_dir = -1;
+        for (int d = 0; d < 4; d++) {
+            if (d == from) continue;
+            int32_t next = neighbour(maze, x, y, d);
+            if (next < 0 || !(maze->maze[next] & mark)) continue;
+            if (next_dir >= 0) return 0; // path branches
+            next_dir = d;
+        }
+        if (next_dir < 0 || ++len > marked) return 0;
+        x += dir_dx[next_dir];
+        y += dir_dy[next_dir];
+        from = (next_dir + 2) % 4;
+    }
+    return len == marked;
+}
+
+/* Left-hand wall follower. Apart from the mark bits in the maze itself,
+ * it uses O(1) memory. Squares are marked when they are entered for the
+ * first time; stepping back into a marked square means that we leave a
+ * dead end, so the square we come from is unmarked again. In a perfect
+ * maze, this leaves exactly the direct path from start to end marked.
+ * In mazes with loops the walk may circle without reaching the end; the
+ * number of steps is therefore limited to 4 steps per square, which is
+ * enough to pass through every passage of a perfect maze in both
+ * directions.
+ * Returns 1 if the end was reached, 0 otherwise.
+ */
+static int wall_follow( struct Maze* maze ) {
+    int n = maze->edgeLen;
+    int x = maze->startX;
+    int y = maze->startY;
+    int heading = 0;
+    uint64_t steps = 4 * (uint64_t)maze->size;
+
+    maze->maze[y * n + x] |= mark;
+    while (x != (int)maze->endX || y != (int)maze->endY) {
+        if (steps-- == 0) return 0;
+
+        // Try left, straight, right and back, relative to the heading
+        int d = heading;
+        int32_t next = -1;
+        for (int turn = 3; turn < 7; turn++) {
+            d = (heading + turn) % 4;
+            if ((next = neighbour(maze, x, y, d)) >= 0) break;
+        }
+        if (next < 0) return 0; // start square is walled in
+
+        if (maze->maze[next] & mark) {
+            maze->maze[y * n + x] &= ~mark; // backtracking out of a dead end
+        } else {
+            maze->maze[next] |= mark;
+        }
+        x += dir_dx[d];
+        y += dir_dy[d];
+        heading = d;
+    }
+    return 1;
+}
+
+/* Returns zeroed flags for size squares from the scratch memory, or
+ * NULL if it cannot grow.
+ */
+static uint8_t* scratch_flags( MazeScratch* scratch, uint32_t size ) {
+    if (scratch->flags_size < size) {
+        uint8_t* flags = realloc(scratch->flags, size);
+        if (flags == NULL) return NULL;
+        scratch->flags = flags;
+        scratch->flags_size = size;
+    }
+    memset(scratch->flags, 0, size);
+    return scratch->flags;
+}
+
+static uint32_t* scratch_queue( MazeScratch* scratch, uint32_t size ) {
+    if (scratch->queue_size < size) {
+        uint32_t* queue = realloc(scratch->queue, size * sizeof(uint32_t));
+        if (queue == NULL) return NULL;
+        scratch->queue = queue;
+        scratch->queue_size = size;
+    }
+    return scratch->queue;
+}
+
+static int solve_dfs( struct Maze* maze, MazeScratch* scratch ) {
+    uint8_t* visited = scratch_flags(scratch, maze->size);
     if (visited == NULL) {
         fprintf(stderr, "Error: Memory allocation failed for visited array.\n");
-        return;
+        return 0;
     }
+    return dfs(maze, maze->startX, maze->startY, visited);
+}
 
-    int startX = maze->startX;
-    int startY = maze->startY;
+static int solve_bfs( struct Maze* maze, MazeScratch* scratch );
 
-    // Check for valid start position
-    if (!dfs(maze, startX, startY, visited)) {
-        fprintf(stderr, "No path found from (%d, %d) to (%d, %d)\n", startX, startY, maze->endX, maze->endY);
+static int solve_wallfollow( struct Maze* maze, MazeScratch* scratch, MazeSolveStats* stats ) {
+    if (wall_follow(maze) && marks_form_path(maze)) {
+        return 1;
     }
-    
-    if (visited != NULL) {
-        free(visited);
+    fprintf(stderr, "%s: maze is not perfect, falling back to BFS\n", __FUNCTION__);
+    clear_marks(maze);
+    stats->used = MAZE_SOLVER_BFS;
+    return solve_bfs(maze, scratch);
+}
+
+/* Counts the passages from square (x,y) into squares that do not
+ * carry the tmark bit, but stops counting at 2. Dead-end filling uses
+ * tmark for filled squares and only needs to know if a square is a
+ * dead end.
+ */
+static int open_unfilled( const struct Maze* maze, int x, int y ) {
+    int count = 0;
+    for (int d = 0; d < 4 && count < 2; d++) {
+        int32_t next = neighbour(maze, x, y, d);
+        if (next >= 0 && !(maze->maze[next] & tmark)) count++;
     }
+    return count;
+}
+
+static int is_endpoint( const struct Maze* maze, int x, int y ) {
+    return (x == (int)maze->startX && y == (int)maze->startY) ||
+           (x == (int)maze->endX && y == (int)maze->endY);
 }
 
+/* Dead-end filling. Every square with at most one open passage that is
+ * not start or end is filled (tmark), and the corridor behind it is
+ * followed until a junction is reached. In a perfect maze, the squares
+ * that remain unfilled are exactly the path from start to end. No
+ * memory is needed besides the tmark bits.
+ */
+static int solve_deadend( struct Maze* maze ) {
+    int n = maze->edgeLen;
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            int cx = x;
+            int cy = y;
+            while (!(maze->maze[cy * n + cx] & tmark) &&
+                   !is_endpoint(maze, cx, cy) &&
+                   open_unfilled(maze, cx, cy) <= 1) {
+                maze->maze[cy * n + cx] |= tmark;
+
+                // Continue into the corridor that led to this dead end
+                for (int d = 0; d < 4; d++) {
+                    int32_t next = neighbour(maze, cx, cy, d);
+                    if (next >= 0 && !(maze->maze[next] & tmark)) {
+                        cx += dir_dx[d];
+                        cy += dir_dy[d];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < maze->size; i++) {
+        if (maze->maze[i] & tmark) {
+            maze->maze[i] &= ~tmark;
+        } else {
+            maze->maze[i] |= mark;
+        }
+    }
+    return marks_form_path(maze);
+}
+
+/* Iterative breadth-first search. from[] stores the direction that
+ * leads back to the square we came from (plus 1, 0 is unvisited), so
+ * the shortest path can be marked by walking back from the end.
+ */
+static int solve_bfs( struct Maze* maze, MazeScratch* scratch ) {
+    int n = maze->edgeLen;
+    uint8_t* from = scratch_flags(scratch, maze->size);
+    uint32_t* queue = scratch_queue(scratch, maze->size);
+    if (from == NULL || queue == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for BFS.\n");
+        return 0;
+    }
+
+    uint32_t start = maze->startY * n + maze->startX;
+    uint32_t end = maze->endY * n + maze->endX;
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    queue[tail++] = start;
+    from[start] = 0xff; // visited, no predecessor
+
+    while (head < tail && from[end] == 0) {
+        uint32_t cur = queue[head++];
+        int x = cur % n;
+        int y = cur / n;
+        for (int d = 0; d < 4; d++) {
+            int32_t next = neighbour(maze, x, y, d);
+            if (next >= 0 && from[next] == 0) {
+                from[next] = (uint8_t)((d + 2) % 4 + 1);
+                queue[tail++] = next;
+            }
+        }
+    }
+
+    int found = from[end] != 0;
+    if (found) {
+        uint32_t cur = end;
+        maze->maze[cur] |= mark;
+        while (cur != start) {
+            int d = from[cur] - 1;
+            cur = (cur / n + dir_dy[d]) * n + (cur % n + dir_dx[d]);
+            maze->maze[cur] |= mark;
+        }
+    }
+    return found;
+}
+
+/* Breadth-first pass behind mazeDistanceField and mazeDistanceField16.
+ * Every square enters the frontier queue exactly once, so the queue is a
+ * plain array that is written and read sequentially, one level after the
+ * other. Neighbours are found with index offsets instead of coordinates.
+ * Only one of dist32 and dist16 is used.
+ */
+static int distance_field( const struct Maze* maze, uint32_t* dist32, uint16_t* dist16 ) {
+    uint32_t n = maze->edgeLen;
+    uint32_t size = maze->size;
+    const char* cells = maze->maze;
+    uint32_t* queue = malloc(size * sizeof(uint32_t));
+    if (queue == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for distance field.\n");
+        return -1;
+    }
+    if (dist32) memset(dist32, 0xff, size * sizeof(uint32_t));
+    if (dist16) memset(dist16, 0xff, size * sizeof(uint16_t));
+
+    uint32_t start = maze->startY * n + maze->startX;
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    uint32_t level_end = 1;
+    uint32_t level = 0;
+    queue[tail++] = start;
+    if (dist32) dist32[start] = 0;
+    if (dist16) dist16[start] = 0;
+
+    while (head < tail) {
+        if (head == level_end) {
+            level++;
+            level_end = tail;
+        }
+        uint32_t cur = queue[head++];
+        uint32_t x = cur % n;
+        int bits = cells[cur];
+        uint32_t next[4];
+        int count = 0;
+        if ((bits & left) && x > 0 && (cells[cur - 1] & right)) next[count++] = cur - 1;
+        if ((bits & right) && x + 1 < n && (cells[cur + 1] & left)) next[count++] = cur + 1;
+        if ((bits & up) && cur >= n && (cells[cur - n] & down)) next[count++] = cur - n;
+        if ((bits & down) && cur + n < size && (cells[cur + n] & up)) next[count++] = cur + n;
+
+        for (int i = 0; i < count; i++) {
+            if (dist32) {
+                if (dist32[next[i]] != MAZE_DIST_UNREACHABLE) continue;
+                dist32[next[i]] = level + 1;
+            } else {
+                if (dist16[next[i]] != MAZE_DIST16_UNREACHABLE) continue;
+                dist16[next[i]] = (uint16_t)(level + 1);
+            }
+            queue[tail++] = next[i];
+        }
+    }
+    free(queue);
+    return (int)tail;
+}
+
+int mazeDistanceField( const struct Maze* maze, uint32_t* dist ) {
+    if (maze == NULL || maze->maze == NULL || dist == NULL) {
+        fprintf(stderr, "Error: NULL pointer passed to %s.\n", __FUNCTION__);
+        return -1;
+    }
+    return distance_field(maze, dist, NULL);
+}
+
+int mazeDistanceField16( const struct Maze* maze, uint16_t* dist ) {
+    if (maze == NULL || maze->maze == NULL || dist == NULL) {
+        fprintf(stderr, "Error: NULL pointer passed to %s.\n", __FUNCTION__);
+        return -1;
+    }
+    if (maze->size >= MAZE_DIST16_UNREACHABLE) {
+        fprintf(stderr, "Error: maze with %u squares is too large for 16-bit distances.\n", maze->size);
+        return -1;
+    }
+    return distance_field(maze, NULL, dist);
+}
+
+/* The cheap pre-pass of MAZE_SOLVER_AUTO. It counts the passages (each
+ * one only once, to the right and down) and the dead ends in at most
+ * MAZE_AUTO_SAMPLE_ROWS evenly spaced rows, and extrapolates to the
+ * whole maze. A perfect maze has size-1 passages, so more than that
+ * means loops. A few loops can be missed by sampling, which is why
+ * the solvers for perfect mazes check their result.
+ */
+static void collect_stats( const struct Maze* maze, MazeSolveStats* stats ) {
+    uint32_t n = maze->edgeLen;
+    uint32_t step = (n + MAZE_AUTO_SAMPLE_ROWS - 1) / MAZE_AUTO_SAMPLE_ROWS;
+    uint32_t rows = 0;
+    for (uint32_t y = 0; y < n; y += step, rows++) {
+        const char* cell = &maze->maze[y * n];
+        for (uint32_t x = 0; x < n; x++, cell++) {
+            int bits = *cell & (left | right | up | down);
+            if ((bits & (bits - 1)) == 0 && bits != 0) stats->deadEnds++;
+            if ((bits & right) && x + 1 < n && (cell[1] & left)) stats->passages++;
+            if ((bits & down) && y + 1 < n && (cell[n] & up)) stats->passages++;
+        }
+    }
+    if (rows < n) {
+        // The last row has no passages down, sampled rows nearly all do
+        stats->deadEnds = (uint32_t)((uint64_t)stats->deadEnds * n / rows);
+        stats->passages = (uint32_t)((uint64_t)stats->passages * (n - 1) / rows);
+        // Allow 1% sampling error before assuming loops
+        stats->hasLoops = stats->passages + 1 > maze->size + maze->size / 100;
+    } else {
+        stats->hasLoops = stats->passages + 1 > maze->size;
+    }
+}
+
+/* Small mazes are solved fastest with DFS. For perfect mazes, the wall
+ * follower touches every square at most a few times and needs no
+ * memory at all, which made it faster than both dead-end filling
+ * (which must visit every square) and BFS in measurements. Mazes with
+ * loops need BFS.
+ */
+static MazeSolver choose_solver( const struct Maze* maze, MazeSolveStats* stats ) {
+    collect_stats(maze, stats);
+    if (maze->size <= MAZE_AUTO_DFS_MAX_SIZE) return MAZE_SOLVER_DFS;
+    if (!stats->hasLoops) return MAZE_SOLVER_WALLFOLLOW;
+    return MAZE_SOLVER_BFS;
+}
+
+void mazeSetSolver( MazeSolver solver ) {
+    current_solver = solver;
+}
+
+const MazeSolveStats* mazeSolveStats( void ) {
+    return &last_stats;
+}
+
+int mazeSolverFromName( const char* name ) {
+    if (name == NULL) return -1;
+    for (int i = 0; i <= MAZE_SOLVER_AUTO; i++) {
+        if (strcmp(name, solver_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+MazeScratch* mazeScratchCreate( void ) {
+    MazeScratch* scratch = calloc(1, sizeof(MazeScratch));
+    if (scratch == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for %s.\n", __FUNCTION__);
+    }
+    return scratch;
+}
+
+void mazeScratchDestroy( MazeScratch* scratch ) {
+    if (scratch == NULL) return;
+    free(scratch->flags);
+    free(scratch->queue);
+    free(scratch);
+}
+
+int mazeSolveWith( struct Maze* maze, MazeSolver solver, MazeScratch* scratch, MazeSolveStats* stats ) {
+    if (maze == NULL || maze->maze == NULL || stats == NULL) {
+        fprintf(stderr, "Error: NULL pointer passed to %s.\n", __FUNCTION__);
+        return 0;
+    }
+
+    // Without scratch memory from the caller, it only lives for this call
+    MazeScratch local = { 0 };
+    MazeScratch* mem = scratch ? scratch : &local;
+
+    PROBE2(maze_solve_start, maze->size, solver);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->size = maze->size;
+    stats->requested = solver;
+    stats->used = solver;
+    if (solver == MAZE_SOLVER_AUTO) {
+        stats->used = choose_solver(maze, stats);
+    }
+
+    int found;
+    switch (stats->used) {
+    case MAZE_SOLVER_WALLFOLLOW:
+        found = solve_wallfollow(maze, mem, stats);
+        break;
+    case MAZE_SOLVER_DEADEND:
+        found = solve_deadend(maze);
+        if (!found) {
+            fprintf(stderr, "%s: dead-end filling left no single path, falling back to BFS\n", __FUNCTION__);
+            clear_marks(maze);
+            stats->used = MAZE_SOLVER_BFS;
+            found = solve_bfs(maze, mem);
+        }
+        break;
+    case MAZE_SOLVER_BFS:
+        found = solve_bfs(maze, mem);
+        break;
+    case MAZE_SOLVER_DFS:
+    default:
+        found = solve_dfs(maze, mem);
+        break;
+    }
+    stats->found = found;
+    PROBE2(maze_solve_end, found, stats->used);
+
+    if (scratch == NULL) {
+        free(local.flags);
+        free(local.queue);
+    }
+    return found;
+}
+
+// Main function to solve the maze
+void mazeSolve( struct Maze* maze ) {
+    if (maze == NULL || maze->maze == NULL) {
+        fprintf(stderr, "Error: NULL pointer passed to mazeSolve.\n");
+        return;
+    }
+
+    int found = mazeSolveWith(maze, current_solver, NULL, &last_stats);
+    if (current_solver == MAZE_SOLVER_AUTO) {
+        fprintf(stderr, "%s: size %u, %u passages, %u dead ends, %s, used solver %s\n",
+                __FUNCTION__, last_stats.size, last_stats.passages, last_stats.deadEnds,
+                last_stats.hasLoops ? "loops" : "no loops", solver_names[last_stats.used]);
+    }
+
+    if (!found) {
+        fprintf(stderr, "No path found from (%d, %d) to (%d, %d)\n",
+                maze->startX, maze->startY, maze->endX, maze->endY);
+    }
+}
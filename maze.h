@@ -13,6 +13,70 @@
 
 typedef struct Maze Maze;
 
+/* The path search strategies that mazeSolve can use.
+ * MAZE_SOLVER_DFS is the recursive depth-first search with a
+ * visited array of one byte per square.
+ * MAZE_SOLVER_WALLFOLLOW walks along the left-hand wall and needs
+ * no memory beyond a few local variables, the backtracks are pruned
+ * from the path while walking. It is only guaranteed to find the
+ * path in perfect mazes (no loops); if the walk or the resulting
+ * path is not valid, mazeSolve falls back to MAZE_SOLVER_BFS.
+ * MAZE_SOLVER_DEADEND fills all dead ends, using the tmark bit, until
+ * only the path remains. It is meant for perfect mazes and falls back
+ * to MAZE_SOLVER_BFS otherwise.
+ * MAZE_SOLVER_BFS is an iterative breadth-first search that finds the
+ * shortest path also in mazes with loops.
+ * MAZE_SOLVER_AUTO looks at cheap statistics of the maze first and
+ * picks one of the others.
+ */
+typedef enum MazeSolver
+{
+    MAZE_SOLVER_DFS = 0,
+    MAZE_SOLVER_WALLFOLLOW,
+    MAZE_SOLVER_DEADEND,
+    MAZE_SOLVER_BFS,
+    MAZE_SOLVER_AUTO
+} MazeSolver;
+
+/* Mazes up to this number of squares are solved with DFS by
+ * MAZE_SOLVER_AUTO. The recursion depth of DFS grows with the
+ * path length, which limits it to small mazes.
+ */
+#define MAZE_AUTO_DFS_MAX_SIZE  (128*128)
+
+/* The pre-pass of MAZE_SOLVER_AUTO looks at no more than this number
+ * of rows of the maze.
+ */
+#define MAZE_AUTO_SAMPLE_ROWS   64
+
+/* Statistics about the last call to mazeSolve.
+ * The pre-pass of MAZE_SOLVER_AUTO fills passages, deadEnds and
+ * hasLoops, estimated from sampled rows in large mazes; the other
+ * solvers leave them at 0.
+ */
+typedef struct MazeSolveStats MazeSolveStats;
+
+struct MazeSolveStats
+{
+    uint32_t   size;
+
+    /* number of open passages between two squares */
+    uint32_t   passages;
+
+    /* number of squares with exactly one open passage */
+    uint32_t   deadEnds;
+
+    /* a connected maze without loops has exactly size-1 passages */
+    int        hasLoops;
+
+    /* the solver that was requested, and the one that produced the
+     * result after decisions and fallbacks */
+    MazeSolver requested;
+    MazeSolver used;
+
+    int        found;
+};
+
 struct Maze
 {
     /* number of squares in horizontal or vertical direction */
@@ -63,5 +127,109 @@ void mazePlot( const struct Maze* maze );
  */
 void mazeSolve( struct Maze* maze );
 
+/* Select the strategy that mazeSolve uses for all following calls.
+ * The default is MAZE_SOLVER_AUTO.
+ */
+void mazeSetSolver( MazeSolver solver );
+
+/* Returns the statistics of the last call to mazeSolve.
+ */
+const MazeSolveStats* mazeSolveStats( void );
+
+/* Translate a solver name ("dfs", "wall", "deadend", "bfs", "auto")
+ * into a MazeSolver.
+ * Returns -1 if the name is unknown.
+ */
+int mazeSolverFromName( const char* name );
+
+/* Solving without global state, for threads that solve mazes at the
+ * same time. mazeSolveWith solves maze like mazeSolve with the given
+ * solver, writes the statistics into stats and returns 1 if a path was
+ * found. It does not print the choice of MAZE_SOLVER_AUTO.
+ * A MazeScratch holds the memory that DFS and BFS need and keeps it for
+ * the next maze; it must only be used by one thread at a time. With
+ * scratch == NULL, the memory is allocated for this call only.
+ */
+typedef struct MazeScratch MazeScratch;
+
+MazeScratch* mazeScratchCreate( void );
+void         mazeScratchDestroy( MazeScratch* scratch );
+
+int mazeSolveWith( struct Maze* maze, MazeSolver solver, MazeScratch* scratch, MazeSolveStats* stats );
+
+/* A pool of worker threads for solving many mazes. mazePoolSubmit
+ * queues a maze, and the next idle worker solves it with mazeSolveWith
+ * and its own MazeScratch. Every maze is solved by one thread, so the
+ * throughput of a batch grows with the number of workers whatever the
+ * size of the mazes. A maze and its stats must not be touched until
+ * mazePoolWait returns.
+ * Workers need a stack for the recursion of DFS; MAZE_POOL_STACK_SIZE
+ * is enough for the mazes that MAZE_SOLVER_AUTO gives to DFS.
+ */
+#define MAZE_POOL_STACK_SIZE  (8 * 1024 * 1024)
+
+typedef struct MazePool MazePool;
+
+/* Starts nworkers threads, or one per online CPU if nworkers <= 0.
+ * All mazes are solved with solver.
+ */
+MazePool* mazePoolCreate( int nworkers, MazeSolver solver );
+
+/* Queues maze. If stats is not NULL, the statistics of the solve are
+ * written there. Returns 0, or -1 if the queue cannot grow.
+ */
+int  mazePoolSubmit( MazePool* pool, struct Maze* maze, MazeSolveStats* stats );
+
+/* Blocks until all mazes submitted so far are solved. Returns the
+ * number of them in which a path was found.
+ */
+uint32_t mazePoolWait( MazePool* pool );
+
+int  mazePoolWorkers( const MazePool* pool );
+
+/* Solves the mazes that are still queued and stops the workers. */
+void mazePoolDestroy( MazePool* pool );
+
+/* Distance fields: one breadth-first pass from (startX,startY) that
+ * writes the number of steps from the start to every square into dist,
+ * which must have room for maze->size entries. Squares that cannot be
+ * reached get MAZE_DIST_UNREACHABLE (or MAZE_DIST16_UNREACHABLE).
+ * The 16-bit variant halves the memory traffic and only works for
+ * mazes with fewer than 65535 squares.
+ * Both return the number of reachable squares, or -1 on error.
+ */
+#define MAZE_DIST_UNREACHABLE    UINT32_MAX
+#define MAZE_DIST16_UNREACHABLE  UINT16_MAX
+
+int mazeDistanceField( const struct Maze* maze, uint32_t* dist );
+int mazeDistanceField16( const struct Maze* maze, uint16_t* dist );
+
+/* Incremental re-solving for mazes whose walls change.
+ * A MazeLPA keeps the search state of Lifelong Planning A* next to a
+ * Maze. After the first mazeLpaSolve, walls can be opened or closed with
+ * mazeLpaSetWall, and the following mazeLpaSolve repairs the marked path
+ * with work that is proportional to the region where distances from the
+ * start changed, instead of searching the whole maze again.
+ * Start and end must not change while the planner exists. The planner
+ * needs about 24 bytes per square.
+ */
+typedef struct MazeLPA MazeLPA;
+
+MazeLPA* mazeLpaCreate( struct Maze* maze );
+void     mazeLpaDestroy( MazeLPA* lpa );
+
+/* Open (open != 0) or close the wall of square (x,y) in the given
+ * direction (left, right, up or down). Both squares are updated.
+ */
+void     mazeLpaSetWall( MazeLPA* lpa, uint32_t x, uint32_t y, int direction, int open );
+
+/* Search or repair the path and set the mark bit on it; the marks of
+ * the previous path are removed. Returns 1 if a path exists.
+ */
+int      mazeLpaSolve( MazeLPA* lpa );
+
+/* Number of squares expanded by the last mazeLpaSolve. */
+uint32_t mazeLpaExpanded( const MazeLPA* lpa );
+
 #endif
 
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "l4mcast.h"
+
+/* Multicasts messages of the given size with L4Mcast and reports the
+ * sender's cost, or receives and checks them with -r. Start the
+ * receivers first.
+ */
+
+void usage( const char* name )
+{
+    fprintf( stderr, "Usage: %s <group> <port> <ifaddr> <kbytes> [<count>]\n"
+                     "       %s -r <group> <port> <ifaddr> [<count>]\n"
+                     "       group    - IPv4 multicast address, e.g. 239.0.0.1\n"
+                     "       port     - The group's port\n"
+                     "       ifaddr   - Address of the interface to use, e.g. 127.0.0.1\n"
+                     "       kbytes   - Size of each message in KB\n"
+                     "       count    - Number of messages (default 1)\n",
+                     name, name );
+    exit( -1 );
+}
+
+static uint8_t pattern( uint32_t i )
+{
+    return (uint8_t)(i % 251);
+}
+
+static double cpu_sec( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_receiver( const char* group, int port, const char* ifaddr, int count )
+{
+    L4Mcast* mc = l4mcast_receiver_create( group, port, ifaddr );
+    if( !mc ) return -1;
+
+    int failed = 0;
+    for( int n=0; n<count; n++ )
+    {
+        uint8_t* data;
+        struct timeval timeout = { 10, 0 };
+        int len = l4mcast_recv( mc, &data, &timeout );
+        if( len <= 0 )
+        {
+            printf( "message %d: timeout\n", n );
+            failed++;
+            break;
+        }
+
+        uint32_t bad = 0;
+        for( uint32_t i=0; i<(uint32_t)len; i++ )
+        {
+            if( data[i] != pattern( i ) ) bad++;
+        }
+        printf( "message %d: %d bytes, %u wrong\n", n, len, bad );
+        fflush( stdout );
+        free( data );
+    }
+
+    l4mcast_destroy( mc );
+    return failed ? -1 : 0;
+}
+
+int main( int argc, char *argv[] )
+{
+    if( argc >= 5 && strcmp( argv[1], "-r" ) == 0 )
+    {
+        if( argc > 6 ) usage( argv[0] );
+        return run_receiver( argv[2], atoi( argv[3] ), argv[4], argc == 6 ? atoi( argv[5] ) : 1 );
+    }
+    if( argc != 5 && argc != 6 ) usage( argv[0] );
+
+    uint32_t len   = (uint32_t)atoi( argv[4] ) * 1024;
+    int      count = argc == 6 ? atoi( argv[5] ) : 1;
+    if( len == 0 || len > L4_MCAST_MAX_MSG || count < 1 ) usage( argv[0] );
+
+    uint8_t* data = malloc( len );
+    if( !data ) {
+        fprintf( stderr, "Failed to allocate %u bytes\n", len );
+        return -1;
+    }
+    for( uint32_t i=0; i<len; i++ ) data[i] = pattern( i );
+
+    L4Mcast* mc = l4mcast_sender_create( argv[1], atoi( argv[2] ), argv[3] );
+    if( !mc ) {
+        fprintf( stderr, "Failed to create sender\n" );
+        return -1;
+    }
+
+    double cpu = cpu_sec( );
+    for( int n=0; n<count; n++ )
+    {
+        if( l4mcast_send( mc, data, len ) < 0 ) return -1;
+    }
+    cpu = cpu_sec( ) - cpu;
+    printf( "%d messages of %u bytes: %.1f ms CPU, %" PRIu64 " frames, %" PRIu64 " NACKs, %" PRIu64 " repairs\n",
+            count, len, cpu * 1000, mc->stats.data_sent, mc->stats.nacks, mc->stats.repairs );
+
+    l4mcast_destroy( mc );
+    free( data );
+    return 0;
+}
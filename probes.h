@@ -0,0 +1,34 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT static tracepoints for perf and bpftrace.
+ *
+ * The probes belong to the provider "udpmaze" and are listed with
+ *     perf list 'sdt_udpmaze:*'          (after perf buildid-cache --add)
+ *     bpftrace -l 'usdt:./maze-client:*'
+ *
+ * Probe                  Arguments
+ * l2_frame_send          payload length
+ * l2_frame_recv          payload length
+ * l2_checksum_fail       received checksum, calculated checksum
+ * l4_retransmit          seqno, attempt
+ * l4_ack                 ackno
+ * l4_shed                seqno of a DATA frame refused by admission control
+ * maze_solve_start       maze size, requested solver
+ * maze_solve_end         found, solver used
+ *
+ * A probe is a single nop instruction until a tracer attaches to it.
+ * When <sys/sdt.h> (systemtap-sdt-dev) is not available, CMake does
+ * not define HAVE_SYS_SDT_H and the probes are compiled out.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)    DTRACE_PROBE1(udpmaze, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(udpmaze, name, a, b)
+#else
+#define PROBE1(name, a)    do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#endif
+
+#endif /* PROBES_H */
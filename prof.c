@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "prof.h"
+
+static const char* stage_names[PROF_NSTAGES] = {
+    "checksum", "copy", "syscall", "wait", "mazeSolve", "mazePlot"
+};
+
+/* Counters of the request in progress. Threads that work for the
+ * request, e.g. the stripe threads of L4Bulk, add to them at the same
+ * time, so they are only changed atomically.
+ */
+static uint64_t current[PROF_NSTAGES];
+static uint64_t current_start;
+static int      in_request;
+
+// Sums over all finished requests
+static uint64_t total[PROF_NSTAGES];
+static uint64_t total_request;
+static uint64_t requests;
+
+static int      exit_report_registered;
+
+static void report_at_exit( void ) {
+    prof_report(stderr);
+}
+
+void prof_add( ProfStage stage, uint64_t start ) {
+    __atomic_fetch_add(&current[stage], prof_now() - start, __ATOMIC_RELAXED);
+}
+
+void prof_request_begin( void ) {
+    if (!exit_report_registered) {
+        exit_report_registered = 1;
+        atexit(report_at_exit);
+    }
+    if (in_request) prof_request_end();
+    for (int i = 0; i < PROF_NSTAGES; i++) {
+        __atomic_store_n(&current[i], 0, __ATOMIC_RELAXED);
+    }
+    in_request = 1;
+    current_start = prof_now();
+}
+
+void prof_request_end( void ) {
+    if (!in_request) return;
+    total_request += prof_now() - current_start;
+    for (int i = 0; i < PROF_NSTAGES; i++) {
+        total[i] += __atomic_exchange_n(&current[i], 0, __ATOMIC_RELAXED);
+    }
+    requests++;
+    in_request = 0;
+}
+
+void prof_report( FILE* out ) {
+    if (requests == 0) return;
+
+    uint64_t covered = 0;
+    fprintf(out, "Time per request (%" PRIu64 " requests, in %s):\n", requests, PROF_UNIT);
+    fprintf(out, "  %-10s %14s %14s %7s\n", "stage", "total", "per request", "share");
+    for (int i = 0; i < PROF_NSTAGES; i++) {
+        covered += total[i];
+        fprintf(out, "  %-10s %14" PRIu64 " %14" PRIu64 " %6.1f%%\n",
+                stage_names[i], total[i], total[i] / requests,
+                total_request ? 100.0 * total[i] / total_request : 0.0);
+    }
+    uint64_t other = total_request > covered ? total_request - covered : 0;
+    fprintf(out, "  %-10s %14" PRIu64 " %14" PRIu64 " %6.1f%%\n",
+            "other", other, other / requests,
+            total_request ? 100.0 * other / total_request : 0.0);
+    fprintf(out, "  %-10s %14" PRIu64 " %14" PRIu64 "\n",
+            "request", total_request, total_request / requests);
+}
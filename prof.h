@@ -0,0 +1,67 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROF_UNIT "cycles"
+#else
+#define PROF_UNIT "ns"
+#endif
+
+/* Lightweight accounting of where the time of a request goes.
+ *
+ * Code that belongs to a pipeline stage takes a timestamp with
+ * prof_now() before the stage and calls prof_add() afterwards.
+ * The time is added to the current request. prof_request_begin()
+ * and prof_request_end() bracket one request of the application
+ * (e.g. one MAZE request of maze-client); at the end of a request
+ * its counters are added to the totals.
+ *
+ * The breakdown is printed to stderr when the program exits, or
+ * earlier with prof_report().
+ *
+ * prof_add may be called from any thread; the requests are begun and
+ * ended by one thread.
+ *
+ * On x86 the counters are TSC cycles, read with rdtsc; elsewhere
+ * they are nanoseconds from CLOCK_MONOTONIC.
+ */
+typedef enum ProfStage
+{
+    PROF_CHECKSUM = 0,   /* L2 checksum computation */
+    PROF_COPY,           /* memset/memcpy of frames and payloads */
+    PROF_SYSCALL,        /* sendto, recvmsg */
+    PROF_WAIT,           /* blocking in select for the peer */
+    PROF_SOLVE,          /* mazeSolve */
+    PROF_PLOT,           /* mazePlot */
+    PROF_NSTAGES
+} ProfStage;
+
+static inline uint64_t prof_now( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/* Add the time since start to the given stage of the current request. */
+void prof_add( ProfStage stage, uint64_t start );
+
+/* Starting a request ends the one that is still in progress. */
+void prof_request_begin( void );
+void prof_request_end( void );
+
+/* Print the per-stage totals, the average per request and the share of
+ * the request time, and the time that is not covered by any stage.
+ */
+void prof_report( FILE* out );
+
+#endif /* PROF_H */
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "l4server.h"
+
+/* Answers any number of transport-test-clients on one port: every
+ * message goes back to its sender, PULL <bytes> is answered with that
+ * many bytes in full frames, and QUIT or a PULL of more than
+ * MUX_MAX_PULL bytes ends the session. With -q, the frames of a PULL
+ * are queued as fast as the client takes them, see l4server_queue.
+ */
+
+#define MUX_MAX_PULL (16L << 20)
+
+static uint8_t filler[L4Payloadsize];
+
+void usage( const char* name )
+{
+    fprintf( stderr, "Usage: %s [-b] [-a] [-q] [-w <us>] <port> [<connections> [<buffers>]]\n"
+                     "       -b          - Bundle ACKs with the answers for clients that agree\n"
+                     "       -a          - Refuse messages when they queue for too long (admission control)\n"
+                     "       -q          - Queue the answers for the egress scheduler instead of waiting\n"
+                     "                     for each ACK\n"
+                     "       -w us       - Spend us microseconds on every message, to simulate work\n"
+                     "       port        - This server's port\n"
+                     "       connections - Maximum number of clients (default 100000)\n"
+                     "       buffers     - Payload buffers shared by all clients (default 64)\n" , name );
+    exit( -1 );
+}
+
+/* Sends or queues one frame of an answer, and closes the connection if
+ * that fails for another reason than an expired deadline.
+ */
+static int answer( L4Server* server, uint32_t conn, const uint8_t* data, int len, int queueing )
+{
+    int sent = queueing ? l4server_queue( server, conn, data, len )
+                        : l4server_send( server, conn, data, len );
+    if( sent < 0 && sent != L4_EXPIRED && sent != L4_WOULD_BLOCK ) l4server_close( server, conn );
+    return sent;
+}
+
+/* Sends or queues the frames that conn still gets for its PULL, until
+ * its queue is full.
+ */
+static void fill( L4Server* server, uint32_t conn, long* pull_left, int queueing )
+{
+    while( pull_left[conn] > 0 )
+    {
+        int chunk = pull_left[conn] < L4Payloadsize ? (int)pull_left[conn] : L4Payloadsize;
+        int sent = answer( server, conn, filler, chunk, queueing );
+        if( sent == L4_WOULD_BLOCK ) return;
+        if( sent < 0 )
+        {
+            pull_left[conn] = 0;
+            return;
+        }
+        pull_left[conn] -= sent;
+    }
+}
+
+int main( int argc, char *argv[] )
+{
+    int bundling  = 0;
+    int admission = 0;
+    int queueing  = 0;
+    int work_us   = 0;
+    int a = 1;
+    while( a < argc && argv[a][0] == '-' )
+    {
+        if( strcmp( argv[a], "-b" ) == 0 ) bundling = 1;
+        else if( strcmp( argv[a], "-a" ) == 0 ) admission = 1;
+        else if( strcmp( argv[a], "-q" ) == 0 ) queueing = 1;
+        else if( strcmp( argv[a], "-w" ) == 0 && a + 1 < argc ) work_us = atoi( argv[++a] );
+        else usage( argv[0] );
+        a++;
+    }
+    if( argc - a < 1 || argc - a > 3 ) usage( argv[0] );
+
+    int      port    = atoi( argv[a] );
+    uint32_t conns   = argc > a+1 ? (uint32_t)atoi( argv[a+1] ) : 100000;
+    uint32_t buffers = argc > a+2 ? (uint32_t)atoi( argv[a+2] ) : 64;
+
+    L4Server* server = l4server_create( port, conns, buffers );
+    if( !server )
+    {
+        fprintf( stderr, "%s: Failed to create server\n", __FUNCTION__ );
+        return -1;
+    }
+    l4server_set_bundling( server, bundling );
+    if( admission ) l4server_set_admission( server, L4_CODEL_TARGET_US, L4_CODEL_INTERVAL_US );
+    printf( "%u connections and %u buffers in %zu bytes, %zu bytes per connection\n",
+            conns, buffers, l4server_memory( server ), sizeof(L4Conn) );
+    fflush( stdout );
+
+    /* What each connection still gets for its PULL */
+    long* pull_left = calloc( conns, sizeof(long) );
+    if( !pull_left )
+    {
+        fprintf( stderr, "%s: Failed to allocate the PULL state\n", __FUNCTION__ );
+        l4server_destroy( server );
+        return -1;
+    }
+    memset( filler, 'x', sizeof(filler) );
+
+    uint8_t buffer[L4Payloadsize];
+    while( 1 )
+    {
+        uint32_t conn;
+        int len = l4server_recv( server, &conn, buffer, sizeof(buffer), NULL );
+        if( len == L4_WRITABLE )
+        {
+            fill( server, conn, pull_left, queueing );
+            continue;
+        }
+        if( len == L4_QUIT )
+        {
+            pull_left[conn] = 0;
+            printf( "connection %u reset, %u open\n", conn, server->nconns );
+            continue;
+        }
+        if( len <= 0 ) continue;
+
+        if( len >= 4 && memcmp( buffer, "QUIT", 4 ) == 0 )
+        {
+            pull_left[conn] = 0;
+            l4server_close( server, conn );
+            printf( "connection %u done, %u open\n", conn, server->nconns );
+            fflush( stdout );
+            continue;
+        }
+        int64_t left_us = l4server_time_left( server, conn );
+        if( left_us >= 0 && left_us < work_us )
+        {
+            continue; /* the client gives up before the answer is ready */
+        }
+        if( work_us > 0 ) usleep( work_us );
+
+        long pull = -1;
+        if( len > 5 && memcmp( buffer, "PULL ", 5 ) == 0 )
+        {
+            char arg[32];
+            int  n = len - 5 < (int)sizeof(arg) - 1 ? len - 5 : (int)sizeof(arg) - 1;
+            memcpy( arg, buffer + 5, n );
+            arg[n] = 0;
+            pull = strtol( arg, NULL, 10 );
+        }
+        if( pull < 0 )
+        {
+            answer( server, conn, buffer, len, queueing );
+            continue;
+        }
+        if( pull > MUX_MAX_PULL )
+        {
+            l4server_close( server, conn );
+            printf( "connection %u refused a PULL of %ld bytes, %u open\n", conn, pull, server->nconns );
+            fflush( stdout );
+            continue;
+        }
+        pull_left[conn] = pull;
+        fill( server, conn, pull_left, queueing );
+    }
+
+    free( pull_left );
+    l4server_destroy( server );
+    return 0;
+}
@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <unistd.h>
 
 #include "l4sap.h"
+#include "prof.h"
 
 static int maxi( int a, int b )
 {
@@ -13,28 +15,79 @@ static int maxi( int a, int b )
 
 void usage( const char* name )
 {
-    fprintf( stderr, "Usage: %s <serverip> <port>\n"
+    fprintf( stderr, "Usage: %s <serverip> <port> [-b] [-t <ticketfile>] [-d <ms>] [-p <bytes>]\n"
                      "       serverip - IPv4 address of the server in dotted decimal notation\n"
-                     "       port     - The server's port\n" , name );
+                     "       port     - The server's port\n"
+                     "       -b       - Bundle ACKs with the next message if the server agrees\n"
+                     "       -t       - Keep resumption tickets in ticketfile and send the first\n"
+                     "                  message without a handshake round trip when possible\n"
+                     "       -d       - Give up when the answer to a message takes longer than ms\n"
+                     "       -p       - Pull bytes from a transport-mux-server before the messages\n" , name );
     exit( -1 );
 }
 
 
 int main( int argc, char *argv[] )
 {
-    if( argc != 3 ) usage( argv[0] );
+    if( argc < 3 ) usage( argv[0] );
 
-    L4SAP* l4 = l4sap_create( argv[1], atoi(argv[2]) );
+    int bundling = 0;
+    const char* ticket_file = NULL;
+    uint32_t    budget_ms   = 0;
+    long        pull        = 0;
+    for( int a=3; a<argc; a++ )
+    {
+        if( strcmp( argv[a], "-b" ) == 0 ) bundling = 1;
+        else if( strcmp( argv[a], "-t" ) == 0 && a+1 < argc ) ticket_file = argv[++a];
+        else if( strcmp( argv[a], "-d" ) == 0 && a+1 < argc ) budget_ms = (uint32_t)atoi( argv[++a] );
+        else if( strcmp( argv[a], "-p" ) == 0 && a+1 < argc ) pull = atol( argv[++a] );
+        else usage( argv[0] );
+    }
+    srand( getpid() );
+
+    L4SAP* l4 = ticket_file ? l4sap_create_resume( argv[1], atoi(argv[2]), ticket_file )
+                            : l4sap_create( argv[1], atoi(argv[2]) );
     if( !l4 )
     {
         fprintf( stderr, "%s: Failed to create server\n", __FUNCTION__ );
         return -1;
     }
+    if( bundling && !l4sap_set_bundling( l4, 1 ) )
+    {
+        fprintf( stderr, "%s: The server does not accept bundles\n", __FUNCTION__ );
+    }
+
+    if( pull > 0 )
+    {
+        uint8_t data[L4Payloadsize];
+        snprintf( (char*)data, sizeof(data), "PULL %ld", pull );
+        if( l4sap_send( l4, data, strlen((char*)data)+1 ) < 0 )
+        {
+            fprintf( stderr, "%s: Send failed. Giving up.\n", __FUNCTION__ );
+            l4sap_destroy( l4 );
+            exit( -1 );
+        }
+        for( long got = 0; got < pull; )
+        {
+            int retval = l4sap_recv( l4, data, sizeof(data) );
+            if( retval < 0 )
+            {
+                fprintf( stderr, "%s: Pull failed after %ld bytes\n", __FUNCTION__, got );
+                l4sap_destroy( l4 );
+                exit( -1 );
+            }
+            got += retval;
+        }
+        fprintf( stderr, "%s: Pulled %ld bytes\n", __FUNCTION__, pull );
+    }
 
     for( int i=0; i<20; i++ )
     {
         fprintf( stderr, "\n%s: Round %d\n\n", __FUNCTION__, i );
 
+        prof_request_begin( );
+        l4sap_set_deadline( l4, budget_ms );
+
         char buffer[1024];
         snprintf( buffer, 1024, "This is message %d from the client to the server.", i );
 
@@ -43,7 +96,16 @@ int main( int argc, char *argv[] )
         fprintf( stderr, "%s: Client sends: '%s' and %d bytes\n", __FUNCTION__, buffer, len );
 
         int retval = l4sap_send( l4, (uint8_t*)buffer, len );
-        if( retval == L4_SEND_FAILED )
+        for( int busy = 0; retval == L4_SERVER_BUSY && busy < 10; busy++ )
+        {
+            /* Wait as long as the server asks, plus up to half of that
+             * again so that the refused clients do not return together.
+             */
+            unsigned wait_ms = l4->busy_retry_ms + rand() % (l4->busy_retry_ms / 2 + 1);
+            usleep( wait_ms * 1000 );
+            retval = l4sap_send( l4, (uint8_t*)buffer, len );
+        }
+        if( retval == L4_SEND_FAILED || retval == L4_EXPIRED )
         {
             fprintf( stderr, "%s: Send failed. Giving up.\n", __FUNCTION__ );
             l4sap_destroy( l4 );
@@ -71,6 +133,12 @@ int main( int argc, char *argv[] )
             l4sap_destroy( l4 );
             exit( -1 );
         }
+        else if( retval == L4_EXPIRED )
+        {
+            fprintf( stderr, "%s: No answer within %u ms. Giving up.\n", __FUNCTION__, budget_ms );
+            l4sap_destroy( l4 );
+            exit( -1 );
+        }
         else if( retval < 0 )
         {
             fprintf( stderr, "%s: Failed to receive data (error)\n", __FUNCTION__ );
@@ -86,6 +154,9 @@ int main( int argc, char *argv[] )
         }
     }
 
+    prof_request_end( );
+
+    l4sap_set_deadline( l4, 0 );
     l4sap_send( l4, (uint8_t*)"QUIT", 5 );
 
     l4sap_destroy( l4 );